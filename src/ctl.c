@@ -0,0 +1,620 @@
+/* ctl.c: the binary control socket, for programs to drive the simulator.
+ * Copyright  2015 Jack Morton <jhm@jemscout.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "postel.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <math.h>
+#include <signal.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <glib.h>
+#include <uv.h>
+
+extern struct global_state_struct postel;
+G_LOCK_EXTERN(postel);
+
+/* With -u, the simulator listens on a Unix domain socket for programs to
+ * drive it in a binary protocol, in host byte order. A request is a header of
+ * a 32 bit payload length, a 16 bit op, 16 bits of zero and a 64 bit tag,
+ * followed by the payload, a multiple of 8 bytes long. Each op works on a
+ * vector of items, under a single lock:
+ *
+ *   add    items of two doubles, x then y. Replies with the id of each node
+ *          added, or -1, all in one update of the index when worth it.
+ *   move   items of a 64 bit id and two doubles, x then y. Replies with 0 or
+ *          -1 for each.
+ *   del    items of a 64 bit id. Replies with 0 or -1 for each.
+ *   sibs   items of a 64 bit id. Replies for each with the number of nodes in
+ *          range, or -1, followed by their ids, all 64 bits.
+ *   stats  no items. Replies with the number of nodes, of links, the
+ *          simulated time in nanoseconds, the events waiting, the requests
+ *          served and the clients connected, all 64 bits.
+ *
+ * A reply is a header of the same layout, with the op, a 16 bit status and
+ * the tag of its request, followed by its payload. An add or a move with a
+ * coordinate that isn't finite is refused whole, with CTL_EINVAL. Requests
+ * may be pipelined: every whole request read is run in order, and their
+ * replies go out in one write. A client isn't read from while its replies
+ * back up, and a request too long or not a multiple of 8 bytes closes the
+ * connection. Payloads stay 8 byte aligned in the buffers, and are used in
+ * place.
+ *
+ * sibs and stats only read nodes, and run on the thread pool, holding
+ * node_head for reading, alongside the snapshot and other queries. The
+ * client waits for its query, unread, so that its replies stay in order. */
+#define CTL_MAX_REQUEST (64 * 1024 * 1024)  /* Most bytes of payload */
+#define CTL_BACKLOG (16 * 1024 * 1024)      /* Reply bytes unwritten */
+#define CTL_BLOCK 65536     /* Least size of a buffer */
+#define CTL_MIN_READ 4096   /* Least room offered to each read */
+#define CTL_LISTEN 16
+
+enum ctl_op {
+  CTL_ADD = 1,
+  CTL_MOVE,
+  CTL_DEL,
+  CTL_SIBS,
+  CTL_STATS
+};
+
+enum ctl_status {
+  CTL_OK,
+  CTL_EINVAL,  /* The payload isn't a whole number of items, or a
+                  coordinate isn't finite */
+  CTL_EOP,     /* No such op */
+  CTL_ENOMEM
+};
+
+struct ctl_header {
+  uint32_t len;
+  uint16_t op, status;
+  uint64_t tag;
+};
+
+struct ctl_move {
+  int64_t id;
+  double x, y;
+};
+
+struct ctl_client {
+  LIST_ENTRY(ctl_client) clients;
+  uv_pipe_t pipe;
+  char *in, *out;
+  size_t in_start, in_len, in_cap;
+  size_t out_len, out_cap;  /* Replies not yet handed to a write */
+  uv_work_t work;           /* A query on the thread pool */
+  struct ctl_header req;    /* Its request */
+  size_t nodes, links;      /* Counted by a stats query */
+  int err;                  /* Of the query */
+  int reading, busy;
+  int closed;               /* While busy */
+};
+
+/* A write of replies, holding their buffer */
+struct ctl_write {
+  uv_write_t req;
+  struct ctl_client *client;
+  char *buf;
+};
+
+static uv_pipe_t ctl_server;
+static char *ctl_path;
+static LIST_HEAD(, ctl_client) ctl_clients = \
+  LIST_HEAD_INITIALIZER(ctl_clients);
+static size_t ctl_connected;
+static uint64_t ctl_served;
+
+static void ctl_read_cb(uv_stream_t *stream, ssize_t nread, \
+  const uv_buf_t *buf);
+static void ctl_parse(struct ctl_client *c);
+
+static void ctl_close_cb(uv_handle_t *handle)
+{
+  struct ctl_client *c = handle->data;
+
+  /* Freed once its query is done */
+  if (c->busy) {
+    c->closed = TRUE;
+    return;
+  }
+  free(c->in);
+  free(c->out);
+  free(c);
+}
+
+static void ctl_close(struct ctl_client *c)
+{
+  if (uv_is_closing((uv_handle_t *)&c->pipe))
+    return;
+  LIST_REMOVE(c, clients);
+  ctl_connected--;
+  uv_close((uv_handle_t *)&c->pipe, &ctl_close_cb);
+}
+
+static size_t ctl_backlog(struct ctl_client *c)
+{
+  return uv_stream_get_write_queue_size((uv_stream_t *)&c->pipe);
+}
+
+/* Offer the free end of the input buffer, moving the unparsed bytes to its
+ * start once it can't hold the rest of the request at its end */
+static void ctl_alloc_cb(uv_handle_t *handle, size_t suggested_size, \
+  uv_buf_t *buf)
+{
+  struct ctl_client *c = handle->data;
+  size_t left = c->in_len - c->in_start, want = sizeof(struct ctl_header);
+  struct ctl_header hdr;
+  char *in;
+
+  if (left >= sizeof(hdr)) {
+    memcpy(&hdr, c->in + c->in_start, sizeof(hdr));
+    want += MIN(hdr.len, CTL_MAX_REQUEST);
+  }
+  if (c->in_cap - c->in_len >= CTL_MIN_READ && c->in_start + want <= c->in_cap)
+    goto peace;
+  if (left)
+    memmove(c->in, c->in + c->in_start, left);
+  c->in_start = 0;
+  c->in_len = left;
+  if (c->in_cap - left < MAX(want - MIN(want, left), CTL_MIN_READ)) {
+    want = MAX(CTL_BLOCK, MAX(want, left) + CTL_MIN_READ);
+    if (!(in = realloc(c->in, want))) {
+      *buf = uv_buf_init(NULL, 0);
+      return;
+    }
+    c->in = in;
+    c->in_cap = want;
+  }
+
+peace:
+  *buf = uv_buf_init(c->in + c->in_len, c->in_cap - c->in_len);
+}
+
+/* Returns NULL on failure, room for len more bytes of replies on success */
+static void *ctl_grow(struct ctl_client *c, size_t len)
+{
+  size_t cap;
+  char *out;
+
+  if (c->out_cap - c->out_len < len) {
+    cap = MAX(c->out_cap * 2, MAX(c->out_len + len, CTL_BLOCK));
+    if (!(out = realloc(c->out, cap)))
+      return NULL;
+    c->out = out;
+    c->out_cap = cap;
+  }
+  out = c->out + c->out_len;
+  c->out_len += len;
+  return out;
+}
+
+/* Returns NULL on failure, the payload of a reply of len bytes on success */
+static void *ctl_reply(struct ctl_client *c, const struct ctl_header *req, \
+  enum ctl_status status, size_t len)
+{
+  struct ctl_header *rep = ctl_grow(c, sizeof(struct ctl_header) + len);
+
+  if (!rep)
+    return NULL;
+  rep->len = len;
+  rep->op = req->op;
+  rep->status = status;
+  rep->tag = req->tag;
+  return rep + 1;
+}
+
+/* The reply for each node is its count of siblings and their ids. Returns
+ * -1 on failure, 0 on success */
+static int ctl_sibs(struct ctl_client *c, const struct ctl_header *req, \
+  const int64_t *ids, size_t n)
+{
+  size_t i, off = c->out_len;
+  int64_t *out;
+  struct node *nodep;
+  struct sibling *sibp;
+
+  if (!ctl_reply(c, req, CTL_OK, 0))
+    return -1;
+  NODE_READ_LOCK();
+  for (i = 0; i < n; i++) {
+    nodep = find_node(ids[i]);
+    if (!(out = ctl_grow(c, (1 + (nodep ? nodep->sib_count : 0)) * \
+      sizeof(int64_t)))) {
+      NODE_READ_UNLOCK();
+      c->out_len = off;
+      return -1;
+    }
+    *out++ = nodep ? (int64_t)nodep->sib_count : -1;
+    if (!nodep)
+      continue;
+    LIST_FOREACH(sibp, &nodep->siblings, sibs)
+      *out++ = sibp->node->id;
+  }
+  NODE_READ_UNLOCK();
+  ((struct ctl_header *)(c->out + off))->len = \
+    c->out_len - off - sizeof(struct ctl_header);
+  return 0;
+}
+
+/* Returns FALSE if any of the n doubles at stride apart isn't finite, TRUE
+ * otherwise */
+static int ctl_finite(const char *payload, size_t n, size_t stride)
+{
+  size_t i;
+  double v;
+
+  for (i = 0; i < n; i++) {
+    memcpy(&v, payload + i * stride, sizeof(v));
+    if (!isfinite(v))
+      return FALSE;
+  }
+  return TRUE;
+}
+
+/* On the thread pool */
+static void ctl_query(uv_work_t *req)
+{
+  struct ctl_client *c = req->data;
+
+  if (c->req.op == CTL_SIBS) {
+    c->err = ctl_sibs(c, &c->req, (const int64_t *)(c->in + c->in_start + \
+      sizeof(struct ctl_header)), c->req.len / sizeof(int64_t));
+    return;
+  }
+  NODE_READ_LOCK();
+  c->nodes = count_nodes(&c->links);
+  NODE_READ_UNLOCK();
+  c->err = 0;
+}
+
+static void ctl_resume(struct ctl_client *c);
+
+/* Reply to the query, and carry on with the requests after it */
+static void ctl_queried(uv_work_t *req, int status)
+{
+  struct ctl_client *c = req->data;
+  uint64_t *stats, now, until;
+  size_t events;
+
+  c->busy = FALSE;
+  if (c->closed) {
+    ctl_close_cb((uv_handle_t *)&c->pipe);
+    return;
+  }
+  if (!status && !c->err && c->req.op == CTL_STATS) {
+    if ((stats = ctl_reply(c, &c->req, CTL_OK, 6 * sizeof(uint64_t)))) {
+      get_clock(&now, &until, &events);
+      stats[0] = c->nodes;
+      stats[1] = c->links;
+      stats[2] = now;
+      stats[3] = events;
+      stats[4] = ctl_served;
+      stats[5] = ctl_connected;
+    }
+    else {
+      c->err = -1;
+    }
+  }
+  if ((status || c->err) && !ctl_reply(c, &c->req, CTL_ENOMEM, 0)) {
+    ctl_close(c);
+    return;
+  }
+  c->in_start += sizeof(struct ctl_header) + c->req.len;
+  ctl_parse(c);
+  ctl_resume(c);
+}
+
+/* Run a request, and queue its reply, or hand a query to the thread pool.
+ * Returns -1 on failure (to queue the reply), 1 if the query was handed on,
+ * 0 on success */
+static int ctl_run(struct ctl_client *c, const struct ctl_header *req, \
+  const char *payload)
+{
+  size_t i, n = 0, item = 0;
+  int64_t *res;
+  struct ctl_move mv;
+  struct node *nodep;
+
+  ctl_served++;
+  switch (req->op) {
+    case CTL_ADD:
+      item = 2 * sizeof(double);
+      break;
+    case CTL_MOVE:
+      item = sizeof(struct ctl_move);
+      break;
+    case CTL_DEL:
+    case CTL_SIBS:
+      item = sizeof(int64_t);
+      break;
+    case CTL_STATS:
+      break;
+    default:
+      return ctl_reply(c, req, CTL_EOP, 0) ? 0 : -1;
+  }
+  if (item) {
+    if (req->len % item)
+      return ctl_reply(c, req, CTL_EINVAL, 0) ? 0 : -1;
+    n = req->len / item;
+  }
+  if ((req->op == CTL_ADD && !ctl_finite(payload, 2 * n, sizeof(double))) || \
+    (req->op == CTL_MOVE && (!ctl_finite(payload + \
+    offsetof(struct ctl_move, x), n, item) || !ctl_finite(payload + \
+    offsetof(struct ctl_move, y), n, item))))
+    return ctl_reply(c, req, CTL_EINVAL, 0) ? 0 : -1;
+
+  switch (req->op) {
+    case CTL_ADD:
+      if (!(res = ctl_reply(c, req, CTL_OK, n * sizeof(int64_t))))
+        break;
+      NODE_LOCK();
+      if (add_nodes((const double *)payload, n, res) < 0) {
+        for (i = 0; i < n; i++)
+          res[i] = -1;
+      }
+      NODE_UNLOCK();
+      return 0;
+    case CTL_MOVE:
+      if (!(res = ctl_reply(c, req, CTL_OK, n * sizeof(int64_t))))
+        break;
+      NODE_LOCK();
+      for (i = 0; i < n; i++) {
+        memcpy(&mv, payload + i * item, sizeof(mv));
+        nodep = find_node(mv.id);
+        res[i] = (nodep && !move_node(nodep, mv.x, mv.y)) ? 0 : -1;
+      }
+      NODE_UNLOCK();
+      return 0;
+    case CTL_DEL:
+      if (!(res = ctl_reply(c, req, CTL_OK, n * sizeof(int64_t))))
+        break;
+      NODE_LOCK();
+      for (i = 0; i < n; i++)
+        res[i] = del_node(((const int64_t *)payload)[i]);
+      NODE_UNLOCK();
+      return 0;
+    case CTL_SIBS:
+    case CTL_STATS:
+      c->req = *req;
+      c->work.data = c;
+      if (uv_queue_work(c->pipe.loop, &c->work, &ctl_query, &ctl_queried))
+        break;
+      c->busy = TRUE;
+      return 1;
+  }
+  return ctl_reply(c, req, CTL_ENOMEM, 0) ? 0 : -1;
+}
+
+static void ctl_write_cb(uv_write_t *req, int status)
+{
+  struct ctl_write *w = (struct ctl_write *)req;
+  struct ctl_client *c = w->client;
+
+  free(w->buf);
+  free(w);
+  if (status < 0) {
+    ctl_close(c);
+    return;
+  }
+  ctl_resume(c);
+}
+
+/* Read on, unless a query is running or replies back up */
+static void ctl_resume(struct ctl_client *c)
+{
+  if (c->reading || c->busy || uv_is_closing((uv_handle_t *)&c->pipe) || \
+    ctl_backlog(c) > CTL_BACKLOG)
+    return;
+  if (uv_read_start((uv_stream_t *)&c->pipe, &ctl_alloc_cb, &ctl_read_cb))
+    ctl_close(c);
+  else
+    c->reading = TRUE;
+}
+
+/* Write every reply queued, and stop reading while they back up */
+static void ctl_flush(struct ctl_client *c)
+{
+  uv_buf_t buf = uv_buf_init(c->out, c->out_len);
+  struct ctl_write *w;
+
+  if (!c->out_len)
+    return;
+  if (!(w = malloc(sizeof(struct ctl_write)))) {
+    ctl_close(c);
+    return;
+  }
+  /* The write holds the buffer from here on */
+  w->client = c;
+  w->buf = c->out;
+  c->out = NULL;
+  c->out_len = c->out_cap = 0;
+  if (uv_write(&w->req, (uv_stream_t *)&c->pipe, &buf, 1, &ctl_write_cb)) {
+    free(w->buf);
+    free(w);
+    ctl_close(c);
+    return;
+  }
+  if (c->reading && ctl_backlog(c) > CTL_BACKLOG) {
+    uv_read_stop((uv_stream_t *)&c->pipe);
+    c->reading = FALSE;
+  }
+}
+
+/* Run every whole request read, up to a query handed to the thread pool. A
+ * partial request waits in the buffer for the rest of it. */
+static void ctl_parse(struct ctl_client *c)
+{
+  struct ctl_header hdr;
+  int rv;
+
+  if (uv_is_closing((uv_handle_t *)&c->pipe))
+    return;
+  while (c->in_len - c->in_start >= sizeof(hdr)) {
+    memcpy(&hdr, c->in + c->in_start, sizeof(hdr));
+    if (hdr.len > CTL_MAX_REQUEST || hdr.len % 8) {
+      fprintf(stderr, "A control client sent a request of %" PRIu32 \
+        " bytes, the most is %d, in multiples of 8.\n", hdr.len, \
+        CTL_MAX_REQUEST);
+      ctl_close(c);
+      return;
+    }
+    if (c->in_len - c->in_start - sizeof(hdr) < hdr.len)
+      break;
+    /* The replies before a query go out first, as it adds to them */
+    if (hdr.op == CTL_SIBS || hdr.op == CTL_STATS)
+      ctl_flush(c);
+    if ((rv = ctl_run(c, &hdr, c->in + c->in_start + sizeof(hdr))) < 0) {
+      ctl_close(c);
+      return;
+    }
+    if (rv > 0) {
+      /* Nothing is read into the buffer until the query is done */
+      if (c->reading)
+        uv_read_stop((uv_stream_t *)&c->pipe);
+      c->reading = FALSE;
+      return;
+    }
+    c->in_start += sizeof(hdr) + hdr.len;
+  }
+  ctl_flush(c);
+}
+
+static void ctl_read_cb(uv_stream_t *stream, ssize_t nread, \
+  const uv_buf_t *buf)
+{
+  struct ctl_client *c = stream->data;
+
+  if (nread == 0)
+    return;
+  if (nread < 0) {
+    if (nread != UV_EOF)
+      fprintf(stderr, "Unable to read from a control client: %s\n", \
+        uv_strerror(nread));
+    ctl_close(c);
+    return;
+  }
+  c->in_len += nread;
+  ctl_parse(c);
+}
+
+static void ctl_connect_cb(uv_stream_t *server, int status)
+{
+  struct ctl_client *c;
+
+  if (status < 0) {
+    fprintf(stderr, "Unable to accept a control client: %s\n", \
+      uv_strerror(status));
+    return;
+  }
+  if (!(c = calloc(1, sizeof(struct ctl_client)))) {
+    fprintf(stderr, "Unable to accept a control client: out of memory\n");
+    return;
+  }
+  uv_pipe_init(server->loop, &c->pipe, 0);
+  c->pipe.data = c;
+  LIST_INSERT_HEAD(&ctl_clients, c, clients);
+  ctl_connected++;
+  if (uv_accept(server, (uv_stream_t *)&c->pipe) || \
+    uv_read_start((uv_stream_t *)&c->pipe, &ctl_alloc_cb, &ctl_read_cb)) {
+    ctl_close(c);
+    return;
+  }
+  c->reading = TRUE;
+}
+
+/* Close every client and the socket */
+void shutdown_control(void)
+{
+  while (!LIST_EMPTY(&ctl_clients))
+    ctl_close(LIST_FIRST(&ctl_clients));
+  if (!ctl_path)
+    return;
+  uv_close((uv_handle_t *)&ctl_server, NULL);
+  unlink(ctl_path);
+  g_free(ctl_path);
+  ctl_path = NULL;
+}
+
+/* Returns -1 on failure (the path is in use), 0 on success */
+static int ctl_take_path(const char *path)
+{
+  struct sockaddr_un sun;
+  struct stat st;
+  int fd, err = 0;
+
+  if (lstat(path, &st) || !S_ISSOCK(st.st_mode))
+    return 0;
+  if (strlen(path) >= sizeof(sun.sun_path))
+    return -1;
+  if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+    return -1;
+  memset(&sun, 0, sizeof(sun));
+  sun.sun_family = AF_UNIX;
+  strcpy(sun.sun_path, path);
+  /* A socket still listened on belongs to a running simulator */
+  if (!connect(fd, (struct sockaddr *)&sun, sizeof(sun))) {
+    fprintf(stderr, "Another simulator listens on %s\n", path);
+    err = -1;
+  }
+  else if (errno != ECONNREFUSED) {
+    err = -1;
+  }
+  else if (unlink(path)) {
+    err = -1;
+  }
+  close(fd);
+  return err;
+}
+
+/* Listen on the control socket, if there's one. Returns -1 on failure, 0 on
+ * success */
+int init_control(uv_loop_t *loop)
+{
+  const char *path;
+
+  G_LOCK(postel);
+  path = postel.control;
+  G_UNLOCK(postel);
+  if (!path)
+    return 0;
+
+  /* A client gone before its replies are written mustn't kill us */
+  signal(SIGPIPE, SIG_IGN);
+  /* A socket left behind by an earlier run is taken over */
+  if (ctl_take_path(path))
+    return -1;
+  uv_pipe_init(loop, &ctl_server, 0);
+  if (uv_pipe_bind(&ctl_server, path) || uv_listen((uv_stream_t *)&ctl_server, \
+    CTL_LISTEN, &ctl_connect_cb)) {
+    uv_close((uv_handle_t *)&ctl_server, NULL);
+    return -1;
+  }
+  ctl_path = g_strdup(path);
+  return 0;
+}
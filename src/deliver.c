@@ -0,0 +1,231 @@
+/* deliver.c: fan out of frames from a node to its siblings.
+ * Copyright  2015 Jack Morton <jhm@jemscout.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "postel.h"
+
+#include <stdlib.h>
+#include <math.h>
+#include <glib.h>
+#include <uv.h>
+
+extern struct global_state_struct postel;
+G_LOCK_EXTERN(postel);
+
+/* A frame is read once, into a block shared by every frame of that read, and
+ * is never copied again on its way through the simulator: each sibling queues
+ * a reference to the bytes of the frame, length included, and holds the block
+ * until its transport is done with them. Frames queued to a node during one
+ * turn of the loop are flushed together once every read of that turn is done,
+ * with a single writev on a FIFO. Blocks are only touched from the loop of the
+ * simulator thread, so their counts need no atomics.
+ *
+ * When frames travel at a finite speed, each sibling is reached after the
+ * distance between the nodes as the frame was sent, over the speed, on the
+ * simulated clock. */
+static uv_check_t deliver_watcher;
+static struct proc_list deliver_head = LIST_HEAD_INITIALIZER(deliver_head);
+
+/* A frame in flight to a sibling, holding its block */
+struct deliver_delay {
+  struct frame_block *block;
+  char *frame;
+  size_t len;
+  int64_t from;
+  int64_t to;  /* The id of the sibling, which may be gone on arrival */
+};
+static struct pool delay_pool;
+
+/* Returns NULL on failure, a block of cap bytes and one reference on success */
+struct frame_block *frame_alloc(size_t cap)
+{
+  struct frame_block *block = malloc(sizeof(struct frame_block) + cap);
+
+  if (block) {
+    block->refs = 1;
+    block->cap = cap;
+  }
+  return block;
+}
+
+void frame_ref(struct frame_block *block)
+{
+  block->refs++;
+}
+
+void frame_unref(struct frame_block *block)
+{
+  if (block && !--block->refs)
+    free(block);
+}
+
+/* LOCK node_head BEFORE CALLING THIS FUNCTION! */
+/* Queue a frame from the node of id from for the next flush. The frame is
+ * dropped, as a radio would drop it, while the node is too far behind
+ * reading. Returns -1 on failure (or a drop), 0 on success */
+static int deliver_queue(struct proc *proc, int64_t from, \
+  struct frame_block *block, char *frame, size_t len)
+{
+  size_t cap;
+  uv_buf_t *out;
+  struct frame_block **blocks;
+
+  if (proc->closed || \
+    proc->out_bytes + len + proc->ops->backlog(proc) > MAX_FRAME_QUEUE)
+    goto drop;
+  if (proc->out_n == proc->out_cap) {
+    cap = proc->out_cap ? proc->out_cap * 2 : 16;
+    if (!(out = realloc(proc->out, cap * sizeof(uv_buf_t))))
+      goto drop;
+    proc->out = out;
+    if (!(blocks = realloc(proc->out_blocks, \
+      cap * sizeof(struct frame_block *))))
+      goto drop;
+    proc->out_blocks = blocks;
+    proc->out_cap = cap;
+  }
+  if (!proc->out_n)
+    LIST_INSERT_HEAD(&deliver_head, proc, pending);
+  frame_ref(block);
+  proc->out[proc->out_n] = uv_buf_init(frame, len);
+  proc->out_blocks[proc->out_n++] = block;
+  proc->out_bytes += len;
+  trace_frame(TRACE_RX, from, proc->id, len);
+  count_metric(METRIC_FRAMES_DELIVERED, 1);
+  return 0;
+
+drop:
+  trace_frame(TRACE_DROP, from, proc->id, len);
+  count_metric(METRIC_FRAMES_DROPPED, 1);
+  return -1;
+}
+
+static void deliver_delay_drop(void *arg)
+{
+  struct deliver_delay *delay = arg;
+
+  frame_unref(delay->block);
+  pool_free(&delay_pool, delay);
+}
+
+/* A frame arrives at a sibling */
+static void deliver_delay_cb(void *arg)
+{
+  struct deliver_delay *delay = arg;
+  struct node *nodep;
+
+  NODE_LOCK();
+  nodep = find_node(delay->to);
+  if (nodep && nodep->proc)
+    deliver_queue(nodep->proc, delay->from, delay->block, delay->frame, \
+      delay->len);
+  NODE_UNLOCK();
+  deliver_delay_drop(delay);
+}
+
+/* LOCK node_head BEFORE CALLING THIS FUNCTION! */
+/* Hand a frame transmitted by a node, with its length, to every sibling that
+ * runs a process. The frame lies within block. */
+void deliver_frame(struct node *nodep, struct frame_block *block, \
+  char *frame, size_t len)
+{
+  double speed, dist_x, dist_y;
+  struct sibling *sibp;
+  struct deliver_delay *delay;
+
+  G_LOCK(postel);
+  speed = postel.prop_speed;
+  G_UNLOCK(postel);
+
+  trace_frame(TRACE_TX, nodep->id, -1, len);
+  count_metric(METRIC_FRAMES_SENT, 1);
+  LIST_FOREACH(sibp, &nodep->siblings, sibs) {
+    if (!sibp->node->proc)
+      continue;
+    if (speed <= 0.0) {
+      deliver_queue(sibp->node->proc, nodep->id, block, frame, len);
+      continue;
+    }
+    if (!(delay = pool_alloc(&delay_pool)))
+      continue;
+    frame_ref(block);
+    delay->block = block;
+    delay->frame = frame;
+    delay->len = len;
+    delay->from = nodep->id;
+    delay->to = sibp->node->id;
+    dist_x = nodep->x - sibp->node->x;
+    dist_y = nodep->y - sibp->node->y;
+    if (!sched_in((uint64_t)(sqrt(dist_x * dist_x + dist_y * dist_y) / \
+      speed * 1e9), &deliver_delay_cb, &deliver_delay_drop, delay))
+      deliver_delay_drop(delay);
+  }
+}
+
+/* LOCK node_head BEFORE CALLING THIS FUNCTION! */
+/* Drop the frames queued to a node, and release their arrays */
+void deliver_drop(struct proc *proc)
+{
+  size_t i;
+
+  if (proc->out_n)
+    LIST_REMOVE(proc, pending);
+  for (i = 0; i < proc->out_n; i++)
+    frame_unref(proc->out_blocks[i]);
+  free(proc->out);
+  free(proc->out_blocks);
+  proc->out = NULL;
+  proc->out_blocks = NULL;
+  proc->out_n = proc->out_cap = proc->out_bytes = 0;
+}
+
+/* Flush every queued frame, with one flush per node */
+static void deliver_flush_cb(uv_check_t *handle)
+{
+  struct proc *proc;
+
+  NODE_LOCK();
+  while (!LIST_EMPTY(&deliver_head)) {
+    proc = LIST_FIRST(&deliver_head);
+    LIST_REMOVE(proc, pending);
+    proc->ops->flush(proc);
+    proc->out_n = proc->out_bytes = 0;
+  }
+  NODE_UNLOCK();
+}
+
+/* Frames still in flight must have been cancelled first */
+void shutdown_deliver(void)
+{
+  uv_check_stop(&deliver_watcher);
+  shutdown_pool(&delay_pool);
+}
+
+/* Returns -1 on failure, 0 on success */
+int init_deliver(uv_loop_t *loop)
+{
+  if (init_pool(&delay_pool, "delivery", sizeof(struct deliver_delay), FALSE))
+    return -1;
+  uv_check_init(loop, &deliver_watcher);
+  /* Flushing alone shouldn't keep the loop running */
+  uv_unref((uv_handle_t *)&deliver_watcher);
+  return uv_check_start(&deliver_watcher, &deliver_flush_cb) ? -1 : 0;
+}
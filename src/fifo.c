@@ -0,0 +1,239 @@
+/* fifo.c: the named pipe transport of node processes.
+ * Copyright  2015 Jack Morton <jhm@jemscout.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "postel.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+#include <glib.h>
+#include <uv.h>
+
+/* The node runs as "file id in out", where in and out are the paths of two
+ * FIFOs: the node reads the frames it receives from in, and writes the frames
+ * it transmits to out. The simulator opens its end of both FIFOs read and
+ * write, so that no open blocks waiting on the node, and services them as
+ * non-blocking pipes. Frames are read into blocks, which are handed to
+ * deliver.c without a copy. */
+#define FIFO_BLOCK 16384    /* Least size of a read block */
+#define FIFO_MIN_READ 4096  /* Least room offered to each read */
+
+/* A writev on its way to a node, holding a block for each of its frames */
+struct fifo_write {
+  uv_write_t req;
+  size_t n;
+  struct frame_block *blocks[];
+};
+
+static void fifo_close_cb(uv_handle_t *handle)
+{
+  release_proc(handle->data);
+}
+
+/* Remove and close the FIFOs */
+static void fifo_close(struct proc *proc)
+{
+  if (proc->chan.fifo.in)
+    unlink(proc->chan.fifo.in);
+  if (proc->chan.fifo.out)
+    unlink(proc->chan.fifo.out);
+  g_free(proc->chan.fifo.in);
+  g_free(proc->chan.fifo.out);
+  proc->chan.fifo.in = proc->chan.fifo.out = NULL;
+  frame_unref(proc->chan.fifo.block);
+  proc->chan.fifo.block = NULL;
+  uv_close((uv_handle_t *)&proc->chan.fifo.tx, &fifo_close_cb);
+  uv_close((uv_handle_t *)&proc->chan.fifo.rx, &fifo_close_cb);
+}
+
+static size_t fifo_backlog(struct proc *proc)
+{
+  return uv_stream_get_write_queue_size((uv_stream_t *)&proc->chan.fifo.tx);
+}
+
+static void fifo_write_cb(uv_write_t *req, int status)
+{
+  struct fifo_write *w = (struct fifo_write *)req;
+  size_t i;
+
+  for (i = 0; i < w->n; i++)
+    frame_unref(w->blocks[i]);
+  free(w);
+}
+
+/* Write every queued frame with one writev */
+static void fifo_flush(struct proc *proc)
+{
+  size_t i;
+  struct fifo_write *w = malloc(sizeof(struct fifo_write) + \
+    proc->out_n * sizeof(struct frame_block *));
+
+  if (!w || uv_write(&w->req, (uv_stream_t *)&proc->chan.fifo.tx, \
+    proc->out, proc->out_n, &fifo_write_cb)) {
+    free(w);
+    for (i = 0; i < proc->out_n; i++)
+      frame_unref(proc->out_blocks[i]);
+    return;
+  }
+  /* The write holds the references of the queue from here on */
+  w->n = proc->out_n;
+  for (i = 0; i < w->n; i++)
+    w->blocks[i] = proc->out_blocks[i];
+}
+
+/* Offer the free end of the read block. Once it runs out of room, or can't
+ * hold the whole of the frame at its end, that partial frame moves to the
+ * start of the block, or of a fresh block while frames in the old one are
+ * still queued to siblings. */
+static void fifo_alloc_cb(uv_handle_t *handle, size_t suggested_size, \
+  uv_buf_t *buf)
+{
+  struct proc *proc = handle->data;
+  struct frame_block *block = proc->chan.fifo.block;
+  size_t start = proc->chan.fifo.start, len = proc->chan.fifo.len;
+  size_t left = len - start, frame = 0, cap;
+  uint32_t hdr;
+
+  /* A block with nothing queued or unparsed starts over */
+  if (block && block->refs == 1 && !left)
+    start = len = 0;
+  if (left >= sizeof(hdr)) {
+    memcpy(&hdr, block->data + start, sizeof(hdr));
+    frame = sizeof(hdr) + MIN(ntohl(hdr), MAX_FRAME);
+  }
+  if (block && block->cap - len >= FIFO_MIN_READ && start + frame <= block->cap)
+    goto peace;
+
+  cap = MAX(FIFO_BLOCK, MAX(frame, left) + FIFO_MIN_READ);
+  if (block && block->refs == 1 && block->cap >= cap)
+    memmove(block->data, block->data + start, left);
+  else {
+    if (!(block = frame_alloc(cap))) {
+      *buf = uv_buf_init(NULL, 0);
+      return;
+    }
+    if (left)
+      memcpy(block->data, proc->chan.fifo.block->data + start, left);
+    frame_unref(proc->chan.fifo.block);
+    proc->chan.fifo.block = block;
+  }
+  start = 0;
+  len = left;
+
+peace:
+  proc->chan.fifo.start = start;
+  proc->chan.fifo.len = len;
+  *buf = uv_buf_init(block->data + len, block->cap - len);
+}
+
+/* Split the bytes read from a node into frames, and deliver each whole one.
+ * A partial frame waits in the block for the rest of it. */
+static void fifo_read_cb(uv_stream_t *stream, ssize_t nread, \
+  const uv_buf_t *buf)
+{
+  struct proc *proc = stream->data;
+  struct frame_block *block;
+  uint32_t len;
+
+  if (nread == 0)
+    return;
+  NODE_LOCK();
+  if (nread < 0) {
+    fprintf(stderr, "Unable to read from node %" PRId64 ": %s\n", proc->id, \
+      uv_strerror(nread));
+    fail_proc(proc);
+    goto peace;
+  }
+  block = proc->chan.fifo.block;
+  proc->chan.fifo.len += nread;
+  while (!proc->closed && \
+    proc->chan.fifo.len - proc->chan.fifo.start >= sizeof(len)) {
+    memcpy(&len, block->data + proc->chan.fifo.start, sizeof(len));
+    len = ntohl(len);
+    if (len > MAX_FRAME) {
+      fprintf(stderr, "Node %" PRId64 " sent a frame of %" PRIu32 \
+        " bytes, the most is %d.\n", proc->id, len, MAX_FRAME);
+      fail_proc(proc);
+      goto peace;
+    }
+    if (proc->chan.fifo.len - proc->chan.fifo.start - sizeof(len) < len)
+      break;
+    if (proc->node)
+      deliver_frame(proc->node, block, block->data + proc->chan.fifo.start, \
+        sizeof(len) + len);
+    proc->chan.fifo.start += sizeof(len) + len;
+  }
+
+peace:
+  NODE_UNLOCK();
+}
+
+/* Open one end of a FIFO as a pipe. Returns -1 on failure, 0 on success */
+static int fifo_open_pipe(uv_pipe_t *pipe, const char *path)
+{
+  int fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+
+  if (fd < 0)
+    return -1;
+  if (uv_pipe_open(pipe, fd)) {
+    close(fd);
+    return -1;
+  }
+  return 0;
+}
+
+/* Returns -1 on failure, 0 on success */
+static int fifo_open(struct proc *proc, uv_loop_t *loop, \
+  uv_process_options_t *options)
+{
+  proc->chan.fifo.in = g_strdup_printf("%s.in", proc->path);
+  proc->chan.fifo.out = g_strdup_printf("%s.out", proc->path);
+  uv_pipe_init(loop, &proc->chan.fifo.tx, 0);
+  uv_pipe_init(loop, &proc->chan.fifo.rx, 0);
+  proc->chan.fifo.tx.data = proc->chan.fifo.rx.data = proc;
+  proc->handles += 2;
+
+  if (mkfifo(proc->chan.fifo.in, 0600) || mkfifo(proc->chan.fifo.out, 0600))
+    return -1;
+  if (fifo_open_pipe(&proc->chan.fifo.tx, proc->chan.fifo.in) || \
+    fifo_open_pipe(&proc->chan.fifo.rx, proc->chan.fifo.out))
+    return -1;
+  if (uv_read_start((uv_stream_t *)&proc->chan.fifo.rx, &fifo_alloc_cb, \
+    &fifo_read_cb))
+    return -1;
+  options->args[2] = proc->chan.fifo.in;
+  options->args[3] = proc->chan.fifo.out;
+  return 0;
+}
+
+const struct transport_ops fifo_transport_ops = {
+  "fifo",
+  &fifo_open,
+  &fifo_close,
+  &fifo_backlog,
+  &fifo_flush
+};
@@ -0,0 +1,279 @@
+/* grid.c: the uniform grid spatial index.
+ * Copyright  2015 Jack Morton <jhm@jemscout.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "postel.h"
+
+#include <stdlib.h>
+#include <math.h>
+
+/* The matrix is divided into square cells as wide as the transmission range,
+ * so that every node in range of a point lies in the 3x3 block of cells around
+ * it. Each cell keeps its coordinates in flat arrays, and a node remembers its
+ * cell and slot, so that it can be swapped out in O(1). */
+#define GRID_MIN_CELL 8
+
+struct grid_cell {
+  double *x, *y;
+  struct node **node;
+  unsigned int n, cap;
+};
+
+struct grid {
+  double cell_size;
+  unsigned int cols, rows;
+  struct grid_cell *cells;
+};
+
+/* Map a coordinate onto a column or row. Coordinates off the matrix are
+ * clamped onto the border cells. */
+static unsigned int grid_coord(const struct grid *grid, double v, \
+  unsigned int max)
+{
+  double c = floor(v / grid->cell_size);
+
+  if (c < 0.0)
+    return 0;
+  if (c >= max)
+    return max - 1;
+  return (unsigned int)c;
+}
+
+static struct grid_cell *grid_cell(const struct grid *grid, double x, double y)
+{
+  return &grid->cells[grid_coord(grid, y, grid->rows) * grid->cols + \
+    grid_coord(grid, x, grid->cols)];
+}
+
+/* Grow a cell to hold at least one more node. Returns -1 on failure */
+static int grid_grow(struct grid_cell *cell)
+{
+  unsigned int cap = cell->cap ? cell->cap * 2 : GRID_MIN_CELL;
+  double *x, *y;
+  struct node **node;
+
+  if (cell->n < cell->cap)
+    return 0;
+  if (!(x = realloc(cell->x, cap * sizeof(double))))
+    return -1;
+  cell->x = x;
+  if (!(y = realloc(cell->y, cap * sizeof(double))))
+    return -1;
+  cell->y = y;
+  if (!(node = realloc(cell->node, cap * sizeof(struct node *))))
+    return -1;
+  cell->node = node;
+  cell->cap = cap;
+  return 0;
+}
+
+static int grid_insert(struct node_index *idx, struct node *nodei)
+{
+  struct grid *grid = idx->data;
+  struct grid_cell *cell = grid_cell(grid, nodei->x, nodei->y);
+
+  if (grid_grow(cell))
+    return -1;
+  cell->x[cell->n] = nodei->x;
+  cell->y[cell->n] = nodei->y;
+  cell->node[cell->n] = nodei;
+  nodei->grid.cell = cell - grid->cells;
+  nodei->grid.slot = cell->n++;
+  return 0;
+}
+
+/* Swap the last node of the cell into the hole */
+static void grid_remove(struct node_index *idx, struct node *nodep)
+{
+  struct grid *grid = idx->data;
+  struct grid_cell *cell = &grid->cells[nodep->grid.cell];
+  unsigned int slot = nodep->grid.slot, last = --cell->n;
+
+  if (slot != last) {
+    cell->x[slot] = cell->x[last];
+    cell->y[slot] = cell->y[last];
+    cell->node[slot] = cell->node[last];
+    cell->node[slot]->grid.slot = slot;
+  }
+}
+
+/* A node that moved within its cell is updated in place, otherwise it is
+ * swapped out of its old cell once the new one has room for it */
+static int grid_move(struct node_index *idx, struct node *nodep, \
+  double old_x, double old_y)
+{
+  struct grid *grid = idx->data;
+  struct grid_cell *cell = grid_cell(grid, nodep->x, nodep->y);
+
+  if (cell - grid->cells == nodep->grid.cell) {
+    cell->x[nodep->grid.slot] = nodep->x;
+    cell->y[nodep->grid.slot] = nodep->y;
+    return 0;
+  }
+  if (grid_grow(cell))
+    return -1;
+  grid_remove(idx, nodep);
+  return grid_insert(idx, nodep);
+}
+
+/* Call fn for every node within distance r of x, y, scanning only the cells
+ * that overlap the bounding square of the circle. Returns the number of nodes
+ * found. */
+static size_t grid_range(struct node_index *idx, double x, double y, \
+  double r, void (*fn)(struct node *, void *), void *arg)
+{
+  struct grid *grid = idx->data;
+  struct grid_cell *cell;
+  unsigned int col, row, col0, col1, row1, i, len, word;
+  uint64_t mask[SIMD_BLOCK / 64], bits;
+  size_t found = 0;
+
+  col0 = grid_coord(grid, x - r, grid->cols);
+  col1 = grid_coord(grid, x + r, grid->cols);
+  row1 = grid_coord(grid, y + r, grid->rows);
+  for (row = grid_coord(grid, y - r, grid->rows); row <= row1; row++) {
+    for (col = col0; col <= col1; col++) {
+      /* Test the cell a block at a time, then visit the bits set */
+      cell = &grid->cells[row * grid->cols + col];
+      for (i = 0; i < cell->n; i += SIMD_BLOCK) {
+        len = MIN(SIMD_BLOCK, cell->n - i);
+        if (!range_mask(x, y, r * r, cell->x + i, cell->y + i, len, mask))
+          continue;
+        for (word = 0; word < (len + 63) / 64; word++) {
+          for (bits = mask[word]; bits; bits &= bits - 1) {
+            fn(cell->node[i + word * 64 + __builtin_ctzll(bits)], arg);
+            found++;
+          }
+        }
+      }
+    }
+  }
+  return found;
+}
+
+/* Search rings of cells outward from the one holding x, y. Once a node is
+ * found, rings that lie further away than it can be skipped. */
+static struct node *grid_nearest(struct node_index *idx, double x, double y)
+{
+  struct grid *grid = idx->data;
+  struct grid_cell *cell;
+  struct node *best = NULL;
+  double best_dist = HUGE_VAL, dist_x, dist_y, dist, reach;
+  long col = grid_coord(grid, x, grid->cols), row = grid_coord(grid, y, \
+    grid->rows), c, r, ring, rings = MAX(grid->cols, grid->rows);
+  unsigned int i;
+
+  for (ring = 0; ring < rings; ring++) {
+    /* From anywhere in its own cell, or off the grid beyond it, the query is
+     * at least ring - 1 cells away from the cells of the ring */
+    reach = MAX(ring - 1, 0) * grid->cell_size;
+    if (best && reach * reach > best_dist)
+      break;
+    for (r = row - ring; r <= row + ring; r++) {
+      if (r < 0 || r >= grid->rows)
+        continue;
+      for (c = col - ring; c <= col + ring; c++) {
+        if (c < 0 || c >= grid->cols)
+          continue;
+        /* Only the outline of the ring, the inside was searched already */
+        if (r != row - ring && r != row + ring && c != col - ring && \
+          c != col + ring)
+          continue;
+        cell = &grid->cells[r * grid->cols + c];
+        for (i = 0; i < cell->n; i++) {
+          dist_x = x - cell->x[i];
+          dist_y = y - cell->y[i];
+          dist = dist_x * dist_x + dist_y * dist_y;
+          if (dist < best_dist) {
+            best = cell->node[i];
+            best_dist = dist;
+          }
+        }
+      }
+    }
+  }
+  return best;
+}
+
+/* Cells are filled one node at a time, which is already O(1) per node. On
+ * failure the nodes inserted are taken out again. Returns -1 on failure, 0 on
+ * success */
+static int grid_load(struct node_index *idx, struct node **v, size_t n)
+{
+  size_t i;
+
+  for (i = 0; i < n; i++) {
+    if (grid_insert(idx, v[i])) {
+      while (i--)
+        grid_remove(idx, v[i]);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static int grid_init(struct node_index *idx, double width, double height, \
+  double range)
+{
+  struct grid *grid = calloc(1, sizeof(struct grid));
+
+  if (!grid)
+    return -1;
+  grid->cell_size = (range > 0.0) ? range : 1.0;
+  grid->cols = MAX(1, (unsigned int)ceil(width / grid->cell_size));
+  grid->rows = MAX(1, (unsigned int)ceil(height / grid->cell_size));
+  grid->cells = calloc((size_t)grid->cols * grid->rows, \
+    sizeof(struct grid_cell));
+  if (!grid->cells) {
+    free(grid);
+    return -1;
+  }
+  idx->data = grid;
+  return 0;
+}
+
+/* The nodes belong to the caller, only the cells are released */
+static void grid_destroy(struct node_index *idx)
+{
+  struct grid *grid = idx->data;
+  unsigned int i;
+
+  for (i = 0; i < grid->cols * grid->rows; i++) {
+    free(grid->cells[i].x);
+    free(grid->cells[i].y);
+    free(grid->cells[i].node);
+  }
+  free(grid->cells);
+  free(grid);
+  idx->data = NULL;
+}
+
+const struct index_ops grid_index_ops = {
+  "grid",
+  &grid_init,
+  &grid_destroy,
+  &grid_insert,
+  &grid_remove,
+  &grid_move,
+  &grid_range,
+  &grid_nearest,
+  &grid_load
+};
@@ -0,0 +1,189 @@
+/* handle.c: generational handle tables.
+ * Copyright  2015 Jack Morton <jhm@jemscout.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "postel.h"
+
+#include <stdlib.h>
+
+/* A handle is the slot index plus one in the low 32 bits, and the generation
+ * of the slot in the high bits. Freeing a slot bumps its generation, so that
+ * a stale handle no longer matches once the slot is reused. The first handle
+ * of each slot is just its index plus one, so ids start at 1. */
+#define HANDLE_MIN_SLOTS 64
+#define HANDLE_MAX_SLOTS 0x7fffffffU
+#define HANDLE_NONE UINT32_MAX
+#define HANDLE_SLOT(h) ((uint32_t)((h) & 0xffffffff) - 1)
+#define HANDLE_GEN(h) ((uint32_t)((h) >> 32))
+#define HANDLE_MAKE(slot, gen) \
+  ((int64_t)((uint64_t)((gen) & 0x7fffffff) << 32 | ((slot) + 1)))
+
+void init_handles(struct handle_table *table)
+{
+  table->slots = NULL;
+  table->size = table->cap = 0;
+  table->free_head = HANDLE_NONE;
+  table->used = 0;
+}
+
+/* Returns -1 on failure, the new handle on success */
+int64_t alloc_handle(struct handle_table *table, void *ptr)
+{
+  uint32_t slot, cap;
+  struct handle_slot *slots;
+
+  if (table->free_head != HANDLE_NONE) {
+    slot = table->free_head;
+    table->free_head = table->slots[slot].next;
+  }
+  else {
+    if (table->size == table->cap) {
+      if (table->cap >= HANDLE_MAX_SLOTS)
+        return -1;
+      cap = table->cap ? MIN(table->cap * 2, HANDLE_MAX_SLOTS) : \
+        HANDLE_MIN_SLOTS;
+      if (!(slots = realloc(table->slots, cap * sizeof(*slots))))
+        return -1;
+      table->slots = slots;
+      table->cap = cap;
+    }
+    slot = table->size++;
+    table->slots[slot].gen = 0;
+  }
+  table->slots[slot].ptr = ptr;
+  table->slots[slot].next = HANDLE_NONE;
+  table->used++;
+  return HANDLE_MAKE(slot, table->slots[slot].gen);
+}
+
+/* Returns NULL on failure (to validate the handle), the pointer on success */
+void *get_handle(const struct handle_table *table, int64_t h)
+{
+  uint32_t slot = HANDLE_SLOT(h);
+
+  if (h <= 0 || slot >= table->size || !table->slots[slot].ptr || \
+    table->slots[slot].gen != HANDLE_GEN(h))
+    return NULL;
+  return table->slots[slot].ptr;
+}
+
+/* Returns the pointer in the last used slot below *cursor, and moves *cursor
+ * down to that slot, or NULL once there is none. A walk starts with *cursor
+ * at UINT32_MAX, and neither misses nor repeats a slot used all along, slots
+ * freed or reused in between being walked or not */
+void *prev_handle(const struct handle_table *table, uint32_t *cursor)
+{
+  uint32_t slot = MIN(*cursor, table->size);
+
+  while (slot--) {
+    if (table->slots[slot].ptr) {
+      *cursor = slot;
+      return table->slots[slot].ptr;
+    }
+  }
+  *cursor = 0;
+  return NULL;
+}
+
+/* Replace the slots of an empty table with size slots, each with the
+ * generation and next free slot of a pair in slots, and the free list that
+ * starts at free_head, as saved by save.c. Every slot is left empty, to be
+ * filled by fill_handle(). Returns -1 on failure, 0 on success */
+int load_handles(struct handle_table *table, const uint32_t *slots, \
+  uint32_t size, uint32_t free_head)
+{
+  uint32_t i, cap;
+  struct handle_slot *grown;
+
+  if (table->used || size > HANDLE_MAX_SLOTS || \
+    (free_head != HANDLE_NONE && free_head >= size))
+    return -1;
+  for (i = 0; i < size; i++) {
+    if (slots[2 * i + 1] != HANDLE_NONE && slots[2 * i + 1] >= size)
+      return -1;
+  }
+  if (size > table->cap) {
+    cap = MAX(size, HANDLE_MIN_SLOTS);
+    if (!(grown = realloc(table->slots, cap * sizeof(*grown))))
+      return -1;
+    table->slots = grown;
+    table->cap = cap;
+  }
+  for (i = 0; i < size; i++) {
+    table->slots[i].ptr = NULL;
+    table->slots[i].gen = slots[2 * i] & 0x7fffffff;
+    table->slots[i].next = slots[2 * i + 1];
+  }
+  table->size = size;
+  table->free_head = free_head;
+  return 0;
+}
+
+/* Once every slot of a loaded table is filled, check that its free list
+ * holds each empty slot exactly once, so that no handle given out later
+ * lands on a slot in use. Returns -1 on failure (a free list that loops,
+ * holds a slot in use or misses an empty one), 0 on success */
+int check_handles(const struct handle_table *table)
+{
+  uint32_t slot, steps = 0, empty = table->size - table->used;
+
+  for (slot = table->free_head; slot != HANDLE_NONE; \
+    slot = table->slots[slot].next) {
+    if (slot >= table->size || table->slots[slot].ptr || ++steps > empty)
+      return -1;
+  }
+  return (steps == empty) ? 0 : -1;
+}
+
+/* Put ptr in the empty slot of a handle of the same generation, as left by
+ * load_handles(). Returns -1 on failure, 0 on success */
+int fill_handle(struct handle_table *table, int64_t h, void *ptr)
+{
+  uint32_t slot = HANDLE_SLOT(h);
+
+  if (h <= 0 || slot >= table->size || table->slots[slot].ptr || \
+    table->slots[slot].gen != HANDLE_GEN(h))
+    return -1;
+  table->slots[slot].ptr = ptr;
+  table->used++;
+  return 0;
+}
+
+/* Returns -1 on failure (to validate the handle), 0 on success */
+int free_handle(struct handle_table *table, int64_t h)
+{
+  uint32_t slot = HANDLE_SLOT(h);
+
+  if (!get_handle(table, h))
+    return -1;
+  table->slots[slot].ptr = NULL;
+  table->slots[slot].gen = (table->slots[slot].gen + 1) & 0x7fffffff;
+  table->slots[slot].next = table->free_head;
+  table->free_head = slot;
+  table->used--;
+  return 0;
+}
+
+void shutdown_handles(struct handle_table *table)
+{
+  free(table->slots);
+  init_handles(table);
+}
@@ -0,0 +1,129 @@
+/* index.c: spatial index backends and their benchmark.
+ * Copyright  2015 Jack Morton <jhm@jemscout.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "postel.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <uv.h>
+
+extern struct global_state_struct postel;
+G_LOCK_EXTERN(postel);
+
+#define BENCH_QUERIES 10000
+
+/* The available backends, the first being the default */
+const struct index_ops *index_backends[] = {
+  &tree_index_ops,
+  &grid_index_ops,
+  NULL
+};
+
+/* Returns NULL on failure (to find the backend), the backend on success */
+const struct index_ops *find_index(const char *name)
+{
+  int i;
+
+  for (i = 0; index_backends[i]; i++) {
+    if (!strcasecmp(name, index_backends[i]->name))
+      return index_backends[i];
+  }
+  return NULL;
+}
+
+/* A xorshift generator, so that every backend sees the same nodes */
+static double bench_rand(uint32_t *state, double max)
+{
+  *state ^= *state << 13;
+  *state ^= *state >> 17;
+  *state ^= *state << 5;
+  return (double)*state / UINT32_MAX * max;
+}
+
+static void bench_cb(struct node *nodep, void *arg)
+{
+  (*(size_t *)arg)++;
+}
+
+/* Time n inserts, BENCH_QUERIES range and nearest neighbor queries, and n
+ * removals on a scratch index filled with uniformly placed nodes. The nodes
+ * are not part of the simulation. Returns -1 on failure, 0 on success */
+int bench_index(const struct index_ops *ops, size_t n, struct index_bench *res)
+{
+  int err = -1;
+  size_t i;
+  uint32_t seed = 2015;
+  double width, height, range;
+  uint64_t start;
+  struct node_index idx;
+  struct node *nodes = calloc(n, sizeof(struct node));
+
+  if (!nodes)
+    return -1;
+
+  G_LOCK(postel);
+  width = postel.matrix_width - postel.matrix_zero;
+  height = postel.matrix_height - postel.matrix_zero;
+  range = postel.node_r_size;
+  G_UNLOCK(postel);
+
+  idx.ops = ops;
+  if (INDEX_INIT(&idx, width, height, range))
+    goto peace;
+  for (i = 0; i < n; i++) {
+    nodes[i].x = bench_rand(&seed, width);
+    nodes[i].y = bench_rand(&seed, height);
+  }
+
+  memset(res, 0, sizeof(*res));
+  start = uv_hrtime();
+  for (i = 0; i < n; i++) {
+    if (INDEX_INSERT(&idx, &nodes[i]))
+      goto destroy;
+  }
+  res->insert = (double)(uv_hrtime() - start) / n;
+
+  start = uv_hrtime();
+  for (i = 0; i < BENCH_QUERIES; i++) {
+    INDEX_RANGE(&idx, bench_rand(&seed, width), bench_rand(&seed, height), \
+      range, bench_cb, &res->found);
+  }
+  res->range = (double)(uv_hrtime() - start) / BENCH_QUERIES;
+  res->found /= BENCH_QUERIES;
+
+  start = uv_hrtime();
+  for (i = 0; i < BENCH_QUERIES; i++)
+    INDEX_NEAREST(&idx, bench_rand(&seed, width), bench_rand(&seed, height));
+  res->nearest = (double)(uv_hrtime() - start) / BENCH_QUERIES;
+
+  start = uv_hrtime();
+  for (i = 0; i < n; i++)
+    INDEX_REMOVE(&idx, &nodes[i]);
+  res->remove = (double)(uv_hrtime() - start) / n;
+  err = 0;
+
+destroy:
+  INDEX_DESTROY(&idx);
+peace:
+  free(nodes);
+  return err;
+}
@@ -27,12 +27,13 @@
 #include <stdio.h>
 #include <stdarg.h>
 #include <string.h>
+#include <inttypes.h>
+#include <sys/uio.h>
 #include <glib.h>
 #include <uv.h>
 
 extern struct global_state_struct postel;
 G_LOCK_EXTERN(postel);
-G_LOCK_DEFINE(node_head);
 
 /* IO callbacks */
 static uv_signal_t sigint_watcher;
@@ -45,28 +46,181 @@ static int set_non_blocking(int fd)
   return val == -1 ? -1 : fcntl(fd, F_SETFL, val | O_NONBLOCK);
 }
 
-/* Print to screen. Watch those format strings! */
+/* Output is queued in chunks, and written once per turn of the loop by the
+ * stdout watcher, with one writev of every chunk queued, or as much of them
+ * as stdout takes. Printing never blocks, and a dump of many lines costs a
+ * few writes rather than one per line. Past OUT_HIGH bytes queued, commands
+ * stop being read and run until the queue drains to OUT_LOW, and past OUT_MAX
+ * output is dropped, and counted. A stdout that can't be polled, such as a
+ * regular file, never blocks either, and is written from an idle handle. */
+#define OUT_CHUNK (64 * 1024)
+#define OUT_LOW (1024 * 1024)
+#define OUT_HIGH (4 * 1024 * 1024)
+#define OUT_MAX (64 * 1024 * 1024)
+#define OUT_IOV 64  /* Most chunks per writev */
+
+struct out_chunk {
+  SIMPLEQ_ENTRY(out_chunk) chunks;
+  size_t start, len, cap;  /* Written up to start, of len bytes */
+  char data[];
+};
+
+static SIMPLEQ_HEAD(, out_chunk) out_head = SIMPLEQ_HEAD_INITIALIZER(out_head);
+static struct out_chunk *out_tail;
+static size_t out_bytes, out_dropped;
+static uv_idle_t out_idle;
+static int out_pollable, out_watching;
+static int console_paused;  /* Output backed up, or a job running */
+static int console_closed;  /* No more commands */
+
+static void console_resume(void);
+
+/* Drop the first w bytes queued, as they were written */
+static void out_consume(size_t w)
+{
+  struct out_chunk *chunk;
+  size_t n;
+
+  out_bytes -= w;
+  while (w && (chunk = SIMPLEQ_FIRST(&out_head))) {
+    n = MIN(w, chunk->len - chunk->start);
+    chunk->start += n;
+    w -= n;
+    if (chunk->start == chunk->len) {
+      SIMPLEQ_REMOVE_HEAD(&out_head, chunk, chunks);
+      if (chunk == out_tail)
+        out_tail = NULL;
+      free(chunk);
+    }
+  }
+}
+
+/* Write as much as stdout takes. Returns TRUE while output is left */
+static int out_drain(void)
+{
+  struct iovec iov[OUT_IOV];
+  struct out_chunk *chunk;
+  ssize_t w;
+  int n;
+
+  while (out_bytes) {
+    n = 0;
+    SIMPLEQ_FOREACH(chunk, &out_head, chunks) {
+      if (n == OUT_IOV)
+        break;
+      iov[n].iov_base = chunk->data + chunk->start;
+      iov[n++].iov_len = chunk->len - chunk->start;
+    }
+    if ((w = writev(STDOUT_FILENO, iov, n)) < 0) {
+      if (errno == EAGAIN || errno == EINTR)
+        return TRUE;
+      fprintf(stderr, "Error on write() to stdout: %s\n", strerror(errno));
+      out_consume(out_bytes);
+      break;
+    }
+    out_consume(w);
+  }
+  return FALSE;
+}
+
+static void out_stop(void)
+{
+  if (!out_watching)
+    return;
+  out_watching = FALSE;
+  if (out_pollable)
+    uv_poll_stop(&stdout_watcher);
+  else
+    uv_idle_stop(&out_idle);
+}
+
+/* Callback when stdout is writable */
+static void stdout_cb(uv_poll_t *handle, int status, int events)
+{
+  if (!out_drain())
+    out_stop();
+  if (console_paused && out_bytes <= OUT_LOW)
+    console_resume();
+}
+
+static void out_idle_cb(uv_idle_t *handle)
+{
+  stdout_cb(NULL, 0, 0);
+}
+
+/* Write the queue out at the next turn of the loop */
+static void out_start(void)
+{
+  if (out_watching)
+    return;
+  out_watching = TRUE;
+  if (out_pollable)
+    uv_poll_start(&stdout_watcher, UV_WRITABLE, &stdout_cb);
+  else
+    uv_idle_start(&out_idle, &out_idle_cb);
+}
+
+/* Returns NULL on failure, a new chunk of at least size bytes at the end of
+ * the queue on success */
+static struct out_chunk *out_chunk(size_t size)
+{
+  size_t cap = MAX(size, OUT_CHUNK);
+  struct out_chunk *chunk = malloc(sizeof(struct out_chunk) + cap);
+
+  if (!chunk)
+    return NULL;
+  chunk->start = chunk->len = 0;
+  chunk->cap = cap;
+  SIMPLEQ_INSERT_TAIL(&out_head, chunk, chunks);
+  out_tail = chunk;
+  return chunk;
+}
+
+/* Print to screen. Watch those format strings! Returns -1 on failure (or a
+ * drop), the length printed on success */
 static int print_msg(const char *fmt, ...)
 {
-  int w;
-  char buf[4096];
-  size_t bufsz = 0;
+  int len;
+  size_t dropped;
   va_list ap;
+  struct out_chunk *chunk = out_tail;
+
+  if (out_dropped && out_bytes <= OUT_LOW) {
+    dropped = out_dropped;
+    out_dropped = 0;
+    print_msg("(%zu bytes of output dropped)\n", dropped);
+  }
 
+  /* Straight into the last chunk, if it fits */
   va_start(ap, fmt);
-    bufsz += vsnprintf(buf + bufsz, (sizeof(buf) - bufsz), fmt, ap);
+  len = vsnprintf(chunk ? chunk->data + chunk->len : NULL, \
+    chunk ? chunk->cap - chunk->len : 0, fmt, ap);
   va_end(ap);
-
-  w = write(STDOUT_FILENO, buf, bufsz);
-  if (w < 0) {
-    fprintf(stderr, "Error on write() to stdout: %s\n", strerror(errno));
+  if (len <= 0)
+    return len;
+  if (!chunk || len >= chunk->cap - chunk->len) {
+    if (out_bytes + len > OUT_MAX || !(chunk = out_chunk(len + 1))) {
+      out_dropped += len;
+      return -1;
+    }
+    va_start(ap, fmt);
+    vsnprintf(chunk->data, chunk->cap, fmt, ap);
+    va_end(ap);
   }
-  while (w >= 0 && w != bufsz) {
-    /* Partial buf written, so shift position */
-    memmove(buf, buf + w, bufsz - w);
-    bufsz -= w;
+  chunk->len += len;
+  out_bytes += len;
+  out_start();
+  if (!console_paused && out_bytes > OUT_HIGH) {
+    console_paused = TRUE;
+    uv_poll_stop(&stdin_watcher);
   }
-  return w;
+  return len;
+}
+
+/* Node ids are parsed in full, so that a stale id never matches a new node */
+static int64_t parse_id(const char *arg)
+{
+  return strtoll(arg, NULL, 10);
 }
 
 static void print_prompt(void)
@@ -81,15 +235,156 @@ static void sigint_cb(uv_signal_t *handle, int signum)
   shutdown_postel(-1, msg);
 }
 
+/* A command with a lot of work to do runs as a job: its step function is
+ * called from an idle handle, and does what it can until a deadline,
+ * holding the lock it needs only for as long, and keeps its place in the job
+ * for the next turn of the loop. The clock, the nodes and the renderer carry
+ * on in between. Commands read meanwhile wait for the job to end, as they do
+ * while output is backed up, and so does the job itself. */
+#define JOB_BUDGET 2000000  /* Nanoseconds per step */
+#define JOB_CHECK 256       /* Items between looks at the clock */
+
+struct console_job {
+  int (*step)(uint64_t deadline);  /* Returns TRUE once done */
+  uint32_t cursor;
+  uint64_t start;
+};
+
+static struct console_job job;
+static uv_idle_t job_idle;
+
+static void job_cb(uv_idle_t *handle)
+{
+  if (out_bytes > OUT_HIGH) {
+    /* Resumed by console_resume() */
+    uv_idle_stop(&job_idle);
+    return;
+  }
+  if (!job.step(uv_hrtime() + JOB_BUDGET))
+    return;
+  uv_idle_stop(&job_idle);
+  job.step = NULL;
+  console_resume();
+}
+
+/* Run a job from the next turn of the loop, see above */
+static void start_job(int (*step)(uint64_t deadline))
+{
+  job.step = step;
+  job.start = uv_hrtime();
+  console_paused = TRUE;
+  uv_poll_stop(&stdin_watcher);
+  uv_idle_start(&job_idle, &job_cb);
+}
+
+/* A command that only reads runs as a query on the thread pool, so that it
+ * holds node_head for reading alongside the snapshot and the control socket,
+ * not on the loop. It builds its output in query.out, printed once it is
+ * done. A query that sets again is queued once more, to print as it goes.
+ * Commands wait for it, as they do for a job. */
+struct console_query {
+  uv_work_t work;
+  uv_work_cb run;
+  int64_t id;
+  size_t i, j, count;  /* Of a bench */
+  size_t sizes[4];
+  GString *out;
+  int running, again;
+};
+
+static struct console_query query;
+
+static void query_done(uv_work_t *req, int status)
+{
+  query.running = FALSE;
+  if (!console_closed) {
+    if (status)
+      print_msg("Error: unable to run the command\n");
+    else
+      print_msg("%s", query.out->str);
+  }
+  if (!status && !console_closed && query.again) {
+    g_string_truncate(query.out, 0);
+    query.again = FALSE;
+    if (!uv_queue_work(stdin_watcher.loop, &query.work, query.run, \
+      &query_done)) {
+      query.running = TRUE;
+      return;
+    }
+    print_msg("Error: unable to run the command\n");
+  }
+  g_string_free(query.out, TRUE);
+  query.out = NULL;
+  if (console_closed || out_bytes > OUT_HIGH)
+    return;
+  console_resume();
+}
+
+/* Run a query on the thread pool, see above */
+static void start_query(uv_work_cb work)
+{
+  query.run = work;
+  query.again = FALSE;
+  query.out = g_string_new(NULL);
+  if (uv_queue_work(stdin_watcher.loop, &query.work, work, &query_done)) {
+    print_msg("Error: unable to run the command\n");
+    g_string_free(query.out, TRUE);
+    query.out = NULL;
+    return;
+  }
+  query.running = TRUE;
+  console_paused = TRUE;
+  uv_poll_stop(&stdin_watcher);
+}
+
 /* Prototypes */
 static void help_command(int argc, char **argv);
 static void add_command(int argc, char **argv);
 static void del_command(int argc, char **argv);
 static void list_command(int argc, char **argv);
+static void sibs_command(int argc, char **argv);
+static void bench_command(int argc, char **argv);
+static void move_command(int argc, char **argv);
+static void mob_command(int argc, char **argv);
+static void path_command(int argc, char **argv);
+static void pool_command(int argc, char **argv);
+static void stats_command(int argc, char **argv);
+static void rebuild_command(int argc, char **argv);
+static void simd_command(int argc, char **argv);
+static void clock_command(int argc, char **argv);
+static void load_command(int argc, char **argv);
+static void save_command(int argc, char **argv);
+static void restore_command(int argc, char **argv);
+static void trace_command(int argc, char **argv);
+static void replay_command(int argc, char **argv);
+
+/* Commands are read into a buffer, and every complete line is run, the rest
+ * kept for the next read. A run of adds without a process, or of dels, is
+ * batched, and run under a single lock, the adds with one update of the index
+ * for as many as add_nodes() finds worth it. */
+#define CONSOLE_BUFFER (64 * 1024)
+#define CONSOLE_READS 64  /* Most reads per callback */
+#define CONSOLE_SPACE " \t\r\n"
+
+static char console_in[CONSOLE_BUFFER + 1];
+static size_t console_len;
+static int console_skip;    /* Dropping the rest of a line too long */
+static int console_eof;     /* No more input */
+
+enum console_batch {
+  BATCH_NONE,
+  BATCH_ADD,
+  BATCH_DEL
+};
+
+static enum console_batch batch_kind;
+static double *batch_xy;
+static int64_t *batch_ids;
+static size_t batch_n, batch_cap;
 
 /* Here are the commands yo! */
-#define MAX_ARGV 3
-#define CONSOLE_COMMANDS 5
+#define MAX_ARGV 33
+#define CONSOLE_COMMANDS 20
 struct commands {
   char *name;
   unsigned int req_arg;
@@ -97,12 +392,87 @@ struct commands {
   char *long_desc;
   void (*function)(int argc, char **argv);
 } commands[] = {
-  {"add", 2, "add <x> <y>: spawn a node at coordinates <x>, <y>.", \
-    "spawn a node at coordinates <x>, <y>.", &add_command},
+  {"add", 2, "add <x> <y> [file] [transport]: spawn a node at <x>, <y>.", \
+    "spawn a node at coordinates <x>, <y>. with [file], the node runs " \
+    "as a process of that executable, linked by the fifo (default) or shm " \
+    "[transport]. a frame is a 32 bit length in network byte order " \
+    "followed by that many bytes. over fifo, the node runs as \"file id " \
+    "in out\": it reads the frames it receives from the FIFO at path in, " \
+    "and writes the frames it transmits to the FIFO at path out. over shm, " \
+    "the node runs as \"file id shm\", with a region of two rings of " \
+    "frames on descriptor 3 and eventfd doorbells on 4 and 5, as laid " \
+    "out in shm.c.", &add_command},
   {"del", 1, "del <id>: remove a node.", \
     "remove the node that identifies by <id>.", &del_command},
+  {"move", 3, "move <id> <x> <y>: move a node to coordinates <x>, <y>.", \
+    "move the node that identifies by <id> to coordinates <x>, <y>.", \
+    &move_command},
+  {"mob", 2, "mob <id> <static|walk|waypoint> [speed]: set node mobility.", \
+    "set the mobility model of the node that identifies by <id>: static, a " \
+    "random walk, or random waypoints, moving at [speed] units per second.", \
+    &mob_command},
+  {"path", 3, "path <id> <x> <y> [<x> <y> ...]: script a node trajectory.", \
+    "move the node that identifies by <id> through the coordinates given, in " \
+    "order, at its speed. up to 15 <x> <y> pairs are taken at a time, and a " \
+    "trajectory in progress is extended.", &path_command},
+  {"load", 1, "load <file>: add the nodes of a scenario file.", \
+    "add every node of the scenario <file>, and rebuild the sibling links. " \
+    "a text scenario holds one node per line, as \"x y\" or \"add x y\". " \
+    "a binary scenario holds the header \"PSTLNODE\", a 32 bit version (1), " \
+    "32 bits of zero and a 64 bit count, followed by count pairs of doubles, " \
+    "x then y, all in host byte order.", &load_command},
+  {"save", 1, "save <file>: save the state of the simulation.", \
+    "save every node, its position, radius, links, mobility and id, the " \
+    "simulated clock, the next mobility tick and the state of the random " \
+    "generator to <file>, to be restored later. node processes and frames " \
+    "in flight aren't saved.", &save_command},
+  {"restore", 1, "restore <file>: restore a saved state of the simulation.", \
+    "replace every node with the nodes saved in <file>, with their ids, " \
+    "links and mobility, and set the clock to the time of the save. " \
+    "running node processes are stopped, and frames in flight dropped.", \
+    &restore_command},
+  {"trace", 0, "trace [file|stop] [deflate]: record a trace of the network.", \
+    "display the trace recorded and the replay in progress, if any. with " \
+    "[file], record every node added, deleted or moved, every link up or " \
+    "down and every frame sent, received or dropped to [file], as a " \
+    "compact binary log, deflated with [deflate], and starting with the " \
+    "nodes and links already there. stop ends the recording.", \
+    &trace_command},
+  {"replay", 1, "replay <file|stop> [speed]: replay a trace.", \
+    "replace every node with the nodes of the trace <file>, and replay " \
+    "their additions, deletions and moves at [speed] times the pace they " \
+    "were recorded at, up to 100. links follow from the nodes, and frames " \
+    "aren't replayed. stop ends the replay.", &replay_command},
   {"list", 0, "list: list information about nodes.", \
     "list id and coordinates for all nodes in the simulation.", &list_command},
+  {"sibs", 1, "sibs <id>: list the nodes in range of a node.", \
+    "list id and coordinates for the nodes in transmission range of the node " \
+    "that identifies by <id>.", &sibs_command},
+  {"bench", 0, "bench [n]: benchmark the spatial indexes.", \
+    "time insert, range query, nearest neighbor and removal on each spatial " \
+    "index with [n] random nodes, or 10^3 to 10^6 nodes by default.", \
+    &bench_command},
+  {"rebuild", 0, "rebuild: recompute all sibling links.", \
+    "drop and recompute the sibling links of every node from scratch.", \
+    &rebuild_command},
+  {"simd", 0, "simd [kernel] [check]: display or select the range kernel.", \
+    "display the kernel that tests nodes for range, or select one of " \
+    "avx512, avx2, sse2, scalar or auto (the fastest supported). with " \
+    "[check], every test is cross checked against the scalar kernel.", \
+    &simd_command},
+  {"clock", 0, "clock [mode] [seconds]: display or set the simulated clock.", \
+    "display the simulated time and the events waiting, or set the clock " \
+    "to realtime (paced by the wall clock), afap (as fast as possible) or " \
+    "pause. with [seconds], the clock pauses after that much simulated " \
+    "time.", &clock_command},
+  {"pool", 0, "pool: display allocator occupancy.", \
+    "display the object size, chunks, capacity, objects in use and free " \
+    "objects of each allocation pool.", &pool_command},
+  {"stats", 0, "stats: display counters and latency histograms.", \
+    "display the frames sent, delivered and dropped, and the count, mean, " \
+    "quantiles and max of the time taken to add and delete nodes, to lock " \
+    "and hold the node list, to query the spatial index, to rebuild sibling " \
+    "links and to draw a frame, across every thread.", &stats_command},
   {"help", 0, "help [topic]: display help for a specific [topic].", \
     "display help for a specific [topic].", &help_command},
   {"quit", 0, "quit: safely shutdown the simulation.", \
@@ -130,84 +500,558 @@ static void help_command(int argc, char **argv)
 
 static void add_command(int argc, char **argv)
 {
-  G_LOCK(node_head);
-  if (add_node(strtod(argv[1], NULL), strtod(argv[2], NULL)))
+  int64_t id;
+  const struct transport_ops *ops = transports[0];
+
+  if (argc > 3 && !(ops = find_transport(argv[4]))) {
+    print_msg("Error: unknown transport %s\n", argv[4]);
+    return;
+  }
+  NODE_LOCK();
+  id = add_node(strtod(argv[1], NULL), strtod(argv[2], NULL));
+  if (id < 0)
     print_msg("Error: unable to add node at %.0f, %.0f\n", \
       strtod(argv[1], NULL), strtod(argv[2], NULL));
-  G_UNLOCK(node_head);
+  else if (argc > 2 && spawn_proc(find_node(id), argv[3], ops)) {
+    print_msg("Error: unable to run %s as node %" PRId64 "\n", argv[3], id);
+    del_node(id);
+  }
+  NODE_UNLOCK();
 }
 
 static void del_command(int argc, char **argv)
 {
-  G_LOCK(node_head);
-  if (sizeof(intptr_t) == sizeof(int)) {
-    if (del_node(atoi(argv[1])))
-      print_msg("Error: unable to find node %ld\n", atoi(argv[1]));
+  NODE_LOCK();
+  if (del_node(parse_id(argv[1])))
+    print_msg("Error: unable to find node %s\n", argv[1]);
+  NODE_UNLOCK();
+}
+
+static void move_command(int argc, char **argv)
+{
+  struct node *nodep;
+
+  NODE_LOCK();
+  nodep = find_node(parse_id(argv[1]));
+  if (!nodep)
+    print_msg("Error: unable to find node %s\n", argv[1]);
+  else if (move_node(nodep, strtod(argv[2], NULL), strtod(argv[3], NULL)))
+    print_msg("Error: unable to move node %s to %.0f, %.0f\n", argv[1], \
+      strtod(argv[2], NULL), strtod(argv[3], NULL));
+  NODE_UNLOCK();
+}
+
+static void mob_command(int argc, char **argv)
+{
+  int i;
+  struct node *nodep;
+  const char *models[] = {"static", "walk", "waypoint"};
+
+  for (i = 0; i < 3; i++) {
+    if (!strcasecmp(argv[2], models[i]))
+      break;
+  }
+  if (i == 3) {
+    print_msg("Invalid mobility model: %s\n", argv[2]);
+    return;
+  }
+
+  NODE_LOCK();
+  nodep = find_node(parse_id(argv[1]));
+  if (!nodep)
+    print_msg("Error: unable to find node %s\n", argv[1]);
+  else
+    set_mobility(nodep, i, (argc > 2) ? strtod(argv[3], NULL) : 0.0);
+  NODE_UNLOCK();
+}
+
+static void path_command(int argc, char **argv)
+{
+  int i;
+  struct node *nodep;
+
+  /* A line cut short at MAX_ARGV arguments leaves an odd one out too */
+  if ((argc - 1) % 2) {
+    print_msg("path: expected <x> <y> pairs, up to %d of them.\n", \
+      (MAX_ARGV - 2) / 2);
+    return;
   }
-  else if (sizeof(intptr_t) == sizeof(long)) {
-    if (del_node(atol(argv[1])))
-      print_msg("Error: unable to find node %ld\n", atol(argv[1]));
+  NODE_LOCK();
+  nodep = find_node(parse_id(argv[1]));
+  if (!nodep) {
+    print_msg("Error: unable to find node %s\n", argv[1]);
+    goto peace;
+  }
+  for (i = 2; i + 1 <= argc; i += 2) {
+    if (add_waypoint(nodep, strtod(argv[i], NULL), \
+      strtod(argv[i + 1], NULL))) {
+      print_msg("Error: unable to add waypoint %.0f, %.0f\n", \
+        strtod(argv[i], NULL), strtod(argv[i + 1], NULL));
+      break;
+    }
   }
-  G_UNLOCK(node_head);
+  if (nodep->mob.model != MOBILITY_PATH)
+    set_mobility(nodep, MOBILITY_PATH, nodep->mob.speed);
+
+peace:
+  NODE_UNLOCK();
 }
 
-static void list_command(int argc, char **argv)
+static void load_command(int argc, char **argv)
+{
+  uint64_t start = uv_hrtime();
+  int64_t n;
+
+  NODE_LOCK();
+  n = load_scenario(argv[1]);
+  NODE_UNLOCK();
+  if (n < 0)
+    print_msg("Error: unable to load %s\n", argv[1]);
+  else
+    print_msg("Loaded %" PRId64 " node(s) in %.3f ms\n", n, \
+      (uv_hrtime() - start) / 1e6);
+}
+
+static void save_command(int argc, char **argv)
+{
+  uint64_t start = uv_hrtime();
+  int64_t n;
+
+  NODE_LOCK();
+  n = save_state(argv[1]);
+  NODE_UNLOCK();
+  if (n < 0)
+    print_msg("Error: unable to save %s\n", argv[1]);
+  else
+    print_msg("Saved %" PRId64 " node(s) in %.3f ms\n", n, \
+      (uv_hrtime() - start) / 1e6);
+}
+
+static void restore_command(int argc, char **argv)
+{
+  uint64_t start = uv_hrtime();
+  int64_t n;
+
+  NODE_LOCK();
+  n = restore_state(argv[1]);
+  NODE_UNLOCK();
+  if (n < 0)
+    print_msg("Error: unable to restore %s\n", argv[1]);
+  else
+    print_msg("Restored %" PRId64 " node(s) in %.3f ms\n", n, \
+      (uv_hrtime() - start) / 1e6);
+}
+
+static void trace_command(int argc, char **argv)
+{
+  int recording;
+  uint64_t records, dropped, bytes, applied;
+  double speed, seconds;
+  const char *path;
+
+  if (argc >= 1 && !strcasecmp(argv[1], "stop")) {
+    if (stop_trace())
+      print_msg("Error: not recording a trace\n");
+  }
+  else if (argc >= 1) {
+    NODE_READ_LOCK();
+    if (start_trace(argv[1], (argc > 1) && !strcasecmp(argv[2], "deflate")))
+      print_msg("Error: unable to record a trace to %s\n", argv[1]);
+    NODE_READ_UNLOCK();
+  }
+  if ((path = get_trace(&records, &dropped, &bytes, &recording)))
+    print_msg("trace: %s %s, %" PRIu64 " record(s), %" PRIu64 " dropped, " \
+      "%" PRIu64 " KiB written\n", recording ? "recording" : "recorded", \
+      path, records, dropped, bytes / 1024);
+  if ((path = get_replay(&applied, &speed, &seconds)))
+    print_msg("replay: %s at %.0fx, %.3f s in, %" PRIu64 " record(s) " \
+      "applied\n", path, speed, seconds, applied);
+}
+
+static void replay_command(int argc, char **argv)
 {
+  if (!strcasecmp(argv[1], "stop")) {
+    if (stop_replay())
+      print_msg("Error: not replaying a trace\n");
+    return;
+  }
+  NODE_LOCK();
+  if (start_replay(argv[1], (argc > 1) ? strtod(argv[2], NULL) : 1.0))
+    print_msg("Error: unable to replay %s\n", argv[1]);
+  NODE_UNLOCK();
+}
+
+/* A node added or deleted while the list runs may or may not be listed */
+static int list_step(uint64_t deadline)
+{
+  int i, done = FALSE;
   struct node *nodep;
 
-  G_LOCK(node_head);
+  NODE_READ_LOCK();
+  do {
+    for (i = 0; i < JOB_CHECK; i++) {
+      if (!(nodep = walk_nodes(&job.cursor))) {
+        done = TRUE;
+        break;
+      }
+      print_msg("%" PRId64 "\t\t%.0f\t%.0f\n", nodep->id, nodep->x, \
+        nodep->y);
+    }
+  } while (!done && out_bytes <= OUT_HIGH && uv_hrtime() < deadline);
+  NODE_READ_UNLOCK();
+  return done;
+}
+
+static void list_command(int argc, char **argv)
+{
   print_msg("node id\t\t\tx\ty\n");
   print_msg("---------------\t\t----\t----\n");
-  LIST_FOREACH(nodep, &node_head, nodes) {
-    print_msg("%ld\t\t%.0f\t%.0f\n", nodep->id, nodep->x, nodep->y);
+  job.cursor = UINT32_MAX;
+  start_job(&list_step);
+}
+
+/* On the thread pool */
+static void sibs_query(uv_work_t *req)
+{
+  struct node *nodep;
+  struct sibling *sibp;
+
+  NODE_READ_LOCK();
+  nodep = find_node(query.id);
+  if (!nodep) {
+    g_string_append_printf(query.out, "Error: unable to find node %" \
+      PRId64 "\n", query.id);
+    goto peace;
+  }
+  g_string_append_printf(query.out, "%u node(s) in range of %" PRId64 \
+    "\n", nodep->sib_count, nodep->id);
+  g_string_append(query.out, "node id\t\t\tx\ty\n");
+  g_string_append(query.out, "---------------\t\t----\t----\n");
+  LIST_FOREACH(sibp, &nodep->siblings, sibs) {
+    g_string_append_printf(query.out, "%" PRId64 "\t\t%.0f\t%.0f\n", \
+      sibp->node->id, sibp->node->x, sibp->node->y);
+  }
+
+peace:
+  NODE_READ_UNLOCK();
+}
+
+static void sibs_command(int argc, char **argv)
+{
+  query.id = parse_id(argv[1]);
+  start_query(&sibs_query);
+}
+
+/* On the thread pool, one index at one size per turn, query.i being the size
+ * and query.j the index. bench_index() fills a scratch index of its own, and
+ * takes no lock on the nodes. */
+static void bench_query(uv_work_t *req)
+{
+  struct index_bench res;
+
+  if (bench_index(index_backends[query.j], query.sizes[query.i], &res))
+    g_string_append_printf(query.out, "Error: unable to benchmark %s with " \
+      "%zu nodes\n", index_backends[query.j]->name, query.sizes[query.i]);
+  else
+    g_string_append_printf(query.out, \
+      "%s\t%-7zu\t\t%.0f\t%.0f\t%.0f\t%.0f\t%zu\n", \
+      index_backends[query.j]->name, query.sizes[query.i], res.insert, \
+      res.range, res.nearest, res.remove, res.found);
+  if (!index_backends[++query.j]) {
+    query.j = 0;
+    query.i++;
+  }
+  if (query.i < query.count)
+    query.again = TRUE;
+  else
+    g_string_append(query.out, \
+      "(nanoseconds per operation, average nodes found in range)\n");
+}
+
+static void bench_command(int argc, char **argv)
+{
+  size_t sizes[] = {1000, 10000, 100000, 1000000};
+
+  memcpy(query.sizes, sizes, sizeof(sizes));
+  query.count = 4;
+  if (argc >= 1) {
+    query.sizes[0] = strtoul(argv[1], NULL, 10);
+    query.count = 1;
+  }
+  query.i = query.j = 0;
+  print_msg("index\tnodes\t\tinsert\trange\tnearest\tremove\tfound\n");
+  print_msg("-----\t-------\t\t------\t-----\t-------\t------\t-----\n");
+  start_query(&bench_query);
+}
+
+static void rebuild_command(int argc, char **argv)
+{
+  uint64_t start = uv_hrtime();
+
+  NODE_LOCK();
+  if (rebuild_siblings())
+    print_msg("Error: unable to rebuild sibling links\n");
+  else
+    print_msg("Rebuilt sibling links in %.3f ms\n", \
+      (uv_hrtime() - start) / 1e6);
+  NODE_UNLOCK();
+}
+
+static void simd_command(int argc, char **argv)
+{
+  int check;
+  const char *name;
+
+  if (argc >= 1 && set_simd(argv[1], (argc > 1) && \
+    !strcasecmp(argv[2], "check")))
+    print_msg("Error: unknown or unsupported kernel %s\n", argv[1]);
+  name = get_simd(&check);
+  print_msg("range kernel: %s%s\n", name, check ? " (cross checked)" : "");
+}
+
+static void clock_command(int argc, char **argv)
+{
+  int mode;
+  size_t events;
+  uint64_t now, until;
+  const char *name;
+
+  if (argc >= 1) {
+    if ((mode = find_clock(argv[1])) < 0) {
+      print_msg("Error: unknown clock mode %s\n", argv[1]);
+      return;
+    }
+    set_clock(mode, (argc > 1) ? strtod(argv[2], NULL) : 0.0);
+  }
+  name = get_clock(&now, &until, &events);
+  print_msg("clock: %s at %.3f s, %zu event(s) waiting\n", name, now / 1e9, \
+    events);
+  if (until != UINT64_MAX)
+    print_msg("pausing at %.3f s\n", until / 1e9);
+}
+
+static void pool_command(int argc, char **argv)
+{
+  size_t i, n;
+  struct pool_stats stats[8];
+
+  n = all_pool_stats(stats, sizeof(stats) / sizeof(stats[0]));
+  print_msg("pool\t\tsize\tchunks\tcapacity\tused\t\tfree\t\tKiB\n");
+  print_msg("----\t\t----\t------\t--------\t----\t\t----\t\t---\n");
+  for (i = 0; i < n; i++) {
+    print_msg("%-15s\t%zu\t%zu\t%-15zu\t%-15zu\t%-15zu\t%zu\n", \
+      stats[i].name, stats[i].size, stats[i].chunks, stats[i].capacity, \
+      stats[i].used, stats[i].free, stats[i].bytes / 1024);
+  }
+}
+
+static void stats_command(int argc, char **argv)
+{
+  int i;
+  struct metric_summary counts[METRIC_COUNTS], times[METRIC_TIMES], *t;
+
+  get_metrics(counts, times);
+  print_msg("count\t\t\tvalue\n");
+  print_msg("-----\t\t\t-----\n");
+  for (i = 0; i < METRIC_COUNTS; i++)
+    print_msg("%-23s\t%" PRIu64 "\n", counts[i].name, counts[i].count);
+  print_msg("time\t\t\tcount\t\tmean\tp50\tp90\tp99\tp99.9\tmax\n");
+  print_msg("----\t\t\t-----\t\t----\t---\t---\t---\t-----\t---\n");
+  for (i = 0; i < METRIC_TIMES; i++) {
+    t = &times[i];
+    print_msg("%-23s\t%-15" PRIu64 "\t%.1f\t%.1f\t%.1f\t%.1f\t%.1f\t%.1f\n", \
+      t->name, t->count, t->count ? t->sum / 1e3 / t->count : 0.0, \
+      t->p50 / 1e3, t->p90 / 1e3, t->p99 / 1e3, t->p999 / 1e3, t->max / 1e3);
+  }
+  print_msg("(microseconds, quantiles within an eighth)\n");
+}
+
+/* Returns -1 on failure (to make room for another command), 0 on success */
+static int batch_reserve(void)
+{
+  size_t cap;
+  double *xy;
+  int64_t *ids;
+
+  if (batch_n < batch_cap)
+    return 0;
+  cap = batch_cap ? batch_cap * 2 : 1024;
+  if (!(xy = realloc(batch_xy, cap * 2 * sizeof(double))))
+    return -1;
+  batch_xy = xy;
+  if (!(ids = realloc(batch_ids, cap * sizeof(int64_t))))
+    return -1;
+  batch_ids = ids;
+  batch_cap = cap;
+  return 0;
+}
+
+/* Run the adds or dels batched so far */
+static void batch_flush(void)
+{
+  size_t i;
+
+  if (!batch_n)
+    return;
+  NODE_LOCK();
+  if (batch_kind == BATCH_DEL) {
+    for (i = 0; i < batch_n; i++) {
+      if (del_node(batch_ids[i]))
+        print_msg("Error: unable to find node %" PRId64 "\n", batch_ids[i]);
+    }
+  }
+  else if (add_nodes(batch_xy, batch_n, batch_ids) < 0) {
+    print_msg("Error: unable to add %zu node(s)\n", batch_n);
+  }
+  else {
+    for (i = 0; i < batch_n; i++) {
+      if (batch_ids[i] < 0)
+        print_msg("Error: unable to add node at %.0f, %.0f\n", \
+          batch_xy[2 * i], batch_xy[2 * i + 1]);
+    }
+  }
+  NODE_UNLOCK();
+  batch_n = 0;
+  batch_kind = BATCH_NONE;
+}
+
+/* Run a command, or batch it with the adds or dels before it */
+static void run_line(char *line)
+{
+  char **arg, *argv[MAX_ARGV + 1];
+  int i, argc = 0;
+  enum console_batch kind = BATCH_NONE;
+
+  arg = argv;
+  if (!(*arg++ = strtok(line, CONSOLE_SPACE)))
+    return;
+  while((*arg++ = strtok(NULL, CONSOLE_SPACE)) && argc < (MAX_ARGV - 1))
+    argc++;
+
+  /* Only an add without a process, and a del, are batched */
+  if (!strcasecmp(argv[0], "add") && argc == 2)
+    kind = BATCH_ADD;
+  else if (!strcasecmp(argv[0], "del") && argc == 1)
+    kind = BATCH_DEL;
+  if (kind != batch_kind)
+    batch_flush();
+  if (kind != BATCH_NONE && !batch_reserve()) {
+    batch_kind = kind;
+    if (kind == BATCH_ADD) {
+      batch_xy[2 * batch_n] = strtod(argv[1], NULL);
+      batch_xy[2 * batch_n + 1] = strtod(argv[2], NULL);
+    }
+    else {
+      batch_ids[batch_n] = parse_id(argv[1]);
+    }
+    batch_n++;
+    return;
+  }
+  batch_flush();
+
+  for(i = 0; i < CONSOLE_COMMANDS; i++) {
+    if (!strcasecmp(argv[0], commands[i].name)) {
+      if (argc < commands[i].req_arg)
+        print_msg("%s: not enough arguments.\n", argv[0]);
+      else
+        commands[i].function(argc, argv);
+      return;
+    }
+  }
+  print_msg("Invalid command: %s\n", argv[0]);
+}
+
+/* Run every complete line read, and keep the rest for the next read */
+static void run_lines(void)
+{
+  char *line = console_in, *end, *last = console_in + console_len;
+
+  while (!console_closed && !console_paused && \
+    (end = memchr(line, '\n', last - line))) {
+    *end = '\0';
+    if (!console_skip)
+      run_line(line);
+    console_skip = FALSE;
+    line = end + 1;
+  }
+  console_len = console_closed ? 0 : last - line;
+  memmove(console_in, line, console_len);
+  /* A line that fills the buffer is dropped, up to its end */
+  if (!console_paused && console_len == CONSOLE_BUFFER) {
+    if (!console_skip)
+      print_msg("Error: dropped a line longer than %d bytes\n", \
+        CONSOLE_BUFFER);
+    console_skip = TRUE;
+    console_len = 0;
   }
-  G_UNLOCK(node_head);
 }
 
 /* Callback when data is readable on stdin */
 static void stdin_cb(uv_poll_t *handle, int status, int events)
 {
-  char buf[4096];
-  char **arg, *argv[MAX_ARGV];
-  int rv, i, argc = 0;
-
-  bzero(&buf, sizeof(buf));
-  rv = read(STDIN_FILENO, buf, sizeof(buf));
-  buf[4096] = '\0';
-  if (rv >= 0) {
-    /* Process the input */
-    arg = argv;
-    if ((*arg++ = strtok(buf, " \n"))) {
-      while((*arg++ = strtok(NULL, " \n")) && argc < (MAX_ARGV - 1))
-          argc++;
-      for(i = 0; i < CONSOLE_COMMANDS; i++) {
-        if (!strcasecmp(argv[0], commands[i].name)) {
-          if (argc < commands[i].req_arg) {
-            print_msg("%s: not enough arguments.\n", argv[0]);
-            goto peace;
-          }
-          else {
-            commands[i].function(argc, argv);
-            goto peace;
-          }
-        }
-      }
-    }
-    print_msg("Invalid command: %s\n", argv[0]);
+  int i;
+  ssize_t rv = -1;
+
+  errno = EAGAIN;
+  for (i = 0; i < CONSOLE_READS && !console_closed && !console_paused; i++) {
+    rv = read(STDIN_FILENO, console_in + console_len, \
+      CONSOLE_BUFFER - console_len);
+    if (rv <= 0)
+      break;
+    console_len += rv;
+    run_lines();
   }
-  else if (errno != EAGAIN && errno != EINPROGRESS) {
+  if (!rv && !console_closed && !console_paused) {
+    /* The last line may end without a newline */
+    console_in[console_len] = '\0';
+    if (!console_skip)
+      run_line(console_in);
+    console_len = 0;
+    console_eof = TRUE;
+    uv_poll_stop(&stdin_watcher);
+  }
+  else if (rv < 0 && errno != EAGAIN && errno != EINPROGRESS) {
     fprintf(stderr, "Error on read() from stdin: %s\n", strerror(errno));
-    return;
   }
+  batch_flush();
+  if (!console_paused)
+    print_prompt();
+}
 
-peace:
+/* Carry on with the job, or run the commands read while output was backed up
+ * or the job ran, then read on */
+static void console_resume(void)
+{
+  if (query.running)
+    return;
+  if (job.step) {
+    uv_idle_start(&job_idle, &job_cb);
+    return;
+  }
+  console_paused = FALSE;
+  run_lines();
+  batch_flush();
+  if (console_paused || console_closed)
+    return;
+  if (!console_eof)
+    uv_poll_start(&stdin_watcher, UV_READABLE, stdin_cb);
   print_prompt();
 }
 
+/* The output left is written out before returning */
 void shutdown_console(void)
 {
+  int val = fcntl(STDOUT_FILENO, F_GETFL, 0);
+
+  console_closed = TRUE;
   uv_poll_stop(&stdin_watcher);
   uv_signal_stop(&sigint_watcher);
+  uv_idle_stop(&job_idle);
+  job.step = NULL;
+  out_stop();
+  if (val != -1)
+    fcntl(STDOUT_FILENO, F_SETFL, val & ~O_NONBLOCK);
+  out_drain();
 }
 
 int init_console(uv_loop_t *loop)
@@ -226,18 +1070,20 @@ int init_console(uv_loop_t *loop)
     goto peace;
   }
 
-  printf(" _  _  __|_ _ |\n" \
-         "|_)(_)_> |_(/_|\n" \
-         "|\n" \
-         "postel: %s\n" \
-         "copyright  2015 Jack Morton <jhm@jemscout.com>\n" \
-         "please read LICENSE for copyright details.\n",  VERSION);
-  print_prompt();
-
   /* Spawn input and output callbacks */
   uv_poll_init(loop, &stdin_watcher, STDIN_FILENO);
-  uv_poll_init(loop, &stdout_watcher, STDOUT_FILENO);
+  out_pollable = !uv_poll_init(loop, &stdout_watcher, STDOUT_FILENO);
+  uv_idle_init(loop, &out_idle);
+  uv_idle_init(loop, &job_idle);
   uv_poll_start(&stdin_watcher, UV_READABLE, stdin_cb);
+
+  print_msg(" _  _  __|_ _ |\n" \
+            "|_)(_)_> |_(/_|\n" \
+            "|\n" \
+            "postel: %s\n" \
+            "copyright  2015 Jack Morton <jhm@jemscout.com>\n" \
+            "please read LICENSE for copyright details.\n",  VERSION);
+  print_prompt();
   uv_signal_init(loop, &sigint_watcher);
   uv_signal_start(&sigint_watcher, sigint_cb, SIGINT);
 
@@ -0,0 +1,155 @@
+/* load.c: bulk loading of scenarios.
+ * Copyright  2015 Jack Morton <jhm@jemscout.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "postel.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <glib.h>
+
+/* A scenario is a list of node positions, in one of two formats:
+ *
+ * Text, one node per line as "x y", or "add x y" so that a script of console
+ * commands loads as well. Blank lines and lines starting with '#' are
+ * skipped.
+ *
+ * Binary, a struct load_header followed by count pairs of doubles, x then y,
+ * all in the byte order of the host. The file is mapped, and the positions
+ * are handed to add_nodes() straight from the mapping. */
+#define LOAD_MAGIC "PSTLNODE"
+#define LOAD_VERSION 1
+
+struct load_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t flags;  /* Unused, zero */
+  uint64_t count;
+};
+
+/* Returns -1 on failure, the number of nodes added on success */
+static int64_t load_binary(const char *path, const char *map, size_t size)
+{
+  struct load_header hdr;
+
+  memcpy(&hdr, map, sizeof(hdr));
+  if (hdr.version != LOAD_VERSION || \
+    hdr.count > (size - sizeof(hdr)) / (2 * sizeof(double))) {
+    fprintf(stderr, "%s: not a version %d scenario of %llu nodes.\n", path, \
+      LOAD_VERSION, (unsigned long long)hdr.count);
+    return -1;
+  }
+  return add_nodes((const double *)(map + sizeof(hdr)), hdr.count, NULL);
+}
+
+/* Returns -1 on failure, the number of nodes added on success */
+static int64_t load_text(const char *path, const char *map, size_t size)
+{
+  int64_t err = -1;
+  size_t n = 0, cap = 0, line = 0;
+  double *xy = NULL, *grown;
+  char *text, *p, *end, *next;
+
+  /* strtod() wants a terminated string, which a mapping doesn't give */
+  if (!(text = malloc(size + 1)))
+    return -1;
+  memcpy(text, map, size);
+  text[size] = '\0';
+
+  for (p = text; *p; p = next) {
+    line++;
+    if ((next = strchr(p, '\n')))
+      *next++ = '\0';
+    else
+      next = p + strlen(p);
+    p += strspn(p, " \t\r");
+    if (!*p || *p == '#')
+      continue;
+    if (!strncasecmp(p, "add", 3) && (p[3] == ' ' || p[3] == '\t'))
+      p += 3;
+    if (n == cap) {
+      cap = cap ? cap * 2 : 1024;
+      if (!(grown = realloc(xy, cap * 2 * sizeof(double))))
+        goto peace;
+      xy = grown;
+    }
+    xy[2 * n] = strtod(p, &end);
+    if (end == p)
+      goto bad_line;
+    p = end;
+    xy[2 * n + 1] = strtod(p, &end);
+    if (end == p)
+      goto bad_line;
+    n++;
+  }
+  err = add_nodes(xy, n, NULL);
+  goto peace;
+
+bad_line:
+  fprintf(stderr, "%s:%zu: expected x y.\n", path, line);
+peace:
+  free(xy);
+  free(text);
+  return err;
+}
+
+/* LOCK node_head BEFORE CALLING THIS FUNCTION! */
+/* Add every node of a scenario file. Returns -1 on failure, the number of
+ * nodes added on success */
+int64_t load_scenario(const char *path)
+{
+  int64_t err = -1;
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  char *map;
+
+  if (fd < 0 || fstat(fd, &st)) {
+    fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    goto peace;
+  }
+  if (!st.st_size) {
+    err = 0;
+    goto peace;
+  }
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED) {
+    fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    goto peace;
+  }
+  madvise(map, st.st_size, MADV_SEQUENTIAL);
+  if (st.st_size >= sizeof(struct load_header) && \
+    !memcmp(map, LOAD_MAGIC, sizeof(((struct load_header *)0)->magic)))
+    err = load_binary(path, map, st.st_size);
+  else
+    err = load_text(path, map, st.st_size);
+  munmap(map, st.st_size);
+
+peace:
+  if (fd >= 0)
+    close(fd);
+  return err;
+}
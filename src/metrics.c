@@ -0,0 +1,379 @@
+/* metrics.c: counters and latency histograms, kept per thread.
+ * Copyright  2015 Jack Morton <jhm@jemscout.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "postel.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <glib.h>
+#include <uv.h>
+
+extern struct global_state_struct postel;
+G_LOCK_EXTERN(postel);
+
+/* Each thread counts and times into its own block, found through a GPrivate,
+ * so that recording takes no lock and shares no cache line. The blocks are
+ * only summed as the metrics are read, with relaxed atomics, and live as long
+ * as the process, since a thread may record up to its very end.
+ *
+ * Times are kept in nanoseconds, in log linear histograms as HDR histograms
+ * do: values below METRIC_SUB have a bucket each, and every power of two above
+ * that is split into METRIC_SUB buckets, so a quantile is within 1 / METRIC_SUB
+ * of the truth. With -m, the metrics are written every METRIC_PERIOD to a file
+ * in the Prometheus text format, by way of a temporary file renamed over it,
+ * on the thread pool. */
+#define METRIC_SUB_BITS 3
+#define METRIC_SUB (1 << METRIC_SUB_BITS)
+#define METRIC_BUCKETS ((65 - METRIC_SUB_BITS) * METRIC_SUB)
+#define METRIC_PERIOD 5000  /* Milliseconds between writes of the file */
+#define METRIC_LE_MIN 8     /* Prometheus buckets end below 2^8 ns, */
+#define METRIC_LE_MAX 36    /* up to 2^36 ns, */
+#define METRIC_LE_STEP 2    /* every 4 times as long */
+
+struct metric_hist {
+  uint64_t count, sum, max;
+  uint64_t buckets[METRIC_BUCKETS];
+};
+
+struct metric_thread {
+  SLIST_ENTRY(metric_thread) threads;
+  uint64_t held_at;  /* As node_head was locked */
+  uint64_t counts[METRIC_COUNTS];
+  struct metric_hist times[METRIC_TIMES];
+};
+
+/* Names and help, in the order of the enums in postel.h */
+static const char *metric_counts[][2] = {
+  {"frames_sent", "Frames sent by nodes."},
+  {"frames_delivered", "Frames delivered to siblings."},
+  {"frames_dropped", "Frames dropped on the way to a sibling."}};
+static const char *metric_times[][2] = {
+  {"add_node", "Time to add a node, failures included."},
+  {"del_node", "Time to delete a node, failures included."},
+  {"node_lock_wait", "Time waiting to lock node_head for writing."},
+  {"node_lock_hold", "Time node_head is held for writing."},
+  {"node_read_lock_wait", "Time waiting to lock node_head for reading."},
+  {"node_read_lock_hold", "Time node_head is held for reading."},
+  {"index_query", "Time of a range query of the spatial index."},
+  {"rebuild", "Time to rebuild every sibling link."},
+  {"render_frame", "Time to draw a frame of the renderer."}};
+
+static GPrivate metric_key;
+static GMutex metric_lock;
+static SLIST_HEAD(, metric_thread) metric_head = \
+  SLIST_HEAD_INITIALIZER(metric_head);
+
+static uv_timer_t metric_timer;
+static uv_work_t metric_work;
+static char *metric_path;
+static GString *metric_text;  /* Being written, NULL once done */
+
+/* Returns NULL on failure, the block of the calling thread on success */
+static struct metric_thread *metric_self(void)
+{
+  struct metric_thread *self = g_private_get(&metric_key);
+
+  if (self)
+    return self;
+  if (!(self = calloc(1, sizeof(struct metric_thread))))
+    return NULL;
+  g_private_set(&metric_key, self);
+  g_mutex_lock(&metric_lock);
+  SLIST_INSERT_HEAD(&metric_head, self, threads);
+  g_mutex_unlock(&metric_lock);
+  return self;
+}
+
+/* Only the owner writes, so a load and a store make an add */
+static void metric_add(uint64_t *p, uint64_t n)
+{
+  __atomic_store_n(p, __atomic_load_n(p, __ATOMIC_RELAXED) + n, \
+    __ATOMIC_RELAXED);
+}
+
+static size_t metric_bucket(uint64_t v)
+{
+  int e;
+
+  if (v < METRIC_SUB)
+    return v;
+  e = 63 - __builtin_clzll(v);
+  return (e - METRIC_SUB_BITS + 1) * METRIC_SUB + \
+    ((v >> (e - METRIC_SUB_BITS)) & (METRIC_SUB - 1));
+}
+
+/* Returns the least value of a bucket */
+static uint64_t metric_floor(size_t b)
+{
+  int e;
+
+  if (b < METRIC_SUB)
+    return b;
+  e = b / METRIC_SUB + METRIC_SUB_BITS - 1;
+  return (uint64_t)(METRIC_SUB + b % METRIC_SUB) << (e - METRIC_SUB_BITS);
+}
+
+static void metric_record(struct metric_thread *self, enum metric_time m, \
+  uint64_t ns)
+{
+  struct metric_hist *h = &self->times[m];
+
+  metric_add(&h->count, 1);
+  metric_add(&h->sum, ns);
+  metric_add(&h->buckets[metric_bucket(ns)], 1);
+  if (ns > h->max)
+    __atomic_store_n(&h->max, ns, __ATOMIC_RELAXED);
+}
+
+void count_metric(enum metric_count m, uint64_t n)
+{
+  struct metric_thread *self = metric_self();
+
+  if (self)
+    metric_add(&self->counts[m], n);
+}
+
+/* Record the time since start, from uv_hrtime() */
+void time_metric(enum metric_time m, uint64_t start)
+{
+  struct metric_thread *self = metric_self();
+
+  if (self)
+    metric_record(self, m, uv_hrtime() - start);
+}
+
+/* Lock node_head, timing the wait, and the hold until unlock_nodes() */
+void lock_nodes(int write)
+{
+  struct metric_thread *self = metric_self();
+  uint64_t start = uv_hrtime();
+
+  if (write)
+    g_rw_lock_writer_lock(&node_head_lock);
+  else
+    g_rw_lock_reader_lock(&node_head_lock);
+  if (!self)
+    return;
+  self->held_at = uv_hrtime();
+  metric_record(self, write ? METRIC_LOCK_WAIT : METRIC_READ_LOCK_WAIT, \
+    self->held_at - start);
+}
+
+void unlock_nodes(int write)
+{
+  struct metric_thread *self = g_private_get(&metric_key);
+
+  if (self)
+    metric_record(self, write ? METRIC_LOCK_HOLD : METRIC_READ_LOCK_HOLD, \
+      uv_hrtime() - self->held_at);
+  if (write)
+    g_rw_lock_writer_unlock(&node_head_lock);
+  else
+    g_rw_lock_reader_unlock(&node_head_lock);
+}
+
+/* Sum the histogram m of every thread into h */
+static void metric_sum(enum metric_time m, struct metric_hist *h)
+{
+  struct metric_thread *t;
+  uint64_t max;
+  size_t b;
+
+  memset(h, 0, sizeof(struct metric_hist));
+  SLIST_FOREACH(t, &metric_head, threads) {
+    h->count += __atomic_load_n(&t->times[m].count, __ATOMIC_RELAXED);
+    h->sum += __atomic_load_n(&t->times[m].sum, __ATOMIC_RELAXED);
+    max = __atomic_load_n(&t->times[m].max, __ATOMIC_RELAXED);
+    h->max = MAX(h->max, max);
+    for (b = 0; b < METRIC_BUCKETS; b++)
+      h->buckets[b] += __atomic_load_n(&t->times[m].buckets[b], \
+        __ATOMIC_RELAXED);
+  }
+}
+
+/* Returns the least value of the bucket that holds quantile q */
+static uint64_t metric_quantile(const struct metric_hist *h, double q)
+{
+  uint64_t seen = 0, rank = (uint64_t)(q * h->count);
+  size_t b;
+
+  for (b = 0; b < METRIC_BUCKETS; b++) {
+    seen += h->buckets[b];
+    if (seen > rank)
+      return MIN(metric_floor(b), h->max);
+  }
+  return h->max;
+}
+
+static uint64_t metric_count(enum metric_count m)
+{
+  struct metric_thread *t;
+  uint64_t n = 0;
+
+  SLIST_FOREACH(t, &metric_head, threads)
+    n += __atomic_load_n(&t->counts[m], __ATOMIC_RELAXED);
+  return n;
+}
+
+/* Fill in the METRIC_COUNTS counts, with only a name and a count, and the
+ * METRIC_TIMES times, in nanoseconds, summed over every thread */
+void get_metrics(struct metric_summary *counts, struct metric_summary *times)
+{
+  struct metric_hist *h = malloc(sizeof(struct metric_hist));
+  int m;
+
+  g_mutex_lock(&metric_lock);
+  for (m = 0; m < METRIC_COUNTS; m++) {
+    memset(&counts[m], 0, sizeof(struct metric_summary));
+    counts[m].name = metric_counts[m][0];
+    counts[m].count = metric_count(m);
+  }
+  for (m = 0; m < METRIC_TIMES; m++) {
+    memset(&times[m], 0, sizeof(struct metric_summary));
+    times[m].name = metric_times[m][0];
+    if (!h)
+      continue;
+    metric_sum(m, h);
+    times[m].count = h->count;
+    times[m].sum = h->sum;
+    times[m].max = h->max;
+    times[m].p50 = metric_quantile(h, 0.5);
+    times[m].p90 = metric_quantile(h, 0.9);
+    times[m].p99 = metric_quantile(h, 0.99);
+    times[m].p999 = metric_quantile(h, 0.999);
+  }
+  g_mutex_unlock(&metric_lock);
+  free(h);
+}
+
+/* Returns NULL on failure, the metrics in the Prometheus text format on
+ * success */
+static GString *metric_format(void)
+{
+  GString *s;
+  struct metric_hist *h = malloc(sizeof(struct metric_hist));
+  uint64_t below;
+  size_t b, edge;
+  int m, k;
+
+  if (!h)
+    return NULL;
+  s = g_string_sized_new(16384);
+  g_mutex_lock(&metric_lock);
+  for (m = 0; m < METRIC_COUNTS; m++) {
+    g_string_append_printf(s, "# HELP postel_%s_total %s\n" \
+      "# TYPE postel_%s_total counter\npostel_%s_total %" PRIu64 "\n", \
+      metric_counts[m][0], metric_counts[m][1], metric_counts[m][0], \
+      metric_counts[m][0], metric_count(m));
+  }
+  for (m = 0; m < METRIC_TIMES; m++) {
+    metric_sum(m, h);
+    g_string_append_printf(s, "# HELP postel_%s_seconds %s\n" \
+      "# TYPE postel_%s_seconds histogram\n", metric_times[m][0], \
+      metric_times[m][1], metric_times[m][0]);
+    /* A power of two starts a bucket, so the buckets below it hold exactly
+     * the times under 2^k ns. Times are whole nanoseconds, so le, which
+     * includes its bound, is 2^k - 1 ns, printed to the nanosecond */
+    for (k = METRIC_LE_MIN, b = 0, below = 0; k <= METRIC_LE_MAX; \
+      k += METRIC_LE_STEP) {
+      edge = metric_bucket((uint64_t)1 << k);
+      for (; b < edge; b++)
+        below += h->buckets[b];
+      g_string_append_printf(s, "postel_%s_seconds_bucket{le=\"%.9f\"} %" \
+        PRIu64 "\n", metric_times[m][0], \
+        (double)(((uint64_t)1 << k) - 1) / 1e9, below);
+    }
+    g_string_append_printf(s, "postel_%s_seconds_bucket{le=\"+Inf\"} %" \
+      PRIu64 "\npostel_%s_seconds_sum %.9f\npostel_%s_seconds_count %" \
+      PRIu64 "\n", metric_times[m][0], h->count, metric_times[m][0], \
+      h->sum / 1e9, metric_times[m][0], h->count);
+  }
+  g_mutex_unlock(&metric_lock);
+  free(h);
+  return s;
+}
+
+/* Write the file on the thread pool. Errors are reported on the loop */
+static void metric_write(uv_work_t *req)
+{
+  char *tmp = g_strdup_printf("%s.tmp", metric_path);
+  FILE *f = fopen(tmp, "w");
+
+  req->data = NULL;
+  if (!f || fwrite(metric_text->str, 1, metric_text->len, f) != \
+    metric_text->len) {
+    req->data = "unable to write";
+    if (f)
+      fclose(f);
+  }
+  else if (fclose(f))
+    req->data = "unable to write";
+  else if (rename(tmp, metric_path))
+    req->data = "unable to rename";
+  g_free(tmp);
+}
+
+static void metric_written(uv_work_t *req, int status)
+{
+  if (req->data)
+    fprintf(stderr, "Metrics: %s %s.\n", (char *)req->data, metric_path);
+  g_string_free(metric_text, TRUE);
+  metric_text = NULL;
+}
+
+static void metric_timer_cb(uv_timer_t *handle)
+{
+  /* A slow disk skips a turn */
+  if (metric_text || !(metric_text = metric_format()))
+    return;
+  if (uv_queue_work(handle->loop, &metric_work, &metric_write, \
+    &metric_written)) {
+    g_string_free(metric_text, TRUE);
+    metric_text = NULL;
+  }
+}
+
+/* Stop writing the file. The write in flight, if any, carries on. */
+void shutdown_metrics(void)
+{
+  if (metric_path)
+    uv_timer_stop(&metric_timer);
+}
+
+/* Write the metrics file, if there's one. Returns -1 on failure, 0 on
+ * success */
+int init_metrics(uv_loop_t *loop)
+{
+  const char *path;
+
+  G_LOCK(postel);
+  path = postel.metrics;
+  G_UNLOCK(postel);
+  if (!path)
+    return 0;
+  metric_path = g_strdup(path);
+  uv_timer_init(loop, &metric_timer);
+  return uv_timer_start(&metric_timer, &metric_timer_cb, 0, METRIC_PERIOD) ? \
+    -1 : 0;
+}
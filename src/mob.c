@@ -0,0 +1,302 @@
+/* mob.c: node mobility.
+ * Copyright  2015 Jack Morton <jhm@jemscout.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "postel.h"
+
+#include <stdlib.h>
+#include <math.h>
+
+extern struct global_state_struct postel;
+G_LOCK_EXTERN(postel);
+
+#define MOBILITY_WALK_TIME 1.0   /* Seconds between turns of a random walk */
+#define MOBILITY_MAX_PAUSE 5.0   /* Longest pause at a random waypoint */
+
+/* Only the nodes that move are ticked, static nodes cost nothing, and the
+ * ticks stop while nothing moves */
+static LIST_HEAD(mover_list, node) mob_head = LIST_HEAD_INITIALIZER(mob_head);
+static struct event *mob_event;
+
+/* A xorshift64* generator, seeded the same way on every run so that a
+ * scenario moves the same way twice. Returns a number in [0, 1). */
+static uint64_t mob_seed = 2015;
+
+static double mob_rand(void)
+{
+  mob_seed ^= mob_seed >> 12;
+  mob_seed ^= mob_seed << 25;
+  mob_seed ^= mob_seed >> 27;
+  return (double)((mob_seed * 2685821657736338717ULL) >> 11) / \
+    (double)(1ULL << 53);
+}
+
+/* Pick a new random heading for a walk */
+static void mob_turn(struct node *nodep)
+{
+  double angle = mob_rand() * 2.0 * M_PI;
+
+  nodep->mob.dx = cos(angle);
+  nodep->mob.dy = sin(angle);
+  nodep->mob.timer = MOBILITY_WALK_TIME;
+}
+
+/* Head toward the current waypoint. Returns TRUE once it is reached */
+static int mob_seek(struct node *nodep, double step, double *x, double *y)
+{
+  double dist_x = nodep->mob.tx - nodep->x, dist_y = nodep->mob.ty - nodep->y;
+  double dist = sqrt(dist_x * dist_x + dist_y * dist_y);
+
+  if (dist <= step) {
+    *x = nodep->mob.tx;
+    *y = nodep->mob.ty;
+    return TRUE;
+  }
+  *x = nodep->x + dist_x / dist * step;
+  *y = nodep->y + dist_y / dist * step;
+  return FALSE;
+}
+
+/* Load the next waypoint of a scripted trajectory. Returns FALSE at the end */
+static int mob_next_waypoint(struct node *nodep)
+{
+  struct waypoint *wp = SIMPLEQ_FIRST(&nodep->mob.path);
+
+  if (!wp)
+    return FALSE;
+  nodep->mob.tx = wp->x;
+  nodep->mob.ty = wp->y;
+  SIMPLEQ_REMOVE_HEAD(&nodep->mob.path, wp, points);
+  free(wp);
+  return TRUE;
+}
+
+/* Advance a node by dt seconds within a width x height matrix */
+static void mob_step(struct node *nodep, double dt, double width, \
+  double height)
+{
+  double x = nodep->x, y = nodep->y, step = nodep->mob.speed * dt;
+
+  switch (nodep->mob.model) {
+    case MOBILITY_WALK:
+      if ((nodep->mob.timer -= dt) <= 0.0)
+        mob_turn(nodep);
+      x += nodep->mob.dx * step;
+      y += nodep->mob.dy * step;
+      /* Bounce off the edges of the matrix */
+      if (x < 0.0 || x > width) {
+        x = (x < 0.0) ? -x : 2.0 * width - x;
+        nodep->mob.dx = -nodep->mob.dx;
+      }
+      if (y < 0.0 || y > height) {
+        y = (y < 0.0) ? -y : 2.0 * height - y;
+        nodep->mob.dy = -nodep->mob.dy;
+      }
+      x = CLAMP(x, 0.0, width);
+      y = CLAMP(y, 0.0, height);
+      break;
+    case MOBILITY_WAYPOINT:
+      if (nodep->mob.timer > 0.0) {
+        nodep->mob.timer -= dt;
+        return;
+      }
+      if (mob_seek(nodep, step, &x, &y)) {
+        nodep->mob.tx = mob_rand() * width;
+        nodep->mob.ty = mob_rand() * height;
+        nodep->mob.timer = mob_rand() * MOBILITY_MAX_PAUSE;
+      }
+      break;
+    case MOBILITY_PATH:
+      if (mob_seek(nodep, step, &x, &y) && !mob_next_waypoint(nodep))
+        set_mobility(nodep, MOBILITY_STATIC, 0.0);
+      break;
+    case MOBILITY_STATIC:
+      return;
+  }
+  if (x != nodep->x || y != nodep->y)
+    move_node(nodep, x, y);
+}
+
+static void mob_tick(void *arg);
+
+/* LOCK node_head BEFORE CALLING THIS FUNCTION! */
+/* Schedule the next tick, unless one is due or nothing moves */
+static void mob_schedule(void)
+{
+  unsigned int hz;
+
+  if (mob_event || LIST_EMPTY(&mob_head))
+    return;
+  G_LOCK(postel);
+  hz = MAX(1, postel.mobility_hz);
+  G_UNLOCK(postel);
+  mob_event = sched_in(1000000000 / hz, &mob_tick, NULL, NULL);
+}
+
+/* Tick every moving node forward */
+static void mob_tick(void *arg)
+{
+  struct node *nodep, *next;
+  double width, height, dt;
+
+  G_LOCK(postel);
+  width = postel.matrix_width - postel.matrix_zero;
+  height = postel.matrix_height - postel.matrix_zero;
+  dt = 1.0 / MAX(1, postel.mobility_hz);
+  G_UNLOCK(postel);
+
+  NODE_LOCK();
+  mob_event = NULL;
+  for (nodep = LIST_FIRST(&mob_head); nodep; nodep = next) {
+    next = LIST_NEXT(nodep, mob.movers);
+    mob_step(nodep, dt, width, height);
+  }
+  mob_schedule();
+  NODE_UNLOCK();
+}
+
+/* LOCK node_head BEFORE CALLING THIS FUNCTION! */
+void init_mobility_node(struct node *nodep)
+{
+  nodep->mob.model = MOBILITY_STATIC;
+  nodep->mob.speed = 0.0;
+  nodep->mob.timer = 0.0;
+  SIMPLEQ_INIT(&nodep->mob.path);
+}
+
+/* LOCK node_head BEFORE CALLING THIS FUNCTION! */
+/* Switch the mobility model of a node. A speed of zero or less picks the
+ * default speed. Returns -1 on failure, 0 on success */
+int set_mobility(struct node *nodep, enum mobility_model model, double speed)
+{
+  double width, height;
+
+  if (model == MOBILITY_PATH && SIMPLEQ_EMPTY(&nodep->mob.path))
+    return -1;
+
+  G_LOCK(postel);
+  width = postel.matrix_width - postel.matrix_zero;
+  height = postel.matrix_height - postel.matrix_zero;
+  if (speed <= 0.0)
+    speed = postel.node_speed;
+  G_UNLOCK(postel);
+
+  if (nodep->mob.model == MOBILITY_STATIC && model != MOBILITY_STATIC)
+    LIST_INSERT_HEAD(&mob_head, nodep, mob.movers);
+  else if (nodep->mob.model != MOBILITY_STATIC && model == MOBILITY_STATIC)
+    LIST_REMOVE(nodep, mob.movers);
+  if (nodep->mob.model == MOBILITY_PATH && model != MOBILITY_PATH) {
+    while (mob_next_waypoint(nodep))
+      ;
+  }
+
+  nodep->mob.model = model;
+  nodep->mob.speed = speed;
+  nodep->mob.timer = 0.0;
+  switch (model) {
+    case MOBILITY_WALK:
+      mob_turn(nodep);
+      break;
+    case MOBILITY_WAYPOINT:
+      nodep->mob.tx = mob_rand() * width;
+      nodep->mob.ty = mob_rand() * height;
+      break;
+    case MOBILITY_PATH:
+      mob_next_waypoint(nodep);
+      break;
+    case MOBILITY_STATIC:
+      return 0;
+  }
+  mob_schedule();
+  return 0;
+}
+
+/* LOCK node_head BEFORE CALLING THIS FUNCTION! */
+/* Append a waypoint to the scripted trajectory of a node. Returns -1 on
+ * failure, 0 on success */
+int add_waypoint(struct node *nodep, double x, double y)
+{
+  struct waypoint *wp;
+
+  G_LOCK(postel);
+  /* X and Y must not exceed the matrix size, and must be greater than zero.
+   * NaN fails every comparison, so it is caught first. */
+  if (!isfinite(x) || !isfinite(y) || \
+    (x + postel.matrix_zero) > postel.matrix_width || \
+    ((y + postel.matrix_zero) > postel.matrix_height || \
+     x < 0 || y < 0)) {
+    G_UNLOCK(postel);
+    return -1;
+  }
+  G_UNLOCK(postel);
+
+  if (!(wp = malloc(sizeof(struct waypoint))))
+    return -1;
+  wp->x = x;
+  wp->y = y;
+  SIMPLEQ_INSERT_TAIL(&nodep->mob.path, wp, points);
+  return 0;
+}
+
+/* LOCK node_head BEFORE CALLING THIS FUNCTION! */
+void stop_mobility_node(struct node *nodep)
+{
+  set_mobility(nodep, MOBILITY_STATIC, 0.0);
+  while (mob_next_waypoint(nodep))
+    ;
+}
+
+/* LOCK node_head BEFORE CALLING THIS FUNCTION! */
+/* Hand every moving node to fn, in the order they are ticked. Returns the
+ * time of the next tick, or UINT64_MAX, and the state of the generator at
+ * *seed */
+uint64_t save_mobility(uint64_t *seed, void (*fn)(struct node *, void *), \
+  void *arg)
+{
+  struct node *nodep;
+
+  LIST_FOREACH(nodep, &mob_head, mob.movers)
+    fn(nodep, arg);
+  *seed = mob_seed;
+  return mob_event ? event_time(mob_event) : UINT64_MAX;
+}
+
+/* LOCK node_head BEFORE CALLING THIS FUNCTION! */
+/* Pick up the moves of n nodes, in the order they are ticked, with their
+ * mobility state and paths already in place, the generator at seed and the
+ * next tick at next. No node may be moving yet. */
+void restore_mobility(struct node **movers, size_t n, uint64_t seed, \
+  uint64_t next)
+{
+  while (n--)
+    LIST_INSERT_HEAD(&mob_head, movers[n], mob.movers);
+  mob_seed = seed;
+  if (!mob_event && !LIST_EMPTY(&mob_head) && next != UINT64_MAX)
+    mob_event = sched_at(next, &mob_tick, NULL, NULL);
+  mob_schedule();
+}
+
+void shutdown_mobility(void)
+{
+  if (mob_event)
+    sched_cancel(mob_event);
+  mob_event = NULL;
+}
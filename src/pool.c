@@ -0,0 +1,338 @@
+/* pool.c: pooled slab allocation of fixed size objects.
+ * Copyright  2015 Jack Morton <jhm@jemscout.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "postel.h"
+
+#include <stdlib.h>
+#include <glib.h>
+
+/* Objects are carved out of chunks aligned to a cache line, and each thread
+ * keeps its own list of free objects, so that allocation is a pointer pop with
+ * no lock and no call into malloc. Threads trade free objects with the pool
+ * in batches, under the pool lock, when their list runs dry or grows long.
+ *
+ * A GPrivate must be static, so one key holds an array of the lists of each
+ * thread, and each pool takes a slot in it for as long as it lives. A list
+ * left by a pool shut down is cut off from it, and is freed by its thread on
+ * exit, or once the slot is used again. */
+#define POOL_CACHE_LINE 64
+#define POOL_CHUNK_SIZE (64 * 1024)
+#define POOL_BATCH 64
+#define POOL_SLOTS 16  /* Most pools at once */
+
+/* A free object holds a pointer to the next free object */
+struct pool_free {
+  struct pool_free *next;
+};
+
+struct pool_chunk {
+  SLIST_ENTRY(pool_chunk) chunks;
+};
+
+struct pool_cache {
+  SLIST_ENTRY(pool_cache) caches;
+  struct pool *pool;
+  struct pool_free *head;
+  size_t count;
+};
+
+struct pool_thread {
+  struct pool_cache *caches[POOL_SLOTS];
+};
+
+static struct pool_list pool_head = LIST_HEAD_INITIALIZER(pool_head);
+static unsigned pool_slots;  /* A bit for each slot taken */
+G_LOCK_DEFINE_STATIC(pool_head);
+
+static void pool_thread_free(gpointer data);
+static GPrivate pool_key = G_PRIVATE_INIT(pool_thread_free);
+
+/* Hand a list of free objects back to the pool. LOCK THE POOL FIRST! */
+static void pool_put(struct pool *pool, struct pool_free *head, \
+  struct pool_free *tail, size_t count)
+{
+  tail->next = pool->free;
+  pool->free = head;
+  pool->free_count += count;
+}
+
+/* Return the free objects of a thread that exits to the pool, unless the pool
+ * was shut down first */
+static void pool_cache_free(gpointer data)
+{
+  struct pool_cache *cache = data;
+  struct pool *pool = cache->pool;
+  struct pool_free *tail;
+
+  if (!pool) {
+    free(cache);
+    return;
+  }
+  g_mutex_lock(&pool->lock);
+  if (cache->head) {
+    for (tail = cache->head; tail->next; tail = tail->next)
+      ;
+    pool_put(pool, cache->head, tail, cache->count);
+  }
+  SLIST_REMOVE(&pool->caches, cache, pool_cache, caches);
+  g_mutex_unlock(&pool->lock);
+  free(cache);
+}
+
+static void pool_thread_free(gpointer data)
+{
+  struct pool_thread *self = data;
+  int i;
+
+  for (i = 0; i < POOL_SLOTS; i++) {
+    if (self->caches[i])
+      pool_cache_free(self->caches[i]);
+  }
+  free(self);
+}
+
+/* Returns NULL on failure, the free list of the calling thread on success */
+static struct pool_cache *pool_cache(struct pool *pool)
+{
+  struct pool_thread *self = g_private_get(&pool_key);
+  struct pool_cache *cache;
+
+  if (!self) {
+    if (!(self = calloc(1, sizeof(struct pool_thread))))
+      return NULL;
+    g_private_set(&pool_key, self);
+  }
+  if ((cache = self->caches[pool->slot])) {
+    if (cache->pool == pool)
+      return cache;
+    /* Left by a pool shut down */
+    free(cache);
+    self->caches[pool->slot] = NULL;
+  }
+  if (!(cache = calloc(1, sizeof(struct pool_cache))))
+    return NULL;
+  cache->pool = pool;
+  g_mutex_lock(&pool->lock);
+  SLIST_INSERT_HEAD(&pool->caches, cache, caches);
+  g_mutex_unlock(&pool->lock);
+  self->caches[pool->slot] = cache;
+  return cache;
+}
+
+/* Refill the free list of a thread with a batch of objects, carving a new
+ * chunk when the pool has none left. Returns -1 on failure, 0 on success */
+static int pool_refill(struct pool *pool, struct pool_cache *cache)
+{
+  int err = 0;
+  size_t i;
+  char *obj;
+  struct pool_chunk *chunk;
+  struct pool_free *objp;
+
+  g_mutex_lock(&pool->lock);
+  if (!pool->free) {
+    if (posix_memalign((void **)&chunk, POOL_CACHE_LINE, POOL_CHUNK_SIZE)) {
+      err = -1;
+      goto peace;
+    }
+    SLIST_INSERT_HEAD(&pool->chunks, chunk, chunks);
+    pool->chunk_count++;
+    pool->capacity += pool->per_chunk;
+    /* Objects start on the first aligned boundary after the chunk header */
+    obj = (char *)chunk + pool->offset;
+    for (i = 0; i < pool->per_chunk; i++, obj += pool->size) {
+      objp = (struct pool_free *)obj;
+      objp->next = pool->free;
+      pool->free = objp;
+    }
+    pool->free_count += pool->per_chunk;
+  }
+  for (i = 0; i < POOL_BATCH && pool->free; i++) {
+    objp = pool->free;
+    pool->free = objp->next;
+    objp->next = cache->head;
+    cache->head = objp;
+  }
+  pool->free_count -= i;
+  cache->count += i;
+
+peace:
+  g_mutex_unlock(&pool->lock);
+  return err;
+}
+
+/* Returns NULL on failure, an uninitialized object on success */
+void *pool_alloc(struct pool *pool)
+{
+  struct pool_cache *cache = pool_cache(pool);
+  struct pool_free *objp;
+
+  if (!cache || (!cache->head && pool_refill(pool, cache)))
+    return NULL;
+  objp = cache->head;
+  cache->head = objp->next;
+  cache->count--;
+  return objp;
+}
+
+void pool_free(struct pool *pool, void *ptr)
+{
+  struct pool_cache *cache = pool_cache(pool);
+  struct pool_free *objp = ptr, *tail;
+  size_t i;
+
+  if (!ptr)
+    return;
+  /* Without a list of its own, the thread hands the object straight back */
+  if (!cache) {
+    g_mutex_lock(&pool->lock);
+    pool_put(pool, objp, objp, 1);
+    g_mutex_unlock(&pool->lock);
+    return;
+  }
+  objp->next = cache->head;
+  cache->head = objp;
+  cache->count++;
+
+  /* Keep one batch and return the rest, so threads don't hoard objects */
+  if (cache->count >= 2 * POOL_BATCH) {
+    for (i = 1, tail = cache->head; i < POOL_BATCH; i++)
+      tail = tail->next;
+    objp = tail->next;
+    tail->next = NULL;
+    for (tail = objp; tail->next; tail = tail->next)
+      ;
+    g_mutex_lock(&pool->lock);
+    pool_put(pool, objp, tail, cache->count - POOL_BATCH);
+    g_mutex_unlock(&pool->lock);
+    cache->count = POOL_BATCH;
+  }
+}
+
+/* Take a snapshot of the occupancy of a pool. Thread lists are read without
+ * their owners stopping, so the counts are approximate while threads run. */
+static void pool_stats(struct pool *pool, struct pool_stats *stats)
+{
+  struct pool_cache *cache;
+
+  g_mutex_lock(&pool->lock);
+  stats->name = pool->name;
+  stats->size = pool->size;
+  stats->chunks = pool->chunk_count;
+  stats->capacity = pool->capacity;
+  stats->free = pool->free_count;
+  SLIST_FOREACH(cache, &pool->caches, caches)
+    stats->free += cache->count;
+  stats->used = stats->capacity - stats->free;
+  stats->bytes = pool->chunk_count * POOL_CHUNK_SIZE;
+  g_mutex_unlock(&pool->lock);
+}
+
+/* Take a snapshot of up to max pools. Returns the number taken */
+size_t all_pool_stats(struct pool_stats *stats, size_t max)
+{
+  size_t n = 0;
+  struct pool *pool;
+
+  G_LOCK(pool_head);
+  LIST_FOREACH(pool, &pool_head, pools) {
+    if (n == max)
+      break;
+    pool_stats(pool, &stats[n++]);
+  }
+  G_UNLOCK(pool_head);
+  return n;
+}
+
+/* Initialize a pool of objects of size bytes. Objects are aligned to a cache
+ * line if align is TRUE, otherwise to a pointer. Returns -1 on failure, 0 on
+ * success */
+int init_pool(struct pool *pool, const char *name, size_t size, int align)
+{
+  size_t boundary = align ? POOL_CACHE_LINE : sizeof(void *);
+
+  size = MAX(size, sizeof(struct pool_free));
+  pool->name = name;
+  pool->size = (size + boundary - 1) / boundary * boundary;
+  pool->offset = (sizeof(struct pool_chunk) + boundary - 1) / boundary * \
+    boundary;
+  if (pool->offset + pool->size > POOL_CHUNK_SIZE)
+    return -1;
+  pool->per_chunk = (POOL_CHUNK_SIZE - pool->offset) / pool->size;
+  pool->free = NULL;
+  pool->free_count = pool->capacity = pool->chunk_count = 0;
+  SLIST_INIT(&pool->chunks);
+  SLIST_INIT(&pool->caches);
+  g_mutex_init(&pool->lock);
+
+  G_LOCK(pool_head);
+  for (pool->slot = 0; pool->slot < POOL_SLOTS; pool->slot++) {
+    if (!(pool_slots & (1U << pool->slot)))
+      break;
+  }
+  if (pool->slot == POOL_SLOTS) {
+    G_UNLOCK(pool_head);
+    return -1;
+  }
+  pool_slots |= 1U << pool->slot;
+  LIST_INSERT_HEAD(&pool_head, pool, pools);
+  G_UNLOCK(pool_head);
+  return 0;
+}
+
+/* Release every chunk of a pool. Every object must have been freed, and no
+ * other thread may use the pool any more. The free lists of threads still
+ * running are left to them, emptied and cut off from the pool, to be freed as
+ * they exit. */
+void shutdown_pool(struct pool *pool)
+{
+  struct pool_chunk *chunk;
+  struct pool_cache *cache;
+  struct pool_thread *self;
+
+  G_LOCK(pool_head);
+  LIST_REMOVE(pool, pools);
+  pool_slots &= ~(1U << pool->slot);
+  G_UNLOCK(pool_head);
+
+  g_mutex_lock(&pool->lock);
+  while (!SLIST_EMPTY(&pool->caches)) {
+    cache = SLIST_FIRST(&pool->caches);
+    SLIST_REMOVE_HEAD(&pool->caches, caches);
+    cache->pool = NULL;
+    cache->head = NULL;
+    cache->count = 0;
+  }
+  while (!SLIST_EMPTY(&pool->chunks)) {
+    chunk = SLIST_FIRST(&pool->chunks);
+    SLIST_REMOVE_HEAD(&pool->chunks, chunks);
+    free(chunk);
+  }
+  pool->free = NULL;
+  pool->free_count = pool->capacity = pool->chunk_count = 0;
+  g_mutex_unlock(&pool->lock);
+  /* The list of this thread is freed now, as it may never exit */
+  if ((self = g_private_get(&pool_key))) {
+    free(self->caches[pool->slot]);
+    self->caches[pool->slot] = NULL;
+  }
+}
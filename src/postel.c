@@ -31,14 +31,34 @@ struct global_state_struct postel = {
   DEFAULT_MATRIX_HEIGHT,
   DEFAULT_NODE_RADIUS_SIZE,
   DEFAULT_NODE_POINT_SIZE,
-  DEFAULT_NODE_RADIUS_SIZE
+  DEFAULT_NODE_RADIUS_SIZE,
+  &tree_index_ops,
+  DEFAULT_NODE_SPEED,
+  DEFAULT_MOBILITY_HZ,
+  DEFAULT_CLOCK,
+  DEFAULT_PROP_SPEED,
+  DEFAULT_HEADLESS,
+  DEFAULT_SCENARIO,
+  DEFAULT_CONTROL,
+  DEFAULT_METRICS
 };
 G_LOCK_DEFINE(postel);
 
 static void usage(const char *argv)
 {
   fprintf(stderr, "postel - version: %s\n"
-                  "usage: %s [-h]\n",
+                  "usage: %s [-h] [-i tree|grid] [-c realtime|afap|pause] "
+                  "[-p speed] [-n] [-s file] [-u socket] [-m file]\n"
+                  "  -i: the spatial index used for neighbor queries\n"
+                  "  -c: the mode of the simulated clock\n"
+                  "  -p: the speed frames travel at, in matrix units per "
+                  "second\n"
+                  "  -n: run headless, without the renderer\n"
+                  "  -s: load the nodes of a scenario file at startup\n"
+                  "  -u: listen for binary control requests on a Unix "
+                  "socket\n"
+                  "  -m: write metrics to a file every few seconds, in the "
+                  "Prometheus text format\n",
                   VERSION, argv);
 }
 
@@ -46,13 +66,15 @@ void shutdown_postel(int err, char **msg)
 {
   shutdown_console();
   shutdown_simulator();
-  shutdown_renderer();
+  /* Headless, the simulator thread returns once its loop runs dry */
+  if (!postel.headless)
+    shutdown_renderer();
 }
 
 /* Welcome to the fantasy zone! Get ready! */
 int main(int argc, const char **argv)
 {
-  int i;
+  int i, mode;
   int err = EXIT_SUCCESS;
   GThread *sim_thread;
   GError *error = NULL;
@@ -61,6 +83,68 @@ int main(int argc, const char **argv)
   for (i = 0; i < argc; i++) {
     if (argv[i][0] == '-') {
       switch(argv[i][1]) {
+        case 'i':
+          if (i + 1 < argc && (postel.index = find_index(argv[i + 1]))) {
+            i++;
+            break;
+          }
+          fprintf(stderr, "Invalid index: %s\n", (i + 1 < argc) ? \
+            argv[i + 1] : "(none)");
+          err = EXIT_FAILURE;
+          usage(argv[0]);
+          goto peace;
+        case 'c':
+          if (i + 1 < argc && (mode = find_clock(argv[i + 1])) >= 0) {
+            postel.clock = mode;
+            i++;
+            break;
+          }
+          fprintf(stderr, "Invalid clock: %s\n", (i + 1 < argc) ? \
+            argv[i + 1] : "(none)");
+          err = EXIT_FAILURE;
+          usage(argv[0]);
+          goto peace;
+        case 'p':
+          if (i + 1 < argc && (postel.prop_speed = \
+            strtod(argv[i + 1], NULL)) >= 0.0) {
+            i++;
+            break;
+          }
+          fprintf(stderr, "Invalid speed: %s\n", (i + 1 < argc) ? \
+            argv[i + 1] : "(none)");
+          err = EXIT_FAILURE;
+          usage(argv[0]);
+          goto peace;
+        case 'n':
+          postel.headless = TRUE;
+          break;
+        case 's':
+          if (i + 1 < argc) {
+            postel.scenario = argv[++i];
+            break;
+          }
+          fprintf(stderr, "Invalid scenario: (none)\n");
+          err = EXIT_FAILURE;
+          usage(argv[0]);
+          goto peace;
+        case 'u':
+          if (i + 1 < argc) {
+            postel.control = argv[++i];
+            break;
+          }
+          fprintf(stderr, "Invalid socket: (none)\n");
+          err = EXIT_FAILURE;
+          usage(argv[0]);
+          goto peace;
+        case 'm':
+          if (i + 1 < argc) {
+            postel.metrics = argv[++i];
+            break;
+          }
+          fprintf(stderr, "Invalid metrics file: (none)\n");
+          err = EXIT_FAILURE;
+          usage(argv[0]);
+          goto peace;
         case 'h':
         default:
           usage(argv[0]);
@@ -73,8 +157,10 @@ int main(int argc, const char **argv)
    * interface to supervise, modify network topography and control the flow of
    * execution. The gtk renderer is initiated from the main postel thread, and
    * provides a visual representation of the simulation, with a more narrow
-   * interface to the model parameters than the console. */
-  gtk_init(0, NULL);
+   * interface to the model parameters than the console. Headless, there is
+   * no renderer at all, and the postel thread just waits for the simulator. */
+  if (!postel.headless)
+    gtk_init(0, NULL);
   /* Launch the supervisor thread */
   sim_thread = g_thread_try_new("simulator", init_simulator, NULL, &error);
   if (!sim_thread) {
@@ -84,7 +170,10 @@ int main(int argc, const char **argv)
   }
 
   /* Launch the renderer */
-  err = init_renderer();
+  if (!postel.headless)
+    err = init_renderer();
+  else
+    g_thread_join(sim_thread);
 
 peace:
   return err;
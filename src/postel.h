@@ -22,7 +22,7 @@
 #include "queue.h"
 
 #include <stdint.h>
-#include <goocanvas.h>
+#include <glib.h>
 #include <uv.h>
 
 #define VERSION "0.1.0-alpha"
@@ -33,6 +33,36 @@
 #define DEFAULT_NODE_POINT_SIZE 16
 #define DEFAULT_NODE_RADIUS_SIZE 128
 
+/* The most candidates handed to range_mask() at once */
+#define SIMD_BLOCK 256
+
+/* Mobility defaults */
+#define DEFAULT_NODE_SPEED 32  /* Matrix units per second */
+#define DEFAULT_MOBILITY_HZ 10
+
+/* Clock defaults */
+#define DEFAULT_CLOCK SCHED_REALTIME
+#define DEFAULT_PROP_SPEED 0.0  /* Matrix units per second, 0 for instant */
+
+/* Run with the renderer by default */
+#define DEFAULT_HEADLESS FALSE
+
+/* Start with no nodes by default */
+#define DEFAULT_SCENARIO NULL
+
+/* No control socket by default */
+#define DEFAULT_CONTROL NULL
+
+/* No metrics file by default */
+#define DEFAULT_METRICS NULL
+
+/* The most snapshots of the network published, and drawn, per second */
+#define SNAP_HZ 30
+
+/* Frame limits */
+#define MAX_FRAME 65536                /* Longest frame payload */
+#define MAX_FRAME_QUEUE (1024 * 1024)  /* Bytes queued to a node before drops */
+
 /* Define TRUE/FALSE */
 #ifndef FALSE
 #define FALSE 0
@@ -41,6 +71,101 @@
 #define TRUE 1
 #endif
 
+struct node;
+
+/* A spatial index over the nodes. Backends implement the operations below and
+ * keep their own state in data. The nodes themselves belong to the caller. */
+struct node_index {
+  const struct index_ops *ops;
+  void *data;
+};
+
+struct index_ops {
+  const char *name;
+  int (*init)(struct node_index *idx, double width, double height, \
+    double range);
+  void (*destroy)(struct node_index *idx);
+  int (*insert)(struct node_index *idx, struct node *nodei);
+  void (*remove)(struct node_index *idx, struct node *nodep);
+  int (*move)(struct node_index *idx, struct node *nodep, double old_x, \
+    double old_y);
+  size_t (*range)(struct node_index *idx, double x, double y, double r, \
+    void (*fn)(struct node *, void *), void *arg);
+  struct node *(*nearest)(struct node_index *idx, double x, double y);
+  /* Insert n nodes at once */
+  int (*load)(struct node_index *idx, struct node **v, size_t n);
+};
+
+#define INDEX_INIT(idx, w, h, r) (idx)->ops->init((idx), (w), (h), (r))
+#define INDEX_DESTROY(idx) (idx)->ops->destroy((idx))
+#define INDEX_INSERT(idx, elm) (idx)->ops->insert((idx), (elm))
+#define INDEX_REMOVE(idx, elm) (idx)->ops->remove((idx), (elm))
+#define INDEX_MOVE(idx, elm, x, y) (idx)->ops->move((idx), (elm), (x), (y))
+#define INDEX_RANGE(idx, x, y, r, fn, arg) \
+  (idx)->ops->range((idx), (x), (y), (r), (fn), (arg))
+#define INDEX_NEAREST(idx, x, y) (idx)->ops->nearest((idx), (x), (y))
+#define INDEX_LOAD(idx, v, n) (idx)->ops->load((idx), (v), (n))
+
+/* Average cost of each index operation in nanoseconds, see bench_index() */
+struct index_bench {
+  double insert, range, nearest, remove;
+  size_t found;  /* Average number of nodes found by a range query */
+};
+
+extern const struct index_ops tree_index_ops, grid_index_ops;
+extern const struct index_ops *index_backends[];
+
+/* Modes of the simulated clock, see sched.c */
+enum sched_mode {
+  SCHED_REALTIME,  /* Paced by the wall clock */
+  SCHED_AFAP,      /* As fast as possible */
+  SCHED_PAUSE
+};
+
+/* An event on the simulated clock, see sched.c */
+struct event;
+
+/* Records of a trace, see trace.c. The node records come first. */
+enum trace_type {
+  TRACE_ADD,
+  TRACE_DEL,
+  TRACE_MOVE,
+  TRACE_LINK_UP,
+  TRACE_LINK_DOWN,
+  TRACE_TX,
+  TRACE_RX,
+  TRACE_DROP
+};
+
+/* Counts and times kept by metrics.c, named there in the same order */
+enum metric_count {
+  METRIC_FRAMES_SENT,
+  METRIC_FRAMES_DELIVERED,
+  METRIC_FRAMES_DROPPED,
+  METRIC_COUNTS
+};
+
+enum metric_time {
+  METRIC_ADD_NODE,
+  METRIC_DEL_NODE,
+  METRIC_LOCK_WAIT,
+  METRIC_LOCK_HOLD,
+  METRIC_READ_LOCK_WAIT,
+  METRIC_READ_LOCK_HOLD,
+  METRIC_INDEX_QUERY,
+  METRIC_REBUILD,
+  METRIC_RENDER_FRAME,
+  METRIC_TIMES
+};
+
+/* A count, or a number of times with their sum, max and quantiles, in
+ * nanoseconds */
+struct metric_summary {
+  const char *name;
+  uint64_t count, sum, max;
+  uint64_t p50, p90, p99, p999;
+};
+
 /* A structure for the global state of postel */
 struct global_state_struct {
   unsigned int matrix_width;
@@ -48,28 +173,209 @@ struct global_state_struct {
   unsigned int matrix_zero;
   unsigned int node_p_size;
   unsigned int node_r_size;
+  const struct index_ops *index;
+  unsigned int node_speed;
+  unsigned int mobility_hz;
+  enum sched_mode clock;
+  double prop_speed;  /* The speed frames travel at, 0 for instant */
+  int headless;       /* No renderer, and no canvas items */
+  const char *scenario;  /* The scenario file loaded at startup, or NULL */
+  const char *control;   /* The path of the control socket, or NULL */
+  const char *metrics;   /* The path of the metrics file, or NULL */
+};
+
+/* Mobility models */
+enum mobility_model {
+  MOBILITY_STATIC,
+  MOBILITY_WALK,      /* Random walk, turning every so often */
+  MOBILITY_WAYPOINT,  /* Random waypoint, pausing at each waypoint */
+  MOBILITY_PATH       /* Scripted trajectory through a list of waypoints */
+};
+
+/* A point on a scripted trajectory */
+struct waypoint {
+  SIMPLEQ_ENTRY(waypoint) points;
+  double x, y;
+};
+
+/* A link to a node in transmission range. Links come in pairs, one on the
+ * siblings list of each end, so that either end can drop both. */
+struct sibling {
+  LIST_ENTRY(sibling) sibs;
+  struct node *node;
+  struct sibling *twin;
+};
+
+/* A snapshot of the network, handed from the simulator to the renderer, see
+ * snap.c. Links hold the indices of their two nodes. */
+struct snap_node {
+  int64_t id;
+  double x, y;
+};
+
+struct snap_link {
+  uint32_t a, b;
+};
+
+struct snapshot {
+  unsigned long seq;
+  struct snap_node *nodes;
+  size_t n_nodes, nodes_cap;
+  struct snap_link *links;
+  size_t n_links, links_cap;
+};
+
+/* A pool of fixed size objects, see pool.c */
+struct pool {
+  LIST_ENTRY(pool) pools;
+  const char *name;
+  size_t size, offset, per_chunk;
+  GMutex lock;
+  struct pool_free *free;
+  size_t free_count, capacity, chunk_count;
+  SLIST_HEAD(, pool_chunk) chunks;
+  SLIST_HEAD(, pool_cache) caches;
+  unsigned slot;  /* Of the free list of each thread, see pool.c */
+};
+LIST_HEAD(pool_list, pool);
+
+struct pool_stats {
+  const char *name;
+  size_t size, chunks, capacity, used, free, bytes;
+};
+
+/* Node positions as a structure of arrays, see soa.c */
+struct soa {
+  size_t n, cap;
+  double *x, *y, *r;
+  struct node **node;
+  /* Packed siblings, as indexes into the arrays above */
+  uint32_t *nbr_start, *nbr;
+  size_t nbr_len, nbr_cap;
+  int nbr_stale;
+};
+
+/* A table of generational handles, see handle.c */
+struct handle_slot {
+  void *ptr;
+  uint32_t gen;
+  uint32_t next;  /* The next free slot */
+};
+
+struct handle_table {
+  struct handle_slot *slots;
+  uint32_t size, cap;
+  uint32_t free_head;
+  uint32_t used;
+};
+
+/* A reference counted block of frames, see deliver.c */
+struct frame_block {
+  unsigned int refs;
+  size_t cap;
+  char data[];
+};
+
+/* A node process, linked to the simulator by a transport, see proc.c */
+struct proc;
+
+/* A transport carries frames between the simulator and a node process. The
+ * transports are fifo.c and shm.c. */
+struct transport_ops {
+  const char *name;
+  /* Set up the channel in loop, and the arguments and descriptors of the
+   * process that follow "file id" and stdio. Returns -1 on failure, 0 on
+   * success */
+  int (*open)(struct proc *proc, uv_loop_t *loop, \
+    uv_process_options_t *options);
+  void (*close)(struct proc *proc);
+  /* Bytes on their way to the node */
+  size_t (*backlog)(struct proc *proc);
+  /* Send the frames queued to the node, and drop their references */
+  void (*flush)(struct proc *proc);
 };
 
+extern const struct transport_ops fifo_transport_ops, shm_transport_ops;
+extern const struct transport_ops *transports[];
+
+struct proc {
+  LIST_ENTRY(proc) procs;
+  struct node *node;    /* NULL once the node is gone */
+  int64_t id;           /* The id of the node */
+  const struct transport_ops *ops;
+  uv_process_t process;
+  char *path;           /* The files of the node start with path */
+  /* Frames queued for the next flush, see deliver.c */
+  uv_buf_t *out;
+  struct frame_block **out_blocks;
+  size_t out_n, out_cap, out_bytes;
+  LIST_ENTRY(proc) pending;
+  int handles;          /* Handles still open */
+  int exited, closed;
+  /* The state of the transport */
+  union {
+    struct {
+      uv_pipe_t tx, rx;           /* Frames to the node, and from the node */
+      char *in, *out;             /* Their paths */
+      struct frame_block *block;  /* The block reads land in */
+      size_t start, len;          /* The unparsed bytes of the block */
+    } fifo;
+    struct {
+      uv_poll_t poll;             /* Watches bell_tx */
+      int fd, bell_rx, bell_tx;   /* The region, and its doorbells */
+      struct shm_region *region;
+      uint32_t rx_head, tx_tail;  /* The ends of the rings we advance */
+    } shm;
+  } chan;
+};
+LIST_HEAD(proc_list, proc);
+
 /* The structure for each network node. _Any_ operation on a node, is protected
- * by a lock on node_head defined in sim.c */
+ * by the reader/writer lock on node_head defined in sim.c: a change to any node
+ * takes it for writing, while queries that only look at nodes take it for
+ * reading, and run alongside each other. */
 struct node {
   LIST_ENTRY(node) nodes;
-  intptr_t id;
+  int64_t id;  /* A handle from node_handles in sim.c */
   double x, y;
-  GooCanvasItem *point, *radius;
   /* The structure for the k-d tree topology */
   struct {
     int depth;
     int axis;
+    size_t size;  /* Nodes in this subtree, including this one */
     struct node *parent;
     struct node *left, *right;
   } tree;
+  /* The cell of the uniform grid, and the position within it */
+  struct {
+    unsigned int cell;
+    unsigned int slot;
+  } grid;
   /* A linked list of nodes in transmission range */
-  LIST_ENTRY(node) sibs;
-  LIST_HEAD(sib_list, node) siblings;
+  LIST_HEAD(sib_list, sibling) siblings;
+  unsigned int sib_count;
+  unsigned long mark;  /* Stamp of the last sibling update that saw it */
+  uint32_t soa;        /* Entry in the position store */
+  /* The mobility model and its state */
+  struct {
+    enum mobility_model model;
+    double speed;
+    double dx, dy;   /* Heading of a random walk */
+    double tx, ty;   /* Current waypoint */
+    double timer;    /* Seconds until the next turn, or left to pause */
+    SIMPLEQ_HEAD(path_list, waypoint) path;
+    LIST_ENTRY(node) movers;
+  } mob;
+  struct proc *proc;  /* The node process, or NULL */
 };
-LIST_HEAD(node_list, node) node_head;
-struct node *tree_head;
+LIST_HEAD(node_list, node);
+extern struct node_list node_head;
+extern GRWLock node_head_lock;
+/* The waits for node_head and its holds are timed, see metrics.c */
+#define NODE_LOCK() lock_nodes(TRUE)
+#define NODE_UNLOCK() unlock_nodes(TRUE)
+#define NODE_READ_LOCK() lock_nodes(FALSE)
+#define NODE_READ_UNLOCK() unlock_nodes(FALSE)
 
 /* Prototypes */
 /* Initialize */
@@ -77,19 +383,148 @@ gpointer init_simulator(gpointer data);
 int init_console(uv_loop_t *loop);
 int init_renderer(void);
 
-/* Render-thread GooCanvas functions */
-GooCanvasItem *rndr_new_goo_line(gdouble x1, gdouble y1, gdouble x2, \
-  gdouble y2, const char *properties, ...);
-GooCanvasItem *rndr_new_goo_ellipse(gdouble x, gdouble y, unsigned int size, \
-  const char *properties, ...);
-void rndr_destroy_goo_item(GooCanvasItem *item);
+/* Snapshots */
+int init_snapshot(uv_loop_t *loop);
+void touch_snapshot(void);
+const struct snapshot *acquire_snapshot(void);
 
 /* Simulation control */
-int add_node(double x, double y);
-int del_node(intptr_t id);
+int64_t add_node(double x, double y);
+int64_t add_nodes(const double *xy, size_t n, int64_t *ids);
+int64_t load_scenario(const char *path);
+int64_t save_state(const char *path);
+int64_t restore_state(const char *path);
+const struct soa *pack_nodes(const struct handle_table **handles);
+int64_t restore_nodes(const struct soa *saved, const int64_t *ids, \
+  const uint32_t *slots, uint32_t n_slots, uint32_t free_head);
+int del_node(int64_t id);
+struct node *find_node(int64_t id);
+struct node *walk_nodes(uint32_t *cursor);
+size_t count_nodes(size_t *links);
+int move_node(struct node *nodep, double x, double y);
+int rebuild_siblings(void);
+
+/* Mobility */
+void init_mobility_node(struct node *nodep);
+int set_mobility(struct node *nodep, enum mobility_model model, double speed);
+int add_waypoint(struct node *nodep, double x, double y);
+void stop_mobility_node(struct node *nodep);
+uint64_t save_mobility(uint64_t *seed, void (*fn)(struct node *, void *), \
+  void *arg);
+void restore_mobility(struct node **movers, size_t n, uint64_t seed, \
+  uint64_t next);
+
+/* Node processes */
+int init_proc(uv_loop_t *loop);
+int spawn_proc(struct node *nodep, const char *file, \
+  const struct transport_ops *ops);
+const struct transport_ops *find_transport(const char *name);
+void fail_proc(struct proc *proc);
+void release_proc(struct proc *proc);
+void stop_proc(struct node *nodep);
+
+/* Event scheduling */
+int init_sched(uv_loop_t *loop);
+uint64_t sched_now(void);
+struct event *sched_at(uint64_t time, void (*fn)(void *), \
+  void (*cancel)(void *), void *arg);
+struct event *sched_in(uint64_t delay, void (*fn)(void *), \
+  void (*cancel)(void *), void *arg);
+void sched_cancel(struct event *ev);
+uint64_t event_time(const struct event *ev);
+void restore_clock(uint64_t now);
+int find_clock(const char *name);
+void set_clock(enum sched_mode mode, double seconds);
+const char *get_clock(uint64_t *now, uint64_t *until, size_t *events);
+
+/* Frame delivery */
+int init_deliver(uv_loop_t *loop);
+struct frame_block *frame_alloc(size_t cap);
+void frame_ref(struct frame_block *block);
+void frame_unref(struct frame_block *block);
+void deliver_frame(struct node *nodep, struct frame_block *block, \
+  char *frame, size_t len);
+void deliver_drop(struct proc *proc);
+
+/* Tracing */
+int init_trace(uv_loop_t *loop);
+void trace_node(enum trace_type type, const struct node *nodep);
+void trace_link(enum trace_type type, const struct node *a, \
+  const struct node *b);
+void trace_frame(enum trace_type type, int64_t from, int64_t to, size_t len);
+int start_trace(const char *path, int deflate);
+int stop_trace(void);
+const char *get_trace(uint64_t *records, uint64_t *dropped, uint64_t *bytes, \
+  int *recording);
+int start_replay(const char *path, double speed);
+int stop_replay(void);
+const char *get_replay(uint64_t *applied, double *speed, double *seconds);
+
+/* Control socket */
+int init_control(uv_loop_t *loop);
+
+/* Metrics */
+int init_metrics(uv_loop_t *loop);
+void count_metric(enum metric_count m, uint64_t n);
+void time_metric(enum metric_time m, uint64_t start);
+void lock_nodes(int write);
+void unlock_nodes(int write);
+void get_metrics(struct metric_summary *counts, struct metric_summary *times);
+
+/* Worker threads */
+int init_workers(void);
+unsigned int count_workers(void);
+void run_workers(size_t tasks, void (*fn)(size_t task, void *arg), void *arg);
+
+/* Pooled allocation */
+int init_pool(struct pool *pool, const char *name, size_t size, int align);
+void *pool_alloc(struct pool *pool);
+void pool_free(struct pool *pool, void *ptr);
+size_t all_pool_stats(struct pool_stats *stats, size_t max);
+void shutdown_pool(struct pool *pool);
+
+/* Vectorized range tests */
+void init_simd(void);
+size_t range_mask(double x, double y, double r2, const double *xs, \
+  const double *ys, size_t n, uint64_t *mask);
+int set_simd(const char *name, int check);
+const char *get_simd(int *check);
+
+/* Position store */
+void init_soa(struct soa *soa);
+int soa_add(struct soa *soa, struct node *nodep, double r);
+void soa_del(struct soa *soa, struct node *nodep);
+void soa_move(struct soa *soa, struct node *nodep);
+int soa_pack(struct soa *soa);
+void shutdown_soa(struct soa *soa);
+
+/* Handle tables */
+void init_handles(struct handle_table *table);
+int64_t alloc_handle(struct handle_table *table, void *ptr);
+void *get_handle(const struct handle_table *table, int64_t h);
+void *prev_handle(const struct handle_table *table, uint32_t *cursor);
+int free_handle(struct handle_table *table, int64_t h);
+int load_handles(struct handle_table *table, const uint32_t *slots, \
+  uint32_t size, uint32_t free_head);
+int fill_handle(struct handle_table *table, int64_t h, void *ptr);
+int check_handles(const struct handle_table *table);
+void shutdown_handles(struct handle_table *table);
+
+/* Spatial index */
+const struct index_ops *find_index(const char *name);
+int bench_index(const struct index_ops *ops, size_t n, struct index_bench *res);
 
 /* Shutdown */
 void shutdown_postel(int err, char **msg);
 void shutdown_console(void);
 void shutdown_simulator(void);
+void shutdown_mobility(void);
+void shutdown_sched(void);
+void shutdown_proc(void);
+void shutdown_deliver(void);
+void shutdown_trace(void);
+void shutdown_control(void);
+void shutdown_metrics(void);
+void shutdown_snapshot(void);
+void shutdown_workers(void);
 void shutdown_renderer(void);
@@ -0,0 +1,207 @@
+/* proc.c: node processes.
+ * Copyright  2015 Jack Morton <jhm@jemscout.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "postel.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <glib.h>
+#include <uv.h>
+
+/* A node process runs as "file id ...", where the arguments that follow are
+ * up to its transport. Whatever the transport, a frame is a 32 bit length in
+ * network byte order followed by that many bytes. Every process and channel
+ * is serviced in the loop of the simulator thread. */
+#define PROC_MAX_ARGS 8
+
+static uv_loop_t *proc_loop;
+static char proc_dir[] = "/tmp/postel.XXXXXX";
+static struct proc_list proc_head = LIST_HEAD_INITIALIZER(proc_head);
+
+/* The available transports, the first being the default */
+const struct transport_ops *transports[] = {
+  &fifo_transport_ops,
+  &shm_transport_ops,
+  NULL
+};
+
+/* Returns NULL on failure (to find the transport), the transport on success */
+const struct transport_ops *find_transport(const char *name)
+{
+  int i;
+
+  for (i = 0; transports[i]; i++) {
+    if (!strcasecmp(name, transports[i]->name))
+      return transports[i];
+  }
+  return NULL;
+}
+
+/* Drop a hold on a process, freeing it once every handle has closed */
+void release_proc(struct proc *proc)
+{
+  if (--proc->handles)
+    return;
+  LIST_REMOVE(proc, procs);
+  g_free(proc->path);
+  free(proc);
+}
+
+static void proc_close_cb(uv_handle_t *handle)
+{
+  release_proc(handle->data);
+}
+
+/* LOCK node_head BEFORE CALLING THIS FUNCTION! */
+/* Detach a process from its node, then close its channel. The process handle
+ * stays open until the process exits. */
+static void proc_close(struct proc *proc)
+{
+  if (proc->closed)
+    return;
+  proc->closed = TRUE;
+  if (proc->node) {
+    proc->node->proc = NULL;
+    proc->node = NULL;
+  }
+  deliver_drop(proc);
+  proc->ops->close(proc);
+}
+
+/* LOCK node_head BEFORE CALLING THIS FUNCTION! */
+static void proc_stop(struct proc *proc, int signum)
+{
+  if (!proc->exited)
+    uv_process_kill(&proc->process, signum);
+  proc_close(proc);
+}
+
+/* LOCK node_head BEFORE CALLING THIS FUNCTION! */
+/* Terminate a process that broke its channel */
+void fail_proc(struct proc *proc)
+{
+  proc_stop(proc, SIGTERM);
+}
+
+static void proc_exit_cb(uv_process_t *process, int64_t status, int signum)
+{
+  struct proc *proc = process->data;
+
+  NODE_LOCK();
+  if (proc->node)
+    fprintf(stderr, "Node %" PRId64 " exited with status %" PRId64 \
+      " (signal %d).\n", proc->id, status, signum);
+  proc->exited = TRUE;
+  proc_close(proc);
+  NODE_UNLOCK();
+  uv_close((uv_handle_t *)process, &proc_close_cb);
+}
+
+/* LOCK node_head BEFORE CALLING THIS FUNCTION! */
+/* Run file as the process of a node, linked by a transport. Returns -1 on
+ * failure, 0 on success */
+int spawn_proc(struct node *nodep, const char *file, \
+  const struct transport_ops *ops)
+{
+  char id[32], *args[PROC_MAX_ARGS];
+  uv_process_options_t options;
+  uv_stdio_container_t stdio[PROC_MAX_ARGS];
+  struct proc *proc;
+  int err = -1;
+
+  if (nodep->proc || !(proc = calloc(1, sizeof(struct proc))))
+    return -1;
+  LIST_INSERT_HEAD(&proc_head, proc, procs);
+  proc->node = nodep;
+  proc->id = nodep->id;
+  proc->ops = ops;
+  snprintf(id, sizeof(id), "%" PRId64, nodep->id);
+  proc->path = g_strdup_printf("%s/%s", proc_dir, id);
+  proc->process.data = proc;
+  /* Nothing to wait for until the process is spawned */
+  proc->exited = TRUE;
+
+  memset(&options, 0, sizeof(options));
+  memset(args, 0, sizeof(args));
+  args[0] = (char *)file;
+  args[1] = id;
+  stdio[0].flags = UV_IGNORE;
+  stdio[1].flags = UV_INHERIT_FD;
+  stdio[1].data.fd = STDOUT_FILENO;
+  stdio[2].flags = UV_INHERIT_FD;
+  stdio[2].data.fd = STDERR_FILENO;
+  options.file = file;
+  options.args = args;
+  options.exit_cb = &proc_exit_cb;
+  options.stdio = stdio;
+  options.stdio_count = 3;
+  /* Hold the process while the transport opens, so it can't be freed */
+  proc->handles = 1;
+  if (ops->open(proc, proc_loop, &options))
+    goto close_proc;
+  if (uv_spawn(proc_loop, &proc->process, &options)) {
+    uv_close((uv_handle_t *)&proc->process, &proc_close_cb);
+    goto close_proc;
+  }
+  proc->exited = FALSE;
+  nodep->proc = proc;
+  err = 0;
+  goto peace;
+
+close_proc:
+  proc_close(proc);
+  /* The failed process handle, if any, holds the process until it closes */
+  if (!uv_is_closing((uv_handle_t *)&proc->process))
+    release_proc(proc);
+peace:
+  return err;
+}
+
+/* LOCK node_head BEFORE CALLING THIS FUNCTION! */
+/* Terminate the process of a node, if it runs one */
+void stop_proc(struct node *nodep)
+{
+  if (nodep->proc)
+    proc_stop(nodep->proc, SIGTERM);
+}
+
+/* LOCK node_head BEFORE CALLING THIS FUNCTION! */
+/* Kill every node process. The loop runs on until they are reaped. */
+void shutdown_proc(void)
+{
+  struct proc *proc;
+
+  LIST_FOREACH(proc, &proc_head, procs)
+    proc_stop(proc, SIGKILL);
+  rmdir(proc_dir);
+}
+
+/* Returns -1 on failure, 0 on success */
+int init_proc(uv_loop_t *loop)
+{
+  proc_loop = loop;
+  return mkdtemp(proc_dir) ? 0 : -1;
+}
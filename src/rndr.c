@@ -20,51 +20,116 @@
  * SOFTWARE.
  */
 
+
 #include "postel.h"
 
 #include <stdlib.h>
-#include <goocanvas.h>
+#include <gtk/gtk.h>
 
 extern struct global_state_struct postel;
 G_LOCK_EXTERN(postel);
 
+/* The whole network is drawn by one cairo drawing area, the size of the
+ * matrix, in a scrolled window. Every 1 / SNAP_HZ of a second the latest
+ * snapshot published by the simulator, if any, replaces the one drawn, and
+ * the area is redrawn. Each redraw walks the position arrays of the snapshot
+ * once, and only paths what lies within the clip of the redraw, which the
+ * scrolled window keeps to the visible part of the matrix. Links, ranges and
+ * points are each stroked or filled as a single path. */
 static GtkWidget *canvas;
+static const struct snapshot *rndr_snap;
 
 void shutdown_renderer(void)
 {
   gtk_main_quit();
 }
 
-void rndr_destroy_goo_item(GooCanvasItem *item)
+/* Returns TRUE if a circle of radius r at x, y touches the clip */
+static int rndr_visible(double x, double y, double r, const double clip[4])
 {
-  goo_canvas_item_remove(item);
+  return x + r >= clip[0] && x - r <= clip[2] && y + r >= clip[1] && \
+    y - r <= clip[3];
 }
 
-GooCanvasItem *rndr_new_goo_line(gdouble x1, gdouble y1, gdouble x2, \
-  gdouble y2, const char *properties, ...)
+static void rndr_links(cairo_t *cr, const struct snapshot *snap, double zero, \
+  const double clip[4])
 {
-  va_list ap;
-
-  GooCanvasItem *root =  goo_canvas_get_root_item(GOO_CANVAS(canvas));
-  GooCanvasItem *line = goo_canvas_polyline_new_line(root, x1, y1, x2, y2, \
-    NULL);
-  va_start(ap, properties);
-  g_object_set_valist(G_OBJECT(line), properties, ap);
-  va_end(ap);
-  return line;
+  const struct snap_node *a, *b;
+  size_t i;
+
+  for (i = 0; i < snap->n_links; i++) {
+    a = &snap->nodes[snap->links[i].a];
+    b = &snap->nodes[snap->links[i].b];
+    if (MAX(a->x, b->x) + zero < clip[0] || MIN(a->x, b->x) + zero > clip[2] \
+      || MAX(a->y, b->y) + zero < clip[1] || MIN(a->y, b->y) + zero > clip[3])
+      continue;
+    cairo_move_to(cr, a->x + zero, a->y + zero);
+    cairo_line_to(cr, b->x + zero, b->y + zero);
+  }
+  cairo_set_line_width(cr, 0.5);
+  cairo_set_source_rgb(cr, 0.69, 0.77, 0.87);  /* Light Steel Blue */
+  cairo_stroke(cr);
 }
 
-GooCanvasItem *rndr_new_goo_ellipse(gdouble x, gdouble y, unsigned int size, \
-  const char *properties, ...)
+/* Path a circle of radius r around every visible node */
+static void rndr_circles(cairo_t *cr, const struct snapshot *snap, \
+  double zero, double r, const double clip[4])
 {
-  va_list ap;
-
-  GooCanvasItem *root = goo_canvas_get_root_item(GOO_CANVAS(canvas));
-  GooCanvasItem *ellipse = goo_canvas_ellipse_new(root, x, y, size, size, NULL);
-  va_start(ap, properties);
-  g_object_set_valist(G_OBJECT(ellipse), properties, ap);
-  va_end(ap);
-  return ellipse;
+  double x, y;
+  size_t i;
+
+  for (i = 0; i < snap->n_nodes; i++) {
+    x = snap->nodes[i].x + zero;
+    y = snap->nodes[i].y + zero;
+    if (!rndr_visible(x, y, r, clip))
+      continue;
+    cairo_new_sub_path(cr);
+    cairo_arc(cr, x, y, r, 0, 2 * G_PI);
+  }
+}
+
+static gboolean rndr_draw(GtkWidget *widget, cairo_t *cr, gpointer data)
+{
+  const struct snapshot *snap = rndr_snap;
+  unsigned int p_size, r_size;
+  double zero, clip[4];
+  uint64_t start = uv_hrtime();
+
+  if (!snap)
+    return FALSE;
+  G_LOCK(postel);
+  zero = postel.matrix_zero;
+  p_size = postel.node_p_size;
+  r_size = postel.node_r_size;
+  G_UNLOCK(postel);
+
+  cairo_clip_extents(cr, &clip[0], &clip[1], &clip[2], &clip[3]);
+  rndr_links(cr, snap, zero, clip);
+
+  cairo_set_line_width(cr, 1.0);
+  rndr_circles(cr, snap, zero, r_size, clip);
+  cairo_set_source_rgb(cr, 0.47, 0.53, 0.60);  /* Light Slate Gray */
+  cairo_stroke(cr);
+
+  rndr_circles(cr, snap, zero, p_size, clip);
+  cairo_set_source_rgb(cr, 0.56, 0.93, 0.56);  /* Light Green */
+  cairo_fill_preserve(cr);
+  cairo_set_source_rgb(cr, 0.18, 0.31, 0.31);  /* Dark Slate Gray */
+  cairo_stroke(cr);
+  time_metric(METRIC_RENDER_FRAME, start);
+  return FALSE;
+}
+
+/* Take up the latest snapshot, if there is a new one */
+static gboolean rndr_tick(gpointer data)
+{
+  const struct snapshot *snap = acquire_snapshot();
+
+  if (snap) {
+    rndr_snap = snap;
+    gtk_widget_queue_draw(canvas);
+  }
+  return G_SOURCE_CONTINUE;
 }
 
 int init_renderer(void)
@@ -72,17 +137,20 @@ int init_renderer(void)
   int err = 0; /* XXX: Initialize */
   GtkWidget *window = gtk_window_new(GTK_WINDOW_TOPLEVEL);
   GtkWidget *scrolled_window = gtk_scrolled_window_new(NULL, NULL);
-  canvas = goo_canvas_new();
+  canvas = gtk_drawing_area_new();
 
   /* XXX: Error checking? */
   gtk_container_add(GTK_CONTAINER(window), scrolled_window);
   gtk_container_add(GTK_CONTAINER(scrolled_window), canvas);
   G_LOCK(postel);
-  goo_canvas_set_bounds(GOO_CANVAS(canvas), 0, 0, postel.matrix_width,
+  gtk_widget_set_size_request(canvas, postel.matrix_width,
   	postel.matrix_height);
   G_UNLOCK(postel);
+  g_signal_connect(G_OBJECT(canvas), "draw", G_CALLBACK(&rndr_draw), NULL);
   gtk_widget_show_all(window);
 
+  g_timeout_add(1000 / SNAP_HZ, &rndr_tick, NULL);
+
   gtk_main();
   return err;
 }
@@ -0,0 +1,449 @@
+/* save.c: checkpoints of the whole simulator, saved and restored.
+ * Copyright  2015 Jack Morton <jhm@jemscout.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "postel.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <glib.h>
+
+extern struct global_state_struct postel;
+G_LOCK_EXTERN(postel);
+
+/* A saved state is a struct save_header followed by the sections below, each
+ * starting on 8 bytes at the offset the header gives, all in the byte order
+ * of the host. The node sections follow the position store, entry by entry,
+ * and the links are its packed siblings, so that a restore maps the file and
+ * hands the arrays straight to restore_nodes(): the index is built in one go
+ * and no range is queried, nor any command replayed.
+ *
+ * The clock, the next mobility tick and the mobility generator are saved, so
+ * that a restored run moves the same way the saved run would have. Node
+ * processes, and the frames in flight to them, can't be saved: the restored
+ * nodes run none, and no other event is left waiting. */
+#define SAVE_MAGIC "PSTLSAVE"
+#define SAVE_VERSION 1
+#define SAVE_ALIGN(n) (((n) + 7) & ~(uint64_t)7)
+#define SAVE_BUFFER (1024 * 1024)
+
+enum save_section {
+  SAVE_ID,         /* An int64_t id per node */
+  SAVE_X,          /* A double per node */
+  SAVE_Y,
+  SAVE_R,
+  SAVE_NBR_START,  /* A uint32_t per node, and one more */
+  SAVE_NBR,        /* A uint32_t entry per end of a link */
+  SAVE_MOB,        /* A struct save_mob per node */
+  SAVE_PATH,       /* A pair of doubles, x then y, per waypoint */
+  SAVE_SLOTS,      /* A pair of uint32_t, generation then next free, per slot
+                    * of the table of node ids */
+  SAVE_SECTIONS
+};
+
+struct save_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t flags;      /* Unused, zero */
+  uint64_t nodes, links, waypoints;
+  uint32_t slots, free_head;
+  uint64_t clock;      /* Simulated nanoseconds */
+  uint64_t mob_tick;   /* The next mobility tick, or UINT64_MAX */
+  uint64_t mob_seed;
+  double range;
+  uint64_t offset[SAVE_SECTIONS];
+};
+
+struct save_mob {
+  uint32_t model;
+  uint32_t rank;       /* The order the node is ticked in, if it moves */
+  uint64_t path;       /* Waypoints left */
+  double speed, dx, dy, tx, ty, timer;
+};
+
+/* Returns the size of a section of hdr */
+static uint64_t save_size(const struct save_header *hdr, int section)
+{
+  switch (section) {
+    case SAVE_ID:
+    case SAVE_X:
+    case SAVE_Y:
+    case SAVE_R:
+      return hdr->nodes * sizeof(double);
+    case SAVE_NBR_START:
+      return (hdr->nodes + 1) * sizeof(uint32_t);
+    case SAVE_NBR:
+      return hdr->links * sizeof(uint32_t);
+    case SAVE_MOB:
+      return hdr->nodes * sizeof(struct save_mob);
+    case SAVE_PATH:
+      return hdr->waypoints * 2 * sizeof(double);
+    case SAVE_SLOTS:
+      return (uint64_t)hdr->slots * 2 * sizeof(uint32_t);
+  }
+  return 0;
+}
+
+/* Write len bytes, then pad them to 8. Returns -1 on failure, 0 on success */
+static int save_write(FILE *f, const void *ptr, size_t len)
+{
+  static const char zero[8];
+
+  if (len && fwrite(ptr, len, 1, f) != 1)
+    return -1;
+  return (SAVE_ALIGN(len) == len || \
+    fwrite(zero, SAVE_ALIGN(len) - len, 1, f) == 1) ? 0 : -1;
+}
+
+struct save_rank_arg {
+  uint32_t *rank;
+  uint32_t n;
+};
+
+static void save_rank_cb(struct node *nodep, void *data)
+{
+  struct save_rank_arg *arg = data;
+
+  arg->rank[nodep->soa] = arg->n++;
+}
+
+/* Write every section after the header. Returns -1 on failure, 0 on success */
+static int save_sections(FILE *f, const struct soa *soa, \
+  const struct handle_table *handles, const uint32_t *rank)
+{
+  size_t i;
+  struct node *nodep;
+  struct waypoint *wp;
+  struct save_mob mob;
+  uint32_t slot[2];
+  double xy[2];
+
+  for (i = 0; i < soa->n; i++) {
+    if (fwrite(&soa->node[i]->id, sizeof(int64_t), 1, f) != 1)
+      return -1;
+  }
+  if (save_write(f, soa->x, soa->n * sizeof(double)) || \
+    save_write(f, soa->y, soa->n * sizeof(double)) || \
+    save_write(f, soa->r, soa->n * sizeof(double)) || \
+    save_write(f, soa->nbr_start, (soa->n + 1) * sizeof(uint32_t)) || \
+    save_write(f, soa->nbr, soa->nbr_len * sizeof(uint32_t)))
+    return -1;
+
+  memset(&mob, 0, sizeof(mob));
+  for (i = 0; i < soa->n; i++) {
+    nodep = soa->node[i];
+    mob.model = nodep->mob.model;
+    mob.rank = rank[i];
+    mob.path = 0;
+    SIMPLEQ_FOREACH(wp, &nodep->mob.path, points)
+      mob.path++;
+    mob.speed = nodep->mob.speed;
+    mob.dx = nodep->mob.dx;
+    mob.dy = nodep->mob.dy;
+    mob.tx = nodep->mob.tx;
+    mob.ty = nodep->mob.ty;
+    mob.timer = nodep->mob.timer;
+    if (fwrite(&mob, sizeof(mob), 1, f) != 1)
+      return -1;
+  }
+  for (i = 0; i < soa->n; i++) {
+    SIMPLEQ_FOREACH(wp, &soa->node[i]->mob.path, points) {
+      xy[0] = wp->x;
+      xy[1] = wp->y;
+      if (fwrite(xy, sizeof(xy), 1, f) != 1)
+        return -1;
+    }
+  }
+  for (i = 0; i < handles->size; i++) {
+    slot[0] = handles->slots[i].gen;
+    slot[1] = handles->slots[i].next;
+    if (fwrite(slot, sizeof(slot), 1, f) != 1)
+      return -1;
+  }
+  return 0;
+}
+
+/* LOCK node_head BEFORE CALLING THIS FUNCTION! */
+/* Save the state of the simulator to a file, which is written beside it and
+ * renamed into place once complete. Returns -1 on failure, the number of
+ * nodes saved on success */
+int64_t save_state(const char *path)
+{
+  int64_t err = -1;
+  int i;
+  size_t k;
+  uint64_t off;
+  const struct soa *soa;
+  const struct handle_table *handles;
+  struct save_header hdr;
+  struct save_rank_arg arg;
+  struct waypoint *wp;
+  char *tmp = g_strdup_printf("%s.tmp", path);
+  FILE *f = NULL;
+
+  arg.rank = NULL;
+  if (!(soa = pack_nodes(&handles)))
+    goto peace;
+  if (!(arg.rank = malloc(MAX(soa->n, 1) * sizeof(uint32_t))))
+    goto peace;
+  for (k = 0; k < soa->n; k++)
+    arg.rank[k] = UINT32_MAX;
+  arg.n = 0;
+
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, SAVE_MAGIC, sizeof(hdr.magic));
+  hdr.version = SAVE_VERSION;
+  hdr.nodes = soa->n;
+  hdr.links = soa->nbr_len;
+  for (k = 0; k < soa->n; k++) {
+    SIMPLEQ_FOREACH(wp, &soa->node[k]->mob.path, points)
+      hdr.waypoints++;
+  }
+  hdr.slots = handles->size;
+  hdr.free_head = handles->free_head;
+  hdr.clock = sched_now();
+  hdr.mob_tick = save_mobility(&hdr.mob_seed, &save_rank_cb, &arg);
+  G_LOCK(postel);
+  hdr.range = postel.node_r_size;
+  G_UNLOCK(postel);
+  for (i = 0, off = SAVE_ALIGN(sizeof(hdr)); i < SAVE_SECTIONS; i++) {
+    hdr.offset[i] = off;
+    off += SAVE_ALIGN(save_size(&hdr, i));
+  }
+
+  if (!(f = fopen(tmp, "wb")))
+    goto fail;
+  setvbuf(f, NULL, _IOFBF, SAVE_BUFFER);
+  if (save_write(f, &hdr, sizeof(hdr)) || \
+    save_sections(f, soa, handles, arg.rank))
+    goto fail;
+  if (fclose(f)) {
+    f = NULL;
+    goto fail;
+  }
+  f = NULL;
+  if (rename(tmp, path))
+    goto fail;
+  err = soa->n;
+  goto peace;
+
+fail:
+  fprintf(stderr, "%s: %s\n", path, strerror(errno));
+  if (f)
+    fclose(f);
+  unlink(tmp);
+peace:
+  free(arg.rank);
+  g_free(tmp);
+  return err;
+}
+
+/* Returns TRUE if every section of hdr lies within size bytes */
+static int restore_fits(const struct save_header *hdr, uint64_t size)
+{
+  int i;
+
+  if (hdr->nodes >= UINT32_MAX || hdr->links > size || \
+    hdr->waypoints > size)
+    return FALSE;
+  for (i = 0; i < SAVE_SECTIONS; i++) {
+    if (hdr->offset[i] % 8 || hdr->offset[i] > size || \
+      save_size(hdr, i) > size - hdr->offset[i])
+      return FALSE;
+  }
+  return TRUE;
+}
+
+/* Returns TRUE if the doubles of a saved mobility are all finite, and its
+ * speed isn't negative. A mover left with NaN would never arrive */
+static int restore_mob_sane(const struct save_mob *mob)
+{
+  return isfinite(mob->speed) && mob->speed >= 0 && isfinite(mob->dx) && \
+    isfinite(mob->dy) && isfinite(mob->tx) && isfinite(mob->ty) && \
+    isfinite(mob->timer);
+}
+
+/* Check the links, mobility and waypoints of a mapped state, and place each
+ * node that moves at movers[rank]. Returns -1 on failure, the number of
+ * movers on success */
+static int64_t restore_check(const struct save_header *hdr, const char *map, \
+  struct node **movers)
+{
+  const uint32_t *start = (const uint32_t *)(map + hdr->offset[SAVE_NBR_START]);
+  const uint32_t *nbr = (const uint32_t *)(map + hdr->offset[SAVE_NBR]);
+  const struct save_mob *mob = \
+    (const struct save_mob *)(map + hdr->offset[SAVE_MOB]);
+  const double *xy = (const double *)(map + hdr->offset[SAVE_PATH]);
+  uint64_t i, k, n = 0, path = 0;
+
+  if (start[0] || start[hdr->nodes] != hdr->links)
+    return -1;
+  for (i = 0; i < hdr->nodes; i++) {
+    if (start[i + 1] < start[i])
+      return -1;
+    for (k = start[i]; k < start[i + 1]; k++) {
+      if (nbr[k] >= hdr->nodes)
+        return -1;
+    }
+    if (mob[i].model > MOBILITY_PATH || mob[i].path > hdr->waypoints || \
+      !restore_mob_sane(&mob[i]))
+      return -1;
+    if (mob[i].model != MOBILITY_STATIC)
+      n++;
+    path += mob[i].path;
+  }
+  if (path != hdr->waypoints || !hdr->mob_seed)
+    return -1;
+  for (i = 0; i < 2 * hdr->waypoints; i++) {
+    if (!isfinite(xy[i]))
+      return -1;
+  }
+
+  /* The ranks of the movers must be 0 to n - 1, each once. A rank taken is
+   * marked until restore_moves() puts its node there */
+  memset(movers, 0, MAX(n, 1) * sizeof(struct node *));
+  for (i = 0; i < hdr->nodes; i++) {
+    if (mob[i].model == MOBILITY_STATIC)
+      continue;
+    if (mob[i].rank >= n || movers[mob[i].rank])
+      return -1;
+    movers[mob[i].rank] = (struct node *)movers;
+  }
+  return n;
+}
+
+/* Put back the mobility of every node, once the nodes are. Returns -1 on
+ * failure (to put back a path), 0 on success */
+static int restore_moves(const struct save_header *hdr, const char *map, \
+  struct node **movers, size_t n)
+{
+  int err = 0;
+  const struct soa *soa;
+  const struct handle_table *handles;
+  const struct save_mob *mob = \
+    (const struct save_mob *)(map + hdr->offset[SAVE_MOB]);
+  const double *xy = (const double *)(map + hdr->offset[SAVE_PATH]);
+  struct node *nodep;
+  uint64_t i, k;
+
+  if (!(soa = pack_nodes(&handles)))
+    return -1;
+  for (i = 0; i < hdr->nodes; i++, mob++) {
+    nodep = soa->node[i];
+    for (k = 0; k < mob->path; k++, xy += 2) {
+      if (add_waypoint(nodep, xy[0], xy[1]))
+        err = -1;
+    }
+    nodep->mob.model = mob->model;
+    nodep->mob.speed = mob->speed;
+    nodep->mob.dx = mob->dx;
+    nodep->mob.dy = mob->dy;
+    nodep->mob.tx = mob->tx;
+    nodep->mob.ty = mob->ty;
+    nodep->mob.timer = mob->timer;
+    if (mob->model != MOBILITY_STATIC)
+      movers[mob->rank] = nodep;
+  }
+  restore_mobility(movers, n, hdr->mob_seed, hdr->mob_tick);
+  return err;
+}
+
+/* LOCK node_head BEFORE CALLING THIS FUNCTION! */
+/* Replace the state of the simulator with a saved state. Every node is
+ * dropped, with its process, and every event waiting is cancelled. A file that
+ * doesn't check out changes nothing, but a failure past that leaves no node at
+ * all. Returns -1 on failure, the number of nodes restored on success */
+int64_t restore_state(const char *path)
+{
+  int64_t err = -1, n;
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  struct save_header hdr;
+  struct soa saved;
+  struct node **movers = NULL;
+  char *map = MAP_FAILED;
+  double range;
+
+  if (fd < 0 || fstat(fd, &st)) {
+    fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    goto peace;
+  }
+  if (st.st_size < sizeof(hdr))
+    goto bad_file;
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED) {
+    fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    goto peace;
+  }
+  madvise(map, st.st_size, MADV_SEQUENTIAL);
+  memcpy(&hdr, map, sizeof(hdr));
+  if (memcmp(hdr.magic, SAVE_MAGIC, sizeof(hdr.magic)) || \
+    hdr.version != SAVE_VERSION || !restore_fits(&hdr, st.st_size))
+    goto bad_file;
+  G_LOCK(postel);
+  range = postel.node_r_size;
+  G_UNLOCK(postel);
+  if (hdr.range != range) {
+    fprintf(stderr, "%s: saved with a range of %.0f, not %.0f.\n", path, \
+      hdr.range, range);
+    goto peace;
+  }
+  if (!(movers = malloc(MAX(hdr.nodes, 1) * sizeof(struct node *))))
+    goto peace;
+  if ((n = restore_check(&hdr, map, movers)) < 0)
+    goto bad_file;
+
+  saved.n = hdr.nodes;
+  saved.x = (double *)(map + hdr.offset[SAVE_X]);
+  saved.y = (double *)(map + hdr.offset[SAVE_Y]);
+  saved.r = (double *)(map + hdr.offset[SAVE_R]);
+  saved.nbr_start = (uint32_t *)(map + hdr.offset[SAVE_NBR_START]);
+  saved.nbr = (uint32_t *)(map + hdr.offset[SAVE_NBR]);
+  saved.nbr_len = hdr.links;
+
+  /* The mobility tick goes first, then every other event */
+  shutdown_mobility();
+  restore_clock(hdr.clock);
+  if ((err = restore_nodes(&saved, (const int64_t *)(map + \
+    hdr.offset[SAVE_ID]), (const uint32_t *)(map + hdr.offset[SAVE_SLOTS]), \
+    hdr.slots, hdr.free_head)) < 0)
+    goto peace;
+  if (restore_moves(&hdr, map, movers, n))
+    fprintf(stderr, "%s: unable to restore every waypoint.\n", path);
+  goto peace;
+
+bad_file:
+  fprintf(stderr, "%s: not a version %d saved state.\n", path, SAVE_VERSION);
+peace:
+  if (map != MAP_FAILED)
+    munmap(map, st.st_size);
+  if (fd >= 0)
+    close(fd);
+  free(movers);
+  return err;
+}
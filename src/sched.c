@@ -0,0 +1,354 @@
+/* sched.c: the discrete event scheduler and the simulated clock.
+ * Copyright  2015 Jack Morton <jhm@jemscout.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "postel.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+#include <uv.h>
+
+extern struct global_state_struct postel;
+G_LOCK_EXTERN(postel);
+
+/* Events wait in a 4-ary min heap, ordered by their simulated time in
+ * nanoseconds and then by the order they were scheduled in, so that a run is
+ * the same every time. Each event knows its slot, so that it is cancelled in
+ * O(log n).
+ *
+ * In realtime mode the clock follows the wall clock from the moment the mode
+ * was set, and a timer wakes the loop at the next event. In afap mode events
+ * are run in batches from an idle handle, the clock jumping from one event to
+ * the next, while the loop still services the console and the nodes between
+ * batches. In pause mode the clock stands still. Either running mode can be
+ * limited to an amount of simulated time, after which the clock pauses.
+ *
+ * The scheduler is only used from the simulator thread. */
+#define SCHED_ARITY 4
+#define SCHED_BATCH 4096  /* Most events run per turn of the loop */
+
+struct event {
+  uint64_t time, seq;
+  size_t slot;  /* In the heap */
+  void (*fn)(void *arg);
+  void (*cancel)(void *arg);
+  void *arg;
+};
+
+static const char *sched_modes[] = {"realtime", "afap", "pause"};
+
+static struct event **sched_heap;
+static size_t sched_n, sched_cap;
+static uint64_t sched_seq;
+static struct pool event_pool;
+
+static uv_timer_t sched_timer;
+static uv_idle_t sched_idle;
+static enum sched_mode sched_mode;
+static uint64_t sched_clock;       /* The time of the last event run */
+static uint64_t sched_until;       /* Pause at this time */
+static uint64_t sched_wall_base;   /* uv_hrtime() as realtime mode began */
+static uint64_t sched_sim_base;    /* The clock as realtime mode began */
+static int sched_running;          /* Inside an event */
+
+static int sched_before(const struct event *a, const struct event *b)
+{
+  return a->time < b->time || (a->time == b->time && a->seq < b->seq);
+}
+
+static void sched_place(size_t slot, struct event *ev)
+{
+  sched_heap[slot] = ev;
+  ev->slot = slot;
+}
+
+static void sched_up(size_t slot)
+{
+  struct event *ev = sched_heap[slot];
+  size_t parent;
+
+  while (slot) {
+    parent = (slot - 1) / SCHED_ARITY;
+    if (!sched_before(ev, sched_heap[parent]))
+      break;
+    sched_place(slot, sched_heap[parent]);
+    slot = parent;
+  }
+  sched_place(slot, ev);
+}
+
+static void sched_down(size_t slot)
+{
+  struct event *ev = sched_heap[slot];
+  size_t child, best, last;
+
+  for (;;) {
+    child = slot * SCHED_ARITY + 1;
+    if (child >= sched_n)
+      break;
+    last = MIN(child + SCHED_ARITY, sched_n);
+    for (best = child++; child < last; child++) {
+      if (sched_before(sched_heap[child], sched_heap[best]))
+        best = child;
+    }
+    if (!sched_before(sched_heap[best], ev))
+      break;
+    sched_place(slot, sched_heap[best]);
+    slot = best;
+  }
+  sched_place(slot, ev);
+}
+
+static void sched_remove(struct event *ev)
+{
+  struct event *last = sched_heap[--sched_n];
+
+  if (ev == last)
+    return;
+  sched_place(ev->slot, last);
+  sched_up(last->slot);
+  sched_down(last->slot);
+}
+
+/* Returns the current simulated time, in nanoseconds */
+uint64_t sched_now(void)
+{
+  uint64_t now;
+
+  if (sched_mode != SCHED_REALTIME || sched_running)
+    return sched_clock;
+  now = sched_sim_base + (uv_hrtime() - sched_wall_base);
+  return MAX(sched_clock, MIN(now, sched_until));
+}
+
+static void sched_timer_cb(uv_timer_t *handle);
+static void sched_idle_cb(uv_idle_t *handle);
+
+/* Wake the loop when the next event, or the pause, is due */
+static void sched_arm(void)
+{
+  uint64_t next = sched_until, now;
+
+  uv_timer_stop(&sched_timer);
+  uv_idle_stop(&sched_idle);
+  if (sched_n)
+    next = MIN(next, sched_heap[0]->time);
+  if (next == UINT64_MAX)
+    return;
+  switch (sched_mode) {
+    case SCHED_REALTIME:
+      now = sched_now();
+      uv_timer_start(&sched_timer, &sched_timer_cb, \
+        (next > now) ? (next - now + 999999) / 1000000 : 0, 0);
+      break;
+    case SCHED_AFAP:
+      uv_idle_start(&sched_idle, &sched_idle_cb);
+      break;
+    case SCHED_PAUSE:
+      break;
+  }
+}
+
+/* Run up to SCHED_BATCH events due by limit. Returns the number run */
+static size_t sched_run(uint64_t limit)
+{
+  size_t n;
+  struct event *ev;
+
+  for (n = 0; n < SCHED_BATCH && sched_n; n++) {
+    ev = sched_heap[0];
+    if (ev->time > limit)
+      break;
+    sched_remove(ev);
+    sched_clock = MAX(sched_clock, ev->time);
+    sched_running = TRUE;
+    ev->fn(ev->arg);
+    sched_running = FALSE;
+    pool_free(&event_pool, ev);
+  }
+  return n;
+}
+
+/* Run out of events before the pause, then pause */
+static void sched_limit(void)
+{
+  if (sched_until == UINT64_MAX || \
+    (sched_n && sched_heap[0]->time <= sched_until))
+    return;
+  if (sched_mode == SCHED_AFAP || sched_now() >= sched_until) {
+    sched_clock = sched_until;
+    sched_mode = SCHED_PAUSE;
+    sched_until = UINT64_MAX;
+  }
+}
+
+static void sched_timer_cb(uv_timer_t *handle)
+{
+  uint64_t now = sched_now();
+
+  sched_run(now);
+  sched_clock = MAX(sched_clock, now);
+  sched_limit();
+  sched_arm();
+}
+
+static void sched_idle_cb(uv_idle_t *handle)
+{
+  sched_run(sched_until);
+  sched_limit();
+  sched_arm();
+}
+
+/* Schedule fn(arg) at a simulated time, or now if that time has passed.
+ * cancel(arg), if not NULL, is called instead should the event be cancelled,
+ * or left over at shutdown. Returns NULL on failure, the event on success,
+ * which is only valid until it runs */
+struct event *sched_at(uint64_t time, void (*fn)(void *), \
+  void (*cancel)(void *), void *arg)
+{
+  struct event *ev, **heap;
+  size_t cap;
+
+  if (sched_n == sched_cap) {
+    cap = sched_cap ? sched_cap * 2 : 256;
+    if (!(heap = realloc(sched_heap, cap * sizeof(struct event *))))
+      return NULL;
+    sched_heap = heap;
+    sched_cap = cap;
+  }
+  if (!(ev = pool_alloc(&event_pool)))
+    return NULL;
+  ev->time = MAX(time, sched_now());
+  ev->seq = sched_seq++;
+  ev->fn = fn;
+  ev->cancel = cancel;
+  ev->arg = arg;
+  sched_place(sched_n++, ev);
+  sched_up(ev->slot);
+  /* Only an earlier wake up changes the timer */
+  if (!ev->slot && !sched_running)
+    sched_arm();
+  return ev;
+}
+
+/* Schedule fn(arg) delay nanoseconds from now, see sched_at() */
+struct event *sched_in(uint64_t delay, void (*fn)(void *), \
+  void (*cancel)(void *), void *arg)
+{
+  return sched_at(sched_now() + delay, fn, cancel, arg);
+}
+
+/* Cancel an event that hasn't run yet */
+void sched_cancel(struct event *ev)
+{
+  int top = !ev->slot;
+
+  sched_remove(ev);
+  if (ev->cancel)
+    ev->cancel(ev->arg);
+  pool_free(&event_pool, ev);
+  if (top && !sched_running)
+    sched_arm();
+}
+
+/* Returns the simulated time an event is due at */
+uint64_t event_time(const struct event *ev)
+{
+  return ev->time;
+}
+
+/* Returns -1 on failure (to find the mode), the mode on success */
+int find_clock(const char *name)
+{
+  int i;
+
+  for (i = 0; i < sizeof(sched_modes) / sizeof(sched_modes[0]); i++) {
+    if (!strcasecmp(name, sched_modes[i]))
+      return i;
+  }
+  return -1;
+}
+
+/* Switch the mode of the clock. With seconds above zero, the clock pauses
+ * once that much simulated time has passed. */
+void set_clock(enum sched_mode mode, double seconds)
+{
+  sched_clock = sched_now();
+  sched_mode = mode;
+  sched_sim_base = sched_clock;
+  sched_wall_base = uv_hrtime();
+  sched_until = (seconds > 0.0) ? sched_clock + (uint64_t)(seconds * 1e9) : \
+    UINT64_MAX;
+  sched_arm();
+}
+
+/* Cancel every event waiting, and set the clock to now, in the mode it is in,
+ * as a saved state is restored */
+void restore_clock(uint64_t now)
+{
+  while (sched_n)
+    sched_cancel(sched_heap[0]);
+  sched_clock = sched_sim_base = now;
+  sched_wall_base = uv_hrtime();
+  sched_until = UINT64_MAX;
+  sched_arm();
+}
+
+/* Returns the name of the current mode, and the time, pause time (or
+ * UINT64_MAX) and number of events waiting */
+const char *get_clock(uint64_t *now, uint64_t *until, size_t *events)
+{
+  *now = sched_now();
+  *until = sched_until;
+  *events = sched_n;
+  return sched_modes[sched_mode];
+}
+
+/* Cancel every event left, and stop the clock */
+void shutdown_sched(void)
+{
+  while (sched_n)
+    sched_cancel(sched_heap[0]);
+  uv_timer_stop(&sched_timer);
+  uv_idle_stop(&sched_idle);
+  free(sched_heap);
+  sched_heap = NULL;
+  sched_n = sched_cap = 0;
+  shutdown_pool(&event_pool);
+}
+
+/* Returns -1 on failure, 0 on success */
+int init_sched(uv_loop_t *loop)
+{
+  enum sched_mode mode;
+
+  if (init_pool(&event_pool, "event", sizeof(struct event), FALSE))
+    return -1;
+  uv_timer_init(loop, &sched_timer);
+  uv_idle_init(loop, &sched_idle);
+  sched_clock = 0;
+  G_LOCK(postel);
+  mode = postel.clock;
+  G_UNLOCK(postel);
+  set_clock(mode, 0.0);
+  return 0;
+}
@@ -0,0 +1,285 @@
+/* shm.c: the shared memory transport of node processes.
+ * Copyright  2015 Jack Morton <jhm@jemscout.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#define _GNU_SOURCE  /* For memfd_create() */
+
+#include "postel.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <arpa/inet.h>
+#include <glib.h>
+#include <uv.h>
+
+/* The node runs as "file id shm", with a shared memory region on descriptor
+ * 3, and two eventfd doorbells: the simulator rings 4 when it puts frames in
+ * the rx ring, and the node rings 5 when it puts frames in the tx ring. Both
+ * doorbells are non-blocking, and are waited on with poll().
+ *
+ * Each ring has one producer and one consumer. head and tail count the bytes
+ * ever written and read, so head - tail bytes are waiting at offset tail %
+ * ring_size of the data of the ring, wrapping around its end. Frames are laid
+ * out as on a FIFO, and are published whole: the producer copies a frame in,
+ * then stores head with release ordering. The consumer loads head with acquire
+ * ordering, copies the frames out, then stores tail with release ordering.
+ *
+ * A consumer about to sleep sets wake, then checks head once more. A producer
+ * that publishes frames, then finds wake set, clears it and rings the
+ * doorbell. Both sides put a full barrier between their two steps, so a
+ * doorbell is never missed, and a node that keeps up is never woken for
+ * nothing.
+ *
+ * The node can write anything to the region, so the simulator never reads
+ * back what only it should write: the size of the rings is its own constant,
+ * and it keeps the head of rx and the tail of tx to itself, only storing them
+ * in the region. A head or tail from the node more than a ring apart from
+ * ours breaks the ring. */
+#define SHM_MAGIC 0x7073746cU  /* "pstl" */
+#define SHM_VERSION 1
+#define SHM_RING_SIZE MAX_FRAME_QUEUE  /* A power of two */
+
+struct shm_ring {
+  uint32_t head;  /* Bytes ever written, advanced by the producer */
+  char pad0[60];
+  uint32_t tail;  /* Bytes ever read, advanced by the consumer */
+  char pad1[60];
+  uint32_t wake;  /* Set by a consumer about to sleep */
+  char pad2[60];
+};
+
+struct shm_region {
+  uint32_t magic, version, ring_size;
+  char pad[52];
+  struct shm_ring rx;  /* Frames to the node */
+  struct shm_ring tx;  /* Frames from the node */
+  char data[];         /* ring_size bytes for rx, then ring_size for tx */
+};
+
+#define SHM_RX_DATA(region) ((region)->data)
+#define SHM_TX_DATA(region) ((region)->data + SHM_RING_SIZE)
+#define SHM_SIZE (sizeof(struct shm_region) + 2 * SHM_RING_SIZE)
+
+/* Ring a doorbell, if the consumer went to sleep */
+static void shm_ring_bell(struct shm_ring *ring, int bell)
+{
+  uint64_t one = 1;
+
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_exchange_n(&ring->wake, 0, __ATOMIC_SEQ_CST) && \
+    write(bell, &one, sizeof(one)) < 0)
+    fprintf(stderr, "Unable to ring a node doorbell: %s\n", strerror(errno));
+}
+
+static void shm_close_cb(uv_handle_t *handle)
+{
+  struct proc *proc = handle->data;
+
+  close(proc->chan.shm.bell_tx);
+  release_proc(proc);
+}
+
+/* Unmap the region, and close its descriptors */
+static void shm_close(struct proc *proc)
+{
+  if (proc->chan.shm.region)
+    munmap(proc->chan.shm.region, SHM_SIZE);
+  proc->chan.shm.region = NULL;
+  if (proc->chan.shm.fd >= 0)
+    close(proc->chan.shm.fd);
+  if (proc->chan.shm.bell_rx >= 0)
+    close(proc->chan.shm.bell_rx);
+  proc->chan.shm.fd = proc->chan.shm.bell_rx = -1;
+  /* The watched doorbell is closed along with its watcher */
+  if (proc->chan.shm.poll.data)
+    uv_close((uv_handle_t *)&proc->chan.shm.poll, &shm_close_cb);
+  else if (proc->chan.shm.bell_tx >= 0)
+    close(proc->chan.shm.bell_tx);
+}
+
+/* A tail from the node that makes no sense reads as a full ring, so that
+ * every frame to it is dropped */
+static size_t shm_backlog(struct proc *proc)
+{
+  struct shm_ring *ring = &proc->chan.shm.region->rx;
+  uint32_t used = proc->chan.shm.rx_head - \
+    __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+  return MIN(used, SHM_RING_SIZE);
+}
+
+/* Copy every queued frame into the rx ring, dropping the frames that don't
+ * fit, and ring the doorbell once */
+static void shm_flush(struct proc *proc)
+{
+  struct shm_region *region = proc->chan.shm.region;
+  struct shm_ring *ring = &region->rx;
+  uint32_t head = proc->chan.shm.rx_head;
+  uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+  size_t i, len, off, n;
+  const char *frame;
+
+  for (i = 0; i < proc->out_n; i++) {
+    frame = proc->out[i].base;
+    len = proc->out[i].len;
+    /* A broken tail drops the frame */
+    if (head - tail <= SHM_RING_SIZE && SHM_RING_SIZE - (head - tail) >= len) {
+      off = head & (SHM_RING_SIZE - 1);
+      n = MIN(len, SHM_RING_SIZE - off);
+      memcpy(SHM_RX_DATA(region) + off, frame, n);
+      memcpy(SHM_RX_DATA(region), frame + n, len - n);
+      head += len;
+    }
+    frame_unref(proc->out_blocks[i]);
+  }
+  if (head != proc->chan.shm.rx_head) {
+    proc->chan.shm.rx_head = head;
+    __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+    shm_ring_bell(ring, proc->chan.shm.bell_rx);
+  }
+}
+
+/* LOCK node_head BEFORE CALLING THIS FUNCTION! */
+/* Copy the frames waiting in the tx ring into one block, hand the space back
+ * to the node, and deliver each frame. Returns -1 on failure (a broken ring),
+ * 0 on success */
+static int shm_drain(struct proc *proc)
+{
+  struct shm_region *region = proc->chan.shm.region;
+  struct shm_ring *ring = &region->tx;
+  uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+  uint32_t tail = proc->chan.shm.tx_tail, avail = head - tail, len;
+  size_t off = tail & (SHM_RING_SIZE - 1), n, i;
+  struct frame_block *block;
+
+  if (!avail)
+    return 0;
+  if (avail > SHM_RING_SIZE || !(block = frame_alloc(avail)))
+    return -1;
+  n = MIN(avail, SHM_RING_SIZE - off);
+  memcpy(block->data, SHM_TX_DATA(region) + off, n);
+  memcpy(block->data + n, SHM_TX_DATA(region), avail - n);
+  proc->chan.shm.tx_tail = head;
+  __atomic_store_n(&ring->tail, head, __ATOMIC_RELEASE);
+
+  for (i = 0; i < avail; i += sizeof(len) + len) {
+    if (avail - i < sizeof(len))
+      goto broken;
+    memcpy(&len, block->data + i, sizeof(len));
+    len = ntohl(len);
+    if (len > MAX_FRAME || avail - i - sizeof(len) < len)
+      goto broken;
+    if (proc->node)
+      deliver_frame(proc->node, block, block->data + i, sizeof(len) + len);
+  }
+  frame_unref(block);
+  return 0;
+
+broken:
+  frame_unref(block);
+  return -1;
+}
+
+static void shm_poll_cb(uv_poll_t *handle, int status, int events)
+{
+  struct proc *proc = handle->data;
+  struct shm_ring *ring;
+  uint64_t count;
+
+  NODE_LOCK();
+  if (proc->closed)
+    goto peace;
+  ring = &proc->chan.shm.region->tx;
+  if (status < 0 || (read(proc->chan.shm.bell_tx, &count, sizeof(count)) < 0 \
+    && errno != EAGAIN))
+    goto broken;
+  /* Sleep only once the ring is seen empty after asking to be woken */
+  do {
+    if (shm_drain(proc))
+      goto broken;
+    __atomic_store_n(&ring->wake, 1, __ATOMIC_SEQ_CST);
+  } while (__atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) != \
+    proc->chan.shm.tx_tail);
+  goto peace;
+
+broken:
+  fprintf(stderr, "Node %" PRId64 " broke its shared memory ring.\n", \
+    proc->id);
+  fail_proc(proc);
+peace:
+  NODE_UNLOCK();
+}
+
+/* Returns -1 on failure, 0 on success */
+static int shm_open_chan(struct proc *proc, uv_loop_t *loop, \
+  uv_process_options_t *options)
+{
+  struct shm_region *region;
+  int i;
+
+  proc->chan.shm.fd = proc->chan.shm.bell_rx = proc->chan.shm.bell_tx = -1;
+  if ((proc->chan.shm.fd = memfd_create("postel", MFD_CLOEXEC)) < 0 || \
+    ftruncate(proc->chan.shm.fd, SHM_SIZE))
+    return -1;
+  region = mmap(NULL, SHM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, \
+    proc->chan.shm.fd, 0);
+  if (region == MAP_FAILED)
+    return -1;
+  proc->chan.shm.region = region;
+  proc->chan.shm.rx_head = proc->chan.shm.tx_tail = 0;
+  region->magic = SHM_MAGIC;
+  region->version = SHM_VERSION;
+  region->ring_size = SHM_RING_SIZE;
+  region->rx.wake = region->tx.wake = 1;
+
+  if ((proc->chan.shm.bell_rx = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0 \
+    || (proc->chan.shm.bell_tx = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+    return -1;
+  if (uv_poll_init(loop, &proc->chan.shm.poll, proc->chan.shm.bell_tx))
+    return -1;
+  proc->chan.shm.poll.data = proc;
+  proc->handles++;
+  if (uv_poll_start(&proc->chan.shm.poll, UV_READABLE, &shm_poll_cb))
+    return -1;
+
+  options->args[2] = "shm";
+  options->stdio[3].data.fd = proc->chan.shm.fd;
+  options->stdio[4].data.fd = proc->chan.shm.bell_rx;
+  options->stdio[5].data.fd = proc->chan.shm.bell_tx;
+  for (i = 3; i < 6; i++)
+    options->stdio[i].flags = UV_INHERIT_FD;
+  options->stdio_count = 6;
+  return 0;
+}
+
+const struct transport_ops shm_transport_ops = {
+  "shm",
+  &shm_open_chan,
+  &shm_close,
+  &shm_backlog,
+  &shm_flush
+};
@@ -23,159 +23,879 @@
 
 #include "postel.h"
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <limits.h>
 #include <math.h>
-#include <goocanvas.h>
 #include <uv.h>
 
 extern struct global_state_struct postel;
 G_LOCK_EXTERN(postel);
-G_LOCK_DEFINE(node_head);
+GRWLock node_head_lock;
+struct node_list node_head;
 
-#define TREE_INSERT(head, elm) tree_insert(NULL, head, elm, 0)
-#define TREE_INIT(head) *head = NULL
+/* The spatial index over all nodes, of the backend in postel.index */
+static struct node_index node_index;
+/* Node ids are handles into this table, so that looking up, validating and
+ * deleting a node by id is O(1), and a stale id never finds a new node */
+static struct handle_table node_handles;
+/* Nodes and sibling links are carved from pools, nodes on cache lines */
+static struct pool node_pool, sib_pool;
+/* Positions and packed siblings of every node, as dense arrays */
+static struct soa node_soa;
 
-/* Insert a node into a 2-dimensional k-d tree */
-static void tree_insert(struct node **parent, struct node **nodep, \
-  struct node *nodei, int axis)
+/* Link two nodes as siblings. Returns -1 on failure, 0 on success */
+static int sib_link(struct node *a, struct node *b)
 {
-  int flip;
+  struct sibling *sa = pool_alloc(&sib_pool);
+  struct sibling *sb = pool_alloc(&sib_pool);
 
-  /* Insert the node... */
-  if (!*nodep) {
-    nodei->tree.axis = axis;
-    if (parent)
-      nodei->tree.parent = (*parent);
-    nodei->tree.left = nodei->tree.right = NULL;
-    *nodep = nodei;
-    return;
+  if (!sa || !sb) {
+    pool_free(&sib_pool, sa);
+    pool_free(&sib_pool, sb);
+    return -1;
   }
-
-  /* Or traverse the tree */
-  flip = ((*nodep)->tree.axis + 1) & 1;
-  if ((*nodep)->tree.axis)
-    tree_insert(&(*nodep), (nodei->x < (*nodep)->x) ? &(*nodep)->tree.left : \
-      &(*nodep)->tree.right, nodei, flip);
-  else
-    tree_insert(&(*nodep), (nodei->y < (*nodep)->y) ? &(*nodep)->tree.left : \
-      &(*nodep)->tree.right, nodei, flip);
+  sa->node = b;
+  sa->twin = sb;
+  sb->node = a;
+  sb->twin = sa;
+  node_soa.nbr_stale = TRUE;
+  LIST_INSERT_HEAD(&a->siblings, sa, sibs);
+  LIST_INSERT_HEAD(&b->siblings, sb, sibs);
+  a->sib_count++;
+  b->sib_count++;
+  trace_link(TRACE_LINK_UP, a, b);
+  return 0;
 }
 
-/* Remove a node from the k-d tree */
-static void tree_remove(struct node **nodep)
+/* Drop a link, and its twin on the other end */
+static void sib_unlink(struct node *nodep, struct sibling *sibp)
 {
+  trace_link(TRACE_LINK_DOWN, nodep, sibp->node);
+  node_soa.nbr_stale = TRUE;
+  LIST_REMOVE(sibp->twin, sibs);
+  sibp->node->sib_count--;
+  pool_free(&sib_pool, sibp->twin);
+  LIST_REMOVE(sibp, sibs);
+  nodep->sib_count--;
+  pool_free(&sib_pool, sibp);
 }
 
-/* Perform a nearest neightor search for the closest node in the tree */
-static struct node *find_nearest(struct node *nodep, double x, double y)
+/* Drop every link of a node */
+static void sib_unlink_all(struct node *nodep)
 {
-  struct node *ret;
-  double dist_x, dist_y;
-
-  if (!nodep)
-    return NULL;
+  while (!LIST_EMPTY(&nodep->siblings))
+    sib_unlink(nodep, LIST_FIRST(&nodep->siblings));
+}
 
-  dist_x = x - nodep->x;
-  dist_y = y - nodep->y;
+/* Range query callback, linking a node to each unmarked node in its range */
+struct sib_update_arg {
+  struct node *nodep;
+  unsigned long stamp;
+  int err;
+};
 
-  if (nodep->tree.axis)
-    ret = find_nearest((dist_x <= 0.0) ? nodep->tree.left : nodep->tree.right, \
-      x, y);
-  else
-    ret = find_nearest((dist_y <= 0.0) ? nodep->tree.left : nodep->tree.right, \
-      x, y);
+static void sib_update_cb(struct node *nodep, void *data)
+{
+  struct sib_update_arg *arg = data;
 
-  return (ret) ? ret : nodep;
+  if (nodep->mark != arg->stamp && !arg->err)
+    arg->err = sib_link(arg->nodep, nodep);
 }
 
-/* LOCK node_head BEFORE CALLING THIS FUNCTION! */
-/* Returns -1 on failure, new node id on success */
-int add_node(double x, double y)
+/* Bring the siblings of a new or moved node up to date. Links that fell out of
+ * range are dropped, and the nodes still linked are marked with a fresh stamp,
+ * so that one range query links exactly the nodes that came into range.
+ * Returns -1 on failure, 0 on success */
+static int sib_update(struct node *nodep, double range)
 {
-  int err = 0;
-  struct node *nodei = malloc(sizeof(struct node));
-  if (!nodei) {
-    err = -1;
-    goto peace;
+  static unsigned long stamp;
+  struct sibling *sibp, *next;
+  struct sib_update_arg arg;
+  double dist_x, dist_y;
+  uint64_t start;
+
+  arg.nodep = nodep;
+  arg.stamp = ++stamp;
+  arg.err = 0;
+  nodep->mark = arg.stamp;
+  for (sibp = LIST_FIRST(&nodep->siblings); sibp; sibp = next) {
+    next = LIST_NEXT(sibp, sibs);
+    dist_x = nodep->x - sibp->node->x;
+    dist_y = nodep->y - sibp->node->y;
+    if (dist_x * dist_x + dist_y * dist_y > range * range)
+      sib_unlink(nodep, sibp);
+    else
+      sibp->node->mark = arg.stamp;
   }
+  start = uv_hrtime();
+  INDEX_RANGE(&node_index, nodep->x, nodep->y, range, sib_update_cb, &arg);
+  time_metric(METRIC_INDEX_QUERY, start);
+  return arg.err;
+}
 
-  /* Initialize the node */
-  nodei->id = (intptr_t)nodei;
+/* Initialize a node at x, y, with no links and no index yet. Returns -1 on
+ * failure (to fit in the matrix), 0 on success */
+static int node_init(struct node *nodei, double x, double y)
+{
   G_LOCK(postel);
-  /* X and Y must not exceed the matrix size, and must be greater than zero. */
-  if ((x + postel.matrix_zero) > postel.matrix_width || \
+  /* X and Y must not exceed the matrix size, and must be greater than zero.
+   * NaN fails every comparison, so it is caught first. */
+  if (!isfinite(x) || !isfinite(y) || \
+    (x + postel.matrix_zero) > postel.matrix_width || \
     ((y + postel.matrix_zero) > postel.matrix_height || \
      x < 0 || y < 0)) {
-    err = -1;
-    free(nodei);
     G_UNLOCK(postel);
-    goto peace;
+    return -1;
   }
+  G_UNLOCK(postel);
   nodei->x = x;
   nodei->y = y;
-  nodei->point = rndr_new_goo_ellipse((x + postel.matrix_zero), \
-    (y + postel.matrix_zero), postel.node_p_size, \
-    "line-width", 1.0, "stroke-color", "Dark Slate Gray",
-    "fill-color", "Light Green", NULL);
-  nodei->radius = rndr_new_goo_ellipse((x + postel.matrix_zero), \
-      (y + postel.matrix_zero), postel.node_r_size, \
-    "line-width", 1.0, "stroke-color", "Light Slate Gray", NULL);
-  G_UNLOCK(postel);
-  if (!nodei->point || !nodei->radius) {
-    free(nodei);
-    err = -1;
+  LIST_INIT(&nodei->siblings);
+  nodei->sib_count = 0;
+  nodei->mark = 0;
+  nodei->proc = NULL;
+  init_mobility_node(nodei);
+  return 0;
+}
+
+/* LOCK node_head BEFORE CALLING THIS FUNCTION! */
+/* Returns -1 on failure, new node id on success */
+int64_t add_node(double x, double y)
+{
+  int64_t err = -1;
+  double range;
+  uint64_t start = uv_hrtime();
+  struct node *nodei = pool_alloc(&node_pool);
+  if (!nodei)
     goto peace;
-  }
-  TREE_INSERT(&tree_head, nodei);
+
+  /* Initialize the node */
+  if (node_init(nodei, x, y))
+    goto free_node;
+  G_LOCK(postel);
+  range = postel.node_r_size;
+  G_UNLOCK(postel);
+  if (soa_add(&node_soa, nodei, range))
+    goto free_node;
+  /* The id comes first, so that the links are traced with it */
+  if ((nodei->id = alloc_handle(&node_handles, nodei)) < 0)
+    goto free_soa;
+  if (INDEX_INSERT(&node_index, nodei))
+    goto free_id;
+  trace_node(TRACE_ADD, nodei);
+
+  /* Only the nodes in range of the new node gain a sibling */
+  if (sib_update(nodei, range))
+    goto free_sibs;
   LIST_INSERT_HEAD(&node_head, nodei, nodes);
+  touch_snapshot();
+  err = nodei->id;
+  goto peace;
+
+free_sibs:
+  sib_unlink_all(nodei);
+  trace_node(TRACE_DEL, nodei);
+  INDEX_REMOVE(&node_index, nodei);
+free_id:
+  free_handle(&node_handles, nodei->id);
+free_soa:
+  soa_del(&node_soa, nodei);
+free_node:
+  pool_free(&node_pool, nodei);
+peace:
+  time_metric(METRIC_ADD_NODE, start);
+  return err;
+}
+
+#define ADD_BULK_RATIO 8
+
+/* LOCK node_head BEFORE CALLING THIS FUNCTION! */
+/* Add n nodes at once, at xy[2 * i], xy[2 * i + 1], and unless ids is NULL,
+ * set ids[i] to the id of each node, or -1 where none was added. Positions
+ * outside the matrix are skipped. The index takes the new nodes in one build,
+ * rather than one insert at a time, and every sibling link is rebuilt after,
+ * unless there are fewer than 1 / ADD_BULK_RATIO as many new nodes as there
+ * are nodes already: those are cheaper added one at a time. Should the
+ * rebuild fail, the new nodes are taken back out, and the links of the nodes
+ * there before rebuilt. Returns -1 on failure (no node added), the number of
+ * nodes added on success */
+int64_t add_nodes(const double *xy, size_t n, int64_t *ids)
+{
+  int64_t err = -1, id;
+  size_t i, added = 0;
+  double range;
+  struct node *nodei, **v;
+
+  if (n * ADD_BULK_RATIO < node_soa.n) {
+    for (i = 0; i < n; i++) {
+      if ((id = add_node(xy[2 * i], xy[2 * i + 1])) >= 0)
+        added++;
+      if (ids)
+        ids[i] = id;
+    }
+    return added;
+  }
+  if (!(v = malloc(MAX(n, 1) * sizeof(struct node *))))
+    return -1;
+  G_LOCK(postel);
+  range = postel.node_r_size;
+  G_UNLOCK(postel);
+
+  for (i = 0; i < n; i++) {
+    if (ids)
+      ids[i] = -1;
+    if (!(nodei = pool_alloc(&node_pool)))
+      goto free_nodes;
+    if (node_init(nodei, xy[2 * i], xy[2 * i + 1])) {
+      pool_free(&node_pool, nodei);
+      continue;
+    }
+    if (soa_add(&node_soa, nodei, range)) {
+      pool_free(&node_pool, nodei);
+      goto free_nodes;
+    }
+    if ((nodei->id = alloc_handle(&node_handles, nodei)) < 0) {
+      soa_del(&node_soa, nodei);
+      pool_free(&node_pool, nodei);
+      goto free_nodes;
+    }
+    LIST_INSERT_HEAD(&node_head, nodei, nodes);
+    v[added++] = nodei;
+    if (ids)
+      ids[i] = nodei->id;
+  }
+  if (INDEX_LOAD(&node_index, v, added))
+    goto free_nodes;
+  for (i = 0; i < added; i++)
+    trace_node(TRACE_ADD, v[i]);
+  if (rebuild_siblings())
+    goto del_nodes;
+  err = added;
+  goto peace;
 
+del_nodes:
+  while (added--) {
+    nodei = v[added];
+    sib_unlink_all(nodei);
+    trace_node(TRACE_DEL, nodei);
+    INDEX_REMOVE(&node_index, nodei);
+    soa_del(&node_soa, nodei);
+    LIST_REMOVE(nodei, nodes);
+    free_handle(&node_handles, nodei->id);
+    pool_free(&node_pool, nodei);
+  }
+  added = 0;
+  if (rebuild_siblings())
+    fprintf(stderr, "Unable to relink the nodes, links are missing until a " \
+      "rebuild.\n");
+free_nodes:
+  for (i = 0; ids && i < n; i++)
+    ids[i] = -1;
+  while (added--) {
+    nodei = v[added];
+    LIST_REMOVE(nodei, nodes);
+    free_handle(&node_handles, nodei->id);
+    soa_del(&node_soa, nodei);
+    pool_free(&node_pool, nodei);
+  }
 peace:
+  free(v);
   return err;
 }
 
+/* LOCK node_head, AT LEAST FOR READING, BEFORE CALLING THIS FUNCTION! */
+/* Returns NULL on failure (to find node), the node on success */
+struct node *find_node(int64_t id)
+{
+  return get_handle(&node_handles, id);
+}
+
+/* LOCK node_head, AT LEAST FOR READING, BEFORE CALLING THIS FUNCTION! */
+/* Walk the nodes a few at a time, newest id slot first, the lock being let go
+ * of in between: see prev_handle() for the cursor. Returns NULL once every
+ * node is walked, the next node on success */
+struct node *walk_nodes(uint32_t *cursor)
+{
+  return prev_handle(&node_handles, cursor);
+}
+
+/* LOCK node_head, AT LEAST FOR READING, BEFORE CALLING THIS FUNCTION! */
+/* Returns the number of nodes, and of links between them at *links */
+size_t count_nodes(size_t *links)
+{
+  size_t i, sibs = 0;
+
+  for (i = 0; i < node_soa.n; i++)
+    sibs += node_soa.node[i]->sib_count;
+  *links = sibs / 2;
+  return node_soa.n;
+}
+
 /* LOCK node_head BEFORE CALLING THIS FUNCTION! */
 /* Returns -1 on failure (to find node), 0 on success */
-int del_node(intptr_t id)
+int del_node(int64_t id)
 {
   int err = -1;
-  struct node *nodep;
+  uint64_t start = uv_hrtime();
+  struct node *nodep = find_node(id);
+
+  /* Timed on failure too, as add_node() is */
+  if (!nodep)
+    goto peace;
+  stop_proc(nodep);
+  stop_mobility_node(nodep);
+  sib_unlink_all(nodep);
+  trace_node(TRACE_DEL, nodep);
+  INDEX_REMOVE(&node_index, nodep);
+  soa_del(&node_soa, nodep);
+  LIST_REMOVE(nodep, nodes);
+  free_handle(&node_handles, id);
+  pool_free(&node_pool, nodep);
+  touch_snapshot();
+  err = 0;
+
+peace:
+  time_metric(METRIC_DEL_NODE, start);
+  return err;
+}
+
+/* LOCK node_head BEFORE CALLING THIS FUNCTION! */
+static void del_all_nodes(void)
+{
+  while (!LIST_EMPTY(&node_head))
+    del_node(LIST_FIRST(&node_head)->id);
+}
+
+/* LOCK node_head BEFORE CALLING THIS FUNCTION! */
+/* Pack the siblings of every node, for a save. Returns NULL on failure, the
+ * position store on success, and the table of node ids at *handles */
+const struct soa *pack_nodes(const struct handle_table **handles)
+{
+  *handles = &node_handles;
+  return soa_pack(&node_soa) ? NULL : &node_soa;
+}
+
+/* Returns TRUE if the packed siblings of a saved position store could have
+ * been linked by sib_link(): each in range, none the node itself, and none
+ * twice. Marks are used to find twins, and left at 0 */
+static int restore_links(const struct soa *saved, struct node **v)
+{
+  size_t i, k;
+  uint32_t j;
+  double dist_x, dist_y, slack;
+  int ok = TRUE;
+
+  for (i = 0; i < saved->n && ok; i++) {
+    /* The range test of a kernel may round the other way */
+    slack = saved->r[i] * saved->r[i] * (1.0 + 1e-9);
+    for (k = saved->nbr_start[i]; k < saved->nbr_start[i + 1]; k++) {
+      j = saved->nbr[k];
+      dist_x = saved->x[i] - saved->x[j];
+      dist_y = saved->y[i] - saved->y[j];
+      if (j == i || v[j]->mark == i + 1 || \
+        dist_x * dist_x + dist_y * dist_y > slack) {
+        ok = FALSE;
+        break;
+      }
+      v[j]->mark = i + 1;
+    }
+  }
+  for (i = 0; i < saved->n; i++)
+    v[i]->mark = 0;
+  return ok;
+}
+
+/* LOCK node_head BEFORE CALLING THIS FUNCTION! */
+/* Replace every node with the entries of a saved position store: entry i
+ * becomes node ids[i], at x[i], y[i] with a radius of r[i], linked to the
+ * entries of its packed siblings, and keeps entry i. The table of node ids
+ * takes the generations and free list of n_slots saved slots, see
+ * load_handles(). The index takes the nodes in one build, and no range is
+ * queried. A failure leaves no node at all. Returns -1 on failure, the number
+ * of nodes on success */
+int64_t restore_nodes(const struct soa *saved, const int64_t *ids, \
+  const uint32_t *slots, uint32_t n_slots, uint32_t free_head)
+{
+  int64_t err = -1;
+  size_t i, k, added = 0;
+  double range;
+  struct node *nodei, **v = malloc(MAX(saved->n, 1) * sizeof(struct node *));
+
+  if (!v)
+    return -1;
+  G_LOCK(postel);
+  range = postel.node_r_size;
+  G_UNLOCK(postel);
+  del_all_nodes();
+  if (load_handles(&node_handles, slots, n_slots, free_head))
+    goto peace;
+  for (i = 0; i < saved->n; i++) {
+    if (!(nodei = pool_alloc(&node_pool)))
+      goto free_nodes;
+    /* Every node gets the range add_node() gives it */
+    if (saved->r[i] != range || node_init(nodei, saved->x[i], saved->y[i]) \
+      || soa_add(&node_soa, nodei, saved->r[i])) {
+      pool_free(&node_pool, nodei);
+      goto free_nodes;
+    }
+    if (fill_handle(&node_handles, ids[i], nodei)) {
+      soa_del(&node_soa, nodei);
+      pool_free(&node_pool, nodei);
+      goto free_nodes;
+    }
+    nodei->id = ids[i];
+    LIST_INSERT_HEAD(&node_head, nodei, nodes);
+    v[added++] = nodei;
+  }
+  if (check_handles(&node_handles) || !restore_links(saved, v) || \
+    INDEX_LOAD(&node_index, v, added))
+    goto free_nodes;
+  for (i = 0; i < added; i++)
+    trace_node(TRACE_ADD, v[i]);
 
-  /* Search the queue and validate the id (pointer). */
-  LIST_FOREACH(nodep, &node_head, nodes) {
-    if (id == nodep->id) {
-      rndr_destroy_goo_item(nodep->point);
-      rndr_destroy_goo_item(nodep->radius);
-      LIST_REMOVE(nodep, nodes);
-      free(nodep);
-      err = 0;
-      break;
+  /* Each pair is packed from both ends, and linked from the first */
+  for (i = 0; i < added; i++) {
+    for (k = saved->nbr_start[i]; k < saved->nbr_start[i + 1]; k++) {
+      if (saved->nbr[k] > i && sib_link(v[i], v[saved->nbr[k]])) {
+        del_all_nodes();
+        goto peace;
+      }
     }
   }
+  touch_snapshot();
+  err = soa_pack(&node_soa) ? -1 : (int64_t)added;
+  goto peace;
+
+free_nodes:
+  while (added--) {
+    nodei = v[added];
+    LIST_REMOVE(nodei, nodes);
+    free_handle(&node_handles, nodei->id);
+    soa_del(&node_soa, nodei);
+    pool_free(&node_pool, nodei);
+  }
+peace:
+  free(v);
   return err;
 }
 
-void shutdown_simulator(void)
+/* LOCK node_head BEFORE CALLING THIS FUNCTION! */
+/* Move a node to x, y. The index and siblings are only updated around the
+ * node. Returns -1 on failure, 0 on success */
+int move_node(struct node *nodep, double x, double y)
+{
+  double old_x = nodep->x, old_y = nodep->y, range;
+
+  G_LOCK(postel);
+  /* X and Y must not exceed the matrix size, and must be greater than zero.
+   * NaN fails every comparison, so it is caught first. */
+  if (!isfinite(x) || !isfinite(y) || \
+    (x + postel.matrix_zero) > postel.matrix_width || \
+    ((y + postel.matrix_zero) > postel.matrix_height || \
+     x < 0 || y < 0)) {
+    G_UNLOCK(postel);
+    return -1;
+  }
+  range = postel.node_r_size;
+  G_UNLOCK(postel);
+
+  nodep->x = x;
+  nodep->y = y;
+  if (INDEX_MOVE(&node_index, nodep, old_x, old_y)) {
+    nodep->x = old_x;
+    nodep->y = old_y;
+    return -1;
+  }
+  soa_move(&node_soa, nodep);
+  trace_node(TRACE_MOVE, nodep);
+  touch_snapshot();
+  /* A failure leaves links out of date until the next move, not broken */
+  sib_update(nodep, range);
+  return 0;
+}
+
+/* Range query callback, linking a node to the nodes after it in the store */
+struct sib_rebuild_arg {
+  struct node *nodep;
+  int err;
+};
+
+static void sib_rebuild_cb(struct node *nodep, void *data)
 {
+  struct sib_rebuild_arg *arg = data;
+
+  if (nodep->soa > arg->nodep->soa && !arg->err)
+    arg->err = sib_link(arg->nodep, nodep);
+}
+
+/* Drop every link of every node, one node at a time, streaming through the
+ * position store. Each pair is linked once, by the node that comes first in
+ * the store. Returns -1 on failure, 0 on success */
+static int rebuild_serial(double range)
+{
+  size_t i;
+  struct sib_rebuild_arg arg;
+
+  for (i = 0; i < node_soa.n; i++)
+    sib_unlink_all(node_soa.node[i]);
+  arg.err = 0;
+  for (i = 0; i < node_soa.n && !arg.err; i++) {
+    arg.nodep = node_soa.node[i];
+    INDEX_RANGE(&node_index, node_soa.x[i], node_soa.y[i], range, \
+      sib_rebuild_cb, &arg);
+  }
+  return arg.err;
+}
+
+/* The parallel rebuild splits the position store into tasks of REBUILD_CHUNK
+ * entries, and runs four jobs over them on the worker threads. A task only
+ * ever changes the nodes of its own entries, and keeps what it finds in
+ * buffers of its own, so no job takes a lock:
+ *
+ * 1. Drop the links of each node, without touching the other end, which is
+ *    dropped along with the node it belongs to. A link paired with its twin
+ *    is traced down from the end first in the store.
+ * 2. Find every node in range of each node, in order of entry.
+ * 3. Make a link to each node found, on the list of the node that found it.
+ * 4. Pair each link with its twin, found by a binary search of the nodes
+ *    found from the other end. The node first in the store pairs both, and
+ *    traces the link up.
+ *
+ * A failure in any task falls back on the serial rebuild. */
+#define REBUILD_CHUNK 512
+
+struct rebuild_task {
+  uint32_t *nbr;          /* The entries found, node after node */
+  struct sibling **sibs;  /* The link made for each entry found */
+  size_t len, cap;
+  int err;
+};
+
+struct rebuild {
+  struct rebuild_task *tasks;
+  uint32_t *start;  /* Where the entries found from each node begin */
+  double range;
+  int err;
+};
+
+struct rebuild_find_arg {
+  struct rebuild_task *task;
+  uint32_t self;
+};
+
+/* Returns the number of entries found from entry i, at *nbr */
+static size_t rebuild_found(const struct rebuild *rb, size_t i, \
+  uint32_t **nbr, struct sibling ***sibs)
+{
+  struct rebuild_task *task = &rb->tasks[i / REBUILD_CHUNK];
+  size_t end = (i + 1 < node_soa.n && (i + 1) % REBUILD_CHUNK) ? \
+    rb->start[i + 1] : task->len;
+
+  *nbr = task->nbr + rb->start[i];
+  if (sibs)
+    *sibs = task->sibs + rb->start[i];
+  return end - rb->start[i];
+}
+
+static void rebuild_unlink(size_t t, void *data)
+{
+  size_t i, last = MIN((t + 1) * REBUILD_CHUNK, node_soa.n);
+  struct node *nodep;
+  struct sibling *sibp;
+
+  for (i = t * REBUILD_CHUNK; i < last; i++) {
+    nodep = node_soa.node[i];
+    while (!LIST_EMPTY(&nodep->siblings)) {
+      sibp = LIST_FIRST(&nodep->siblings);
+      if (sibp->twin && sibp->node->soa > nodep->soa)
+        trace_link(TRACE_LINK_DOWN, nodep, sibp->node);
+      LIST_REMOVE(sibp, sibs);
+      pool_free(&sib_pool, sibp);
+    }
+    nodep->sib_count = 0;
+  }
+}
+
+static void rebuild_find_cb(struct node *nodep, void *data)
+{
+  struct rebuild_find_arg *arg = data;
+  struct rebuild_task *task = arg->task;
+  uint32_t *nbr;
+  size_t cap;
+
+  if (nodep->soa == arg->self || task->err)
+    return;
+  if (task->len == task->cap) {
+    cap = task->cap ? task->cap * 2 : REBUILD_CHUNK * 16;
+    if (!(nbr = realloc(task->nbr, cap * sizeof(uint32_t)))) {
+      task->err = -1;
+      return;
+    }
+    task->nbr = nbr;
+    task->cap = cap;
+  }
+  task->nbr[task->len++] = nodep->soa;
+}
+
+static int rebuild_cmp(const void *a, const void *b)
+{
+  uint32_t ea = *(const uint32_t *)a, eb = *(const uint32_t *)b;
+
+  return (ea > eb) - (ea < eb);
+}
+
+static void rebuild_find(size_t t, void *data)
+{
+  struct rebuild *rb = data;
+  struct rebuild_find_arg arg;
+  size_t i, last = MIN((t + 1) * REBUILD_CHUNK, node_soa.n);
+  uint64_t start;
+
+  arg.task = &rb->tasks[t];
+  for (i = t * REBUILD_CHUNK; i < last && !arg.task->err; i++) {
+    rb->start[i] = arg.task->len;
+    arg.self = i;
+    start = uv_hrtime();
+    INDEX_RANGE(&node_index, node_soa.x[i], node_soa.y[i], rb->range, \
+      rebuild_find_cb, &arg);
+    time_metric(METRIC_INDEX_QUERY, start);
+    qsort(arg.task->nbr + rb->start[i], arg.task->len - rb->start[i], \
+      sizeof(uint32_t), &rebuild_cmp);
+  }
+  if (!arg.task->err && \
+    !(arg.task->sibs = calloc(MAX(arg.task->len, 1), \
+    sizeof(struct sibling *))))
+    arg.task->err = -1;
+}
+
+static void rebuild_link(size_t t, void *data)
+{
+  struct rebuild *rb = data;
+  struct rebuild_task *task = &rb->tasks[t];
+  size_t i, k, n, last = MIN((t + 1) * REBUILD_CHUNK, node_soa.n);
+  uint32_t *nbr;
+  struct sibling **sibs;
   struct node *nodep;
 
-  G_LOCK(node_head);
-  while (!LIST_EMPTY(&node_head)) {
-    nodep = LIST_FIRST(&node_head);
-    del_node(nodep->id);
+  for (i = t * REBUILD_CHUNK; i < last && !task->err; i++) {
+    nodep = node_soa.node[i];
+    n = rebuild_found(rb, i, &nbr, &sibs);
+    for (k = 0; k < n; k++) {
+      if (!(sibs[k] = pool_alloc(&sib_pool))) {
+        task->err = -1;
+        break;
+      }
+      sibs[k]->node = node_soa.node[nbr[k]];
+      sibs[k]->twin = NULL;
+      LIST_INSERT_HEAD(&nodep->siblings, sibs[k], sibs);
+      nodep->sib_count++;
+    }
+  }
+}
+
+static void rebuild_twin(size_t t, void *data)
+{
+  struct rebuild *rb = data;
+  struct rebuild_task *task = &rb->tasks[t];
+  size_t i, k, n, m, last = MIN((t + 1) * REBUILD_CHUNK, node_soa.n);
+  uint32_t *nbr, *other, *found, self;
+  struct sibling **sibs, **other_sibs;
+
+  for (i = t * REBUILD_CHUNK; i < last; i++) {
+    n = rebuild_found(rb, i, &nbr, &sibs);
+    self = i;
+    for (k = 0; k < n; k++) {
+      if (nbr[k] < i)
+        continue;
+      m = rebuild_found(rb, nbr[k], &other, &other_sibs);
+      /* Range tests are symmetric, but a missing twin must not go unseen */
+      if (!(found = bsearch(&self, other, m, sizeof(uint32_t), \
+        &rebuild_cmp))) {
+        task->err = -1;
+        return;
+      }
+      sibs[k]->twin = other_sibs[found - other];
+      other_sibs[found - other]->twin = sibs[k];
+      trace_link(TRACE_LINK_UP, node_soa.node[i], node_soa.node[nbr[k]]);
+    }
+  }
+}
+
+/* Returns the error of the first task that failed, 0 if none did */
+static int rebuild_err(const struct rebuild *rb, size_t tasks)
+{
+  size_t t;
+
+  for (t = 0; t < tasks; t++) {
+    if (rb->tasks[t].err)
+      return rb->tasks[t].err;
+  }
+  return 0;
+}
+
+/* Returns -1 on failure, 0 on success */
+static int rebuild_parallel(double range)
+{
+  size_t t, tasks = (node_soa.n + REBUILD_CHUNK - 1) / REBUILD_CHUNK;
+  struct rebuild rb;
+  int err = -1;
+
+  rb.range = range;
+  rb.tasks = calloc(tasks, sizeof(struct rebuild_task));
+  rb.start = malloc(MAX(node_soa.n, 1) * sizeof(uint32_t));
+  if (!rb.tasks || !rb.start)
+    goto peace;
+
+  run_workers(tasks, &rebuild_unlink, &rb);
+  run_workers(tasks, &rebuild_find, &rb);
+  if (rebuild_err(&rb, tasks))
+    goto peace;
+  run_workers(tasks, &rebuild_link, &rb);
+  if (rebuild_err(&rb, tasks))
+    goto peace;
+  run_workers(tasks, &rebuild_twin, &rb);
+  err = rebuild_err(&rb, tasks);
+
+peace:
+  /* Whatever links were made are dropped again by the serial rebuild */
+  if (err)
+    run_workers(tasks, &rebuild_unlink, &rb);
+  for (t = 0; rb.tasks && t < tasks; t++) {
+    free(rb.tasks[t].nbr);
+    free(rb.tasks[t].sibs);
   }
-  G_UNLOCK(node_head);
+  free(rb.tasks);
+  free(rb.start);
+  return err;
+}
+
+/* LOCK node_head BEFORE CALLING THIS FUNCTION! */
+/* Recompute every sibling link from scratch, on every worker thread. Returns
+ * -1 on failure, 0 on success */
+int rebuild_siblings(void)
+{
+  double range;
+  int err;
+  uint64_t start = uv_hrtime();
+
+  G_LOCK(postel);
+  range = postel.node_r_size;
+  G_UNLOCK(postel);
+
+  node_soa.nbr_stale = TRUE;
+  if (node_soa.n > UINT32_MAX)
+    err = rebuild_serial(range);
+  else if ((err = rebuild_parallel(range)))
+    err = rebuild_serial(range);
+  touch_snapshot();
+  time_metric(METRIC_REBUILD, start);
+  return (err) ? -1 : soa_pack(&node_soa);
+}
+
+void shutdown_simulator(void)
+{
+  shutdown_metrics();
+  shutdown_control();
+  shutdown_trace();
+  shutdown_mobility();
+  shutdown_sched();
+  shutdown_deliver();
+  shutdown_snapshot();
+  shutdown_workers();
+  NODE_LOCK();
+  shutdown_proc();
+  del_all_nodes();
+  if (node_index.data)
+    INDEX_DESTROY(&node_index);
+  shutdown_handles(&node_handles);
+  shutdown_soa(&node_soa);
+  shutdown_pool(&node_pool);
+  shutdown_pool(&sib_pool);
+  NODE_UNLOCK();
 }
 
 gpointer init_simulator(gpointer data)
 {
+  int err, headless;
+  const char *scenario, *control, *metrics;
   uv_loop_t *loop = uv_loop_new();
 
-  /* Initialize the node list */
-  G_LOCK(node_head);
+  /* Initialize the node list and the spatial index */
+  NODE_LOCK();
   LIST_INIT(&node_head);
-  TREE_INIT(&tree_head);
-  G_UNLOCK(node_head);
+  init_handles(&node_handles);
+  init_soa(&node_soa);
+  init_simd();
+  if (init_workers())
+    fprintf(stderr, "Unable to start worker threads, rebuilding serially.\n");
+  if (init_pool(&node_pool, "node", sizeof(struct node), TRUE) || \
+    init_pool(&sib_pool, "sibling", sizeof(struct sibling), FALSE)) {
+    NODE_UNLOCK();
+    fprintf(stderr, "Unable to initialize the node pools.\n");
+    return NULL;
+  }
+  G_LOCK(postel);
+  node_index.ops = postel.index;
+  err = INDEX_INIT(&node_index, postel.matrix_width - postel.matrix_zero, \
+    postel.matrix_height - postel.matrix_zero, postel.node_r_size);
+  G_UNLOCK(postel);
+  NODE_UNLOCK();
+  if (err) {
+    fprintf(stderr, "Unable to initialize the %s index.\n", \
+      node_index.ops->name);
+    return NULL;
+  }
+
+  if (init_sched(loop)) {
+    fprintf(stderr, "Unable to start the event scheduler.\n");
+    return NULL;
+  }
+  if (init_proc(loop)) {
+    fprintf(stderr, "Unable to create the node FIFO directory.\n");
+    return NULL;
+  }
+  if (init_deliver(loop)) {
+    fprintf(stderr, "Unable to start frame delivery.\n");
+    return NULL;
+  }
+  if (init_trace(loop)) {
+    fprintf(stderr, "Unable to start tracing.\n");
+    return NULL;
+  }
+  G_LOCK(postel);
+  headless = postel.headless;
+  G_UNLOCK(postel);
+  if (!headless && init_snapshot(loop)) {
+    fprintf(stderr, "Unable to start publishing snapshots.\n");
+    return NULL;
+  }
+
+  G_LOCK(postel);
+  scenario = postel.scenario;
+  G_UNLOCK(postel);
+  if (scenario) {
+    NODE_LOCK();
+    if (load_scenario(scenario) < 0)
+      fprintf(stderr, "Unable to load the scenario %s.\n", scenario);
+    NODE_UNLOCK();
+  }
+
+  G_LOCK(postel);
+  control = postel.control;
+  G_UNLOCK(postel);
+  if (init_control(loop)) {
+    fprintf(stderr, "Unable to listen on the control socket %s.\n", control);
+    return NULL;
+  }
+
+  G_LOCK(postel);
+  metrics = postel.metrics;
+  G_UNLOCK(postel);
+  if (init_metrics(loop)) {
+    fprintf(stderr, "Unable to write metrics to %s.\n", metrics);
+    return NULL;
+  }
 
   /* Initialize the console */
   init_console(loop);
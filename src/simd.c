@@ -0,0 +1,228 @@
+/* simd.c: vectorized range test kernels.
+ * Copyright  2015 Jack Morton <jhm@jemscout.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "postel.h"
+
+#include <stdio.h>
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SIMD_X86
+#endif
+
+/* Each kernel tests one point against a block of candidate coordinates and
+ * sets bit i of the mask when candidate i lies within the radius. Every kernel
+ * computes dx * dx + dy * dy <= r2 with the same operations in the same order,
+ * so all of them agree with the scalar kernel to the bit, which the check mode
+ * verifies on every call. That holds only while the compiler keeps each
+ * multiply and add apart: where FMA is available (avx512f, or -march=native),
+ * it would otherwise fuse some of them into an fma, rounded once instead of
+ * twice, and the kernels would differ in the last bit near the radius. This
+ * file is built with -ffp-contract=off for that. The kernel is picked at
+ * runtime from the features of the CPU. */
+typedef size_t (*range_kernel)(double x, double y, double r2, \
+  const double *xs, const double *ys, size_t n, uint64_t *mask);
+
+/* Test candidates from i onward, one at a time */
+static size_t range_tail(double x, double y, double r2, const double *xs, \
+  const double *ys, size_t i, size_t n, uint64_t *mask)
+{
+  size_t found = 0;
+  double dx, dy;
+
+  for (; i < n; i++) {
+    dx = x - xs[i];
+    dy = y - ys[i];
+    if (dx * dx + dy * dy <= r2) {
+      mask[i / 64] |= (uint64_t)1 << (i % 64);
+      found++;
+    }
+  }
+  return found;
+}
+
+static size_t range_scalar(double x, double y, double r2, const double *xs, \
+  const double *ys, size_t n, uint64_t *mask)
+{
+  memset(mask, 0, (n + 63) / 64 * sizeof(uint64_t));
+  return range_tail(x, y, r2, xs, ys, 0, n, mask);
+}
+
+#ifdef SIMD_X86
+__attribute__((target("sse2")))
+static size_t range_sse2(double x, double y, double r2, const double *xs, \
+  const double *ys, size_t n, uint64_t *mask)
+{
+  size_t i, found = 0;
+  int bits;
+  __m128d vx = _mm_set1_pd(x), vy = _mm_set1_pd(y), vr = _mm_set1_pd(r2);
+  __m128d dx, dy;
+
+  memset(mask, 0, (n + 63) / 64 * sizeof(uint64_t));
+  for (i = 0; i + 2 <= n; i += 2) {
+    dx = _mm_sub_pd(vx, _mm_loadu_pd(xs + i));
+    dy = _mm_sub_pd(vy, _mm_loadu_pd(ys + i));
+    bits = _mm_movemask_pd(_mm_cmple_pd(_mm_add_pd(_mm_mul_pd(dx, dx), \
+      _mm_mul_pd(dy, dy)), vr));
+    mask[i / 64] |= (uint64_t)bits << (i % 64);
+    found += __builtin_popcount(bits);
+  }
+  return found + range_tail(x, y, r2, xs, ys, i, n, mask);
+}
+
+__attribute__((target("avx2")))
+static size_t range_avx2(double x, double y, double r2, const double *xs, \
+  const double *ys, size_t n, uint64_t *mask)
+{
+  size_t i, found = 0;
+  int bits;
+  __m256d vx = _mm256_set1_pd(x), vy = _mm256_set1_pd(y);
+  __m256d vr = _mm256_set1_pd(r2), dx, dy;
+
+  memset(mask, 0, (n + 63) / 64 * sizeof(uint64_t));
+  for (i = 0; i + 4 <= n; i += 4) {
+    dx = _mm256_sub_pd(vx, _mm256_loadu_pd(xs + i));
+    dy = _mm256_sub_pd(vy, _mm256_loadu_pd(ys + i));
+    bits = _mm256_movemask_pd(_mm256_cmp_pd(_mm256_add_pd( \
+      _mm256_mul_pd(dx, dx), _mm256_mul_pd(dy, dy)), vr, _CMP_LE_OQ));
+    mask[i / 64] |= (uint64_t)bits << (i % 64);
+    found += __builtin_popcount(bits);
+  }
+  return found + range_tail(x, y, r2, xs, ys, i, n, mask);
+}
+
+__attribute__((target("avx512f")))
+static size_t range_avx512(double x, double y, double r2, const double *xs, \
+  const double *ys, size_t n, uint64_t *mask)
+{
+  size_t i, found = 0;
+  __mmask8 bits;
+  __m512d vx = _mm512_set1_pd(x), vy = _mm512_set1_pd(y);
+  __m512d vr = _mm512_set1_pd(r2), dx, dy;
+
+  memset(mask, 0, (n + 63) / 64 * sizeof(uint64_t));
+  for (i = 0; i + 8 <= n; i += 8) {
+    dx = _mm512_sub_pd(vx, _mm512_loadu_pd(xs + i));
+    dy = _mm512_sub_pd(vy, _mm512_loadu_pd(ys + i));
+    bits = _mm512_cmp_pd_mask(_mm512_add_pd(_mm512_mul_pd(dx, dx), \
+      _mm512_mul_pd(dy, dy)), vr, _CMP_LE_OQ);
+    mask[i / 64] |= (uint64_t)bits << (i % 64);
+    found += __builtin_popcount(bits);
+  }
+  return found + range_tail(x, y, r2, xs, ys, i, n, mask);
+}
+#endif
+
+static const struct {
+  const char *name;
+  range_kernel kernel;
+} kernels[] = {
+#ifdef SIMD_X86
+  {"avx512", &range_avx512},
+  {"avx2", &range_avx2},
+  {"sse2", &range_sse2},
+#endif
+  {"scalar", &range_scalar}
+};
+#define SIMD_KERNELS (sizeof(kernels) / sizeof(kernels[0]))
+
+static range_kernel simd_kernel = &range_scalar;
+static const char *simd_name = "scalar";
+static int simd_check;
+
+static int simd_supported(int i)
+{
+#ifdef SIMD_X86
+  /* __builtin_cpu_supports() only takes a literal */
+  __builtin_cpu_init();
+  if (!strcmp(kernels[i].name, "avx512"))
+    return __builtin_cpu_supports("avx512f");
+  if (!strcmp(kernels[i].name, "avx2"))
+    return __builtin_cpu_supports("avx2");
+  if (!strcmp(kernels[i].name, "sse2"))
+    return __builtin_cpu_supports("sse2");
+#endif
+  return TRUE;
+}
+
+/* Test x, y against n candidates with the current kernel, setting a bit of
+ * mask, which holds (n + 63) / 64 words, for each candidate within r2 (the
+ * squared radius). Returns the number of candidates within range. */
+size_t range_mask(double x, double y, double r2, const double *xs, \
+  const double *ys, size_t n, uint64_t *mask)
+{
+  size_t found = simd_kernel(x, y, r2, xs, ys, n, mask), i, words;
+  uint64_t check[SIMD_BLOCK / 64];
+
+  if (!simd_check || n > SIMD_BLOCK)
+    return found;
+
+  /* Cross check against the scalar kernel, and trust the scalar one */
+  words = (n + 63) / 64;
+  range_scalar(x, y, r2, xs, ys, n, check);
+  for (i = 0; i < words; i++) {
+    if (mask[i] != check[i]) {
+      fprintf(stderr, "simd: %s kernel disagrees with scalar at %.17g, " \
+        "%.17g (word %zu: %016llx != %016llx)\n", simd_name, x, y, i, \
+        (unsigned long long)mask[i], (unsigned long long)check[i]);
+      memcpy(mask, check, words * sizeof(uint64_t));
+      found = 0;
+      for (i = 0; i < words; i++)
+        found += __builtin_popcountll(check[i]);
+      break;
+    }
+  }
+  return found;
+}
+
+/* Select a kernel by name, or the fastest the CPU supports for "auto", and
+ * turn cross checking against the scalar kernel on or off. Returns -1 on
+ * failure (unknown or unsupported kernel), 0 on success */
+int set_simd(const char *name, int check)
+{
+  size_t i;
+
+  for (i = 0; i < SIMD_KERNELS; i++) {
+    if (!simd_supported(i))
+      continue;
+    if (!strcasecmp(name, "auto") || !strcasecmp(name, kernels[i].name)) {
+      simd_kernel = kernels[i].kernel;
+      simd_name = kernels[i].name;
+      simd_check = check;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+/* Returns the name of the current kernel, and whether it is cross checked */
+const char *get_simd(int *check)
+{
+  if (check)
+    *check = simd_check;
+  return simd_name;
+}
+
+void init_simd(void)
+{
+  set_simd("auto", FALSE);
+}
@@ -0,0 +1,172 @@
+/* snap.c: snapshots of the network, published to the renderer.
+ * Copyright  2015 Jack Morton <jhm@jemscout.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "postel.h"
+
+#include <stdlib.h>
+#include <glib.h>
+#include <uv.h>
+
+/* The simulator never draws. At most SNAP_HZ times a second, and only once
+ * something has changed, it copies the positions of the nodes and their links
+ * into a snapshot, and publishes it to the renderer through a triple buffer:
+ * the simulator fills the back buffer, then swaps it with the middle one,
+ * which the renderer swaps with its front buffer whenever it holds a fresh
+ * snapshot. Neither side ever waits on the other, and the renderer always
+ * finds the latest snapshot, skipping those it was too slow for.
+ *
+ * The copy is made on the thread pool, holding node_head for reading only,
+ * so that it runs alongside other readers, and the simulator loop gets on
+ * with everything but changing nodes meanwhile. One copy runs at a time. */
+#define SNAP_FRESH 4  /* Set in snap_middle when it holds a new snapshot */
+
+static struct snapshot snaps[3];
+static int snap_back = 0, snap_middle = 1, snap_front = 2;
+static unsigned long snap_seq;
+static int snap_dirty;
+static int snap_busy;  /* A copy is running */
+static int snap_err;   /* Of the last copy */
+static uv_timer_t snap_timer;
+static uv_work_t snap_work;
+
+/* The network changed, publish it at the next tick */
+void touch_snapshot(void)
+{
+  snap_dirty = TRUE;
+}
+
+/* Returns -1 on failure, 0 on success */
+static int snap_reserve(void **array, size_t *cap, size_t n, size_t size)
+{
+  void *grown;
+  size_t new_cap = *cap ? *cap : 256;
+
+  if (n <= *cap)
+    return 0;
+  while (new_cap < n)
+    new_cap *= 2;
+  if (!(grown = realloc(*array, new_cap * size)))
+    return -1;
+  *array = grown;
+  *cap = new_cap;
+  return 0;
+}
+
+/* LOCK node_head, AT LEAST FOR READING, BEFORE CALLING THIS FUNCTION! */
+/* Nodes are laid out in the order of the position store, and each link is
+ * taken once, from the node that comes first. Returns -1 on failure, 0 on
+ * success */
+static int snap_fill(struct snapshot *snap)
+{
+  struct node *nodep;
+  struct sibling *sibp;
+  size_t n = 0, links = 0;
+
+  LIST_FOREACH(nodep, &node_head, nodes) {
+    n++;
+    links += nodep->sib_count;
+  }
+  if (snap_reserve((void **)&snap->nodes, &snap->nodes_cap, n, \
+    sizeof(struct snap_node)) || snap_reserve((void **)&snap->links, \
+    &snap->links_cap, links / 2, sizeof(struct snap_link)))
+    return -1;
+
+  links = 0;
+  LIST_FOREACH(nodep, &node_head, nodes) {
+    snap->nodes[nodep->soa].id = nodep->id;
+    snap->nodes[nodep->soa].x = nodep->x;
+    snap->nodes[nodep->soa].y = nodep->y;
+    LIST_FOREACH(sibp, &nodep->siblings, sibs) {
+      if (sibp->node->soa > nodep->soa) {
+        snap->links[links].a = nodep->soa;
+        snap->links[links++].b = sibp->node->soa;
+      }
+    }
+  }
+  snap->n_nodes = n;
+  snap->n_links = links;
+  snap->seq = ++snap_seq;
+  return 0;
+}
+
+/* On the thread pool */
+static void snap_copy(uv_work_t *req)
+{
+  NODE_READ_LOCK();
+  snap_err = snap_fill(&snaps[snap_back]);
+  NODE_READ_UNLOCK();
+}
+
+static void snap_copied(uv_work_t *req, int status)
+{
+  snap_busy = FALSE;
+  /* On failure the network is published again at the next tick */
+  if (status || snap_err) {
+    snap_dirty = TRUE;
+    return;
+  }
+  snap_back = __atomic_exchange_n(&snap_middle, snap_back | SNAP_FRESH, \
+    __ATOMIC_ACQ_REL) & ~SNAP_FRESH;
+}
+
+static void snap_timer_cb(uv_timer_t *handle)
+{
+  if (!snap_dirty || snap_busy)
+    return;
+  /* Changes made while the copy runs publish it again */
+  snap_dirty = FALSE;
+  if (uv_queue_work(handle->loop, &snap_work, &snap_copy, &snap_copied)) {
+    snap_dirty = TRUE;
+    return;
+  }
+  snap_busy = TRUE;
+}
+
+/* Called from the renderer thread. Returns NULL if nothing was published
+ * since the last call, the latest snapshot otherwise, which stays valid until
+ * the next call */
+const struct snapshot *acquire_snapshot(void)
+{
+  if (!(__atomic_load_n(&snap_middle, __ATOMIC_ACQUIRE) & SNAP_FRESH))
+    return NULL;
+  snap_front = __atomic_exchange_n(&snap_middle, snap_front, \
+    __ATOMIC_ACQ_REL) & ~SNAP_FRESH;
+  return &snaps[snap_front];
+}
+
+/* The buffers outlive the simulator, as the renderer may still be reading
+ * one of them */
+void shutdown_snapshot(void)
+{
+  uv_timer_stop(&snap_timer);
+}
+
+/* Returns -1 on failure, 0 on success */
+int init_snapshot(uv_loop_t *loop)
+{
+  uv_timer_init(loop, &snap_timer);
+  /* Publishing alone shouldn't keep the loop running */
+  uv_unref((uv_handle_t *)&snap_timer);
+  snap_dirty = TRUE;
+  return uv_timer_start(&snap_timer, &snap_timer_cb, 0, 1000 / SNAP_HZ) ? \
+    -1 : 0;
+}
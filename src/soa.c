@@ -0,0 +1,146 @@
+/* soa.c: the structure of arrays store of node positions and neighbors.
+ * Copyright  2015 Jack Morton <jhm@jemscout.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "postel.h"
+
+#include <stdlib.h>
+
+/* Loops over positions stream through x, y and r without dragging in the rest
+ * of struct node. Entry i belongs to node[i], and each node knows its entry,
+ * so that a node is swapped out in O(1). The entries are packed: the last
+ * entry moves into the hole of a deleted one. */
+#define SOA_MIN_CAP 256
+
+/* Grow the arrays to hold at least one more entry. Returns -1 on failure */
+static int soa_grow(struct soa *soa)
+{
+  size_t cap = soa->cap ? soa->cap * 2 : SOA_MIN_CAP;
+  double *x, *y, *r;
+  struct node **node;
+
+  if (soa->n < soa->cap)
+    return 0;
+  if (!(x = realloc(soa->x, cap * sizeof(double))))
+    return -1;
+  soa->x = x;
+  if (!(y = realloc(soa->y, cap * sizeof(double))))
+    return -1;
+  soa->y = y;
+  if (!(r = realloc(soa->r, cap * sizeof(double))))
+    return -1;
+  soa->r = r;
+  if (!(node = realloc(soa->node, cap * sizeof(struct node *))))
+    return -1;
+  soa->node = node;
+  soa->cap = cap;
+  return 0;
+}
+
+/* Returns -1 on failure, 0 on success */
+int soa_add(struct soa *soa, struct node *nodep, double r)
+{
+  if (soa_grow(soa))
+    return -1;
+  soa->x[soa->n] = nodep->x;
+  soa->y[soa->n] = nodep->y;
+  soa->r[soa->n] = r;
+  soa->node[soa->n] = nodep;
+  nodep->soa = soa->n++;
+  soa->nbr_stale = TRUE;
+  return 0;
+}
+
+void soa_del(struct soa *soa, struct node *nodep)
+{
+  size_t i = nodep->soa, last = --soa->n;
+
+  if (i != last) {
+    soa->x[i] = soa->x[last];
+    soa->y[i] = soa->y[last];
+    soa->r[i] = soa->r[last];
+    soa->node[i] = soa->node[last];
+    soa->node[i]->soa = i;
+  }
+  soa->nbr_stale = TRUE;
+}
+
+void soa_move(struct soa *soa, struct node *nodep)
+{
+  soa->x[nodep->soa] = nodep->x;
+  soa->y[nodep->soa] = nodep->y;
+}
+
+/* Pack the siblings of every node into one array of entry indexes: the
+ * neighbors of entry i are nbr[nbr_start[i]] up to nbr[nbr_start[i + 1]].
+ * Nothing is done while the packed array is up to date. Returns -1 on
+ * failure, 0 on success */
+int soa_pack(struct soa *soa)
+{
+  size_t i, len = 0;
+  uint32_t *start, *nbr;
+  struct sibling *sibp;
+
+  if (!soa->nbr_stale)
+    return 0;
+  if (!(start = realloc(soa->nbr_start, (soa->n + 1) * sizeof(uint32_t))))
+    return -1;
+  soa->nbr_start = start;
+  for (i = 0; i < soa->n; i++) {
+    start[i] = len;
+    len += soa->node[i]->sib_count;
+  }
+  start[soa->n] = len;
+  if (len > soa->nbr_cap) {
+    if (!(nbr = realloc(soa->nbr, len * sizeof(uint32_t))))
+      return -1;
+    soa->nbr = nbr;
+    soa->nbr_cap = len;
+  }
+  for (i = 0, len = 0; i < soa->n; i++) {
+    LIST_FOREACH(sibp, &soa->node[i]->siblings, sibs)
+      soa->nbr[len++] = sibp->node->soa;
+  }
+  soa->nbr_len = len;
+  soa->nbr_stale = FALSE;
+  return 0;
+}
+
+void init_soa(struct soa *soa)
+{
+  soa->n = soa->cap = 0;
+  soa->x = soa->y = soa->r = NULL;
+  soa->node = NULL;
+  soa->nbr_start = soa->nbr = NULL;
+  soa->nbr_len = soa->nbr_cap = 0;
+  soa->nbr_stale = TRUE;
+}
+
+void shutdown_soa(struct soa *soa)
+{
+  free(soa->x);
+  free(soa->y);
+  free(soa->r);
+  free(soa->node);
+  free(soa->nbr_start);
+  free(soa->nbr);
+  init_soa(soa);
+}
@@ -0,0 +1,798 @@
+/* trace.c: a binary trace of the network, recorded and replayed.
+ * Copyright  2015 Jack Morton <jhm@jemscout.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "postel.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <zlib.h>
+#include <glib.h>
+#include <uv.h>
+
+/* A trace records what happens to the network: nodes added, deleted and
+ * moved, links up and down, and frames sent, received and dropped. Each thread
+ * appends records to a block of its own, with no lock, and seals the block
+ * once full. Every TRACE_FLUSH_MS the simulator thread seals the blocks left
+ * partly full, and sealed blocks are written one at a time, in the order they
+ * were sealed, through the file functions of libuv, so that the simulator
+ * never waits on the disk. A deflated trace has each block deflated on the
+ * libuv thread pool on its way. Should the disk fall TRACE_MAX_QUEUE blocks
+ * behind, the blocks sealed after are dropped, and counted. Worker threads
+ * only record while the simulator thread waits on their job, so the simulator
+ * thread seals their blocks between jobs.
+ *
+ * A trace is a struct trace_header followed by blocks, each a struct
+ * trace_block followed by its records, deflated or not. A record is a type
+ * byte, then the simulated nanoseconds since the record before it in the
+ * block, or since the time of the block, as a zigzag varint, then:
+ *
+ *   TRACE_ADD, TRACE_MOVE     the id of the node as a varint, then x and y
+ *   TRACE_DEL                 the id of the node
+ *   TRACE_LINK_UP, _DOWN      the ids of both ends
+ *   TRACE_TX                  the id of the sender, and the length of the frame
+ *   TRACE_RX, TRACE_DROP      the ids of the sender and of the sibling, and
+ *                             the length of the frame
+ *
+ * with doubles in the byte order of the host. Every node record comes from the
+ * simulator thread, so node records are in order across blocks, not only
+ * within them. A trace opens with the nodes and links there as it started, so
+ * that it replays onto an empty network. */
+#define TRACE_MAGIC "PSTLTRCE"
+#define TRACE_VERSION 1
+#define TRACE_BLOCK (64 * 1024)
+#define TRACE_MAX_RECORD 64   /* Longer than the longest record */
+#define TRACE_MAX_QUEUE 1024  /* Blocks waiting on the disk before drops */
+#define TRACE_FLUSH_MS 250
+#define TRACE_DEFLATE 1       /* Set in the flags of a deflated block */
+
+/* A replay is paced by a timer, every REPLAY_MS of wall clock time, at up to
+ * REPLAY_MAX_SPEED times the pace of the simulated clock it was recorded by */
+#define REPLAY_MS 10
+#define REPLAY_MAX_SPEED 100.0
+
+struct trace_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t flags;   /* Unused, zero */
+};
+
+struct trace_block {
+  uint32_t raw;     /* Bytes of records */
+  uint32_t size;    /* Bytes stored */
+  uint32_t flags;
+  uint32_t thread;  /* The thread that recorded it */
+  uint64_t time;    /* Of the first record */
+};
+
+struct trace_buf {
+  SIMPLEQ_ENTRY(trace_buf) bufs;
+  struct trace_block hdr;
+  uint64_t last;    /* The time of the last record */
+  size_t len, records;
+  uint8_t *out;     /* The records deflated, or NULL */
+  uLongf out_len;
+  uint8_t data[TRACE_BLOCK];
+};
+SIMPLEQ_HEAD(trace_queue, trace_buf);
+
+/* The block a thread records to */
+struct trace_thread {
+  LIST_ENTRY(trace_thread) threads;
+  uint32_t id;
+  struct trace_buf *buf;
+};
+
+struct trace_record {
+  enum trace_type type;
+  int64_t a, b;
+  double x, y;
+  uint64_t len;
+};
+
+static uv_loop_t *trace_loop;
+static uv_timer_t trace_timer;
+static uv_async_t trace_async;
+static uv_fs_t trace_req;
+static uv_work_t trace_work;
+static GPrivate trace_key;
+static GMutex trace_lock;  /* Guards the queue, the threads and the counts */
+static LIST_HEAD(, trace_thread) trace_threads = \
+  LIST_HEAD_INITIALIZER(trace_threads);
+static struct trace_queue trace_queue = SIMPLEQ_HEAD_INITIALIZER(trace_queue);
+static size_t trace_queued;
+static uint32_t trace_thread_ids;
+static int trace_on;                  /* Recording */
+static int trace_fd = -1;             /* Open until every block is written */
+static int trace_deflate;
+static struct trace_buf *trace_busy;  /* On its way to the disk */
+static char *trace_path;
+static uint64_t trace_records, trace_dropped, trace_bytes;
+
+static uv_timer_t replay_timer;
+static FILE *replay_file;
+static char *replay_path;
+static uint8_t *replay_raw, *replay_stored;
+static size_t replay_len, replay_pos;  /* Records in raw, and the next one */
+static uint64_t replay_time;           /* Of the last record read */
+static uint64_t replay_start, replay_wall;
+static double replay_speed;
+static GHashTable *replay_ids;         /* Ids in the trace to ids replayed */
+static uint64_t replay_applied;
+
+/* Returns NULL on failure, the recording state of the calling thread on
+ * success */
+static struct trace_thread *trace_self(void)
+{
+  struct trace_thread *self = g_private_get(&trace_key);
+
+  if (self)
+    return self;
+  if (!(self = calloc(1, sizeof(struct trace_thread))))
+    return NULL;
+  g_mutex_lock(&trace_lock);
+  self->id = trace_thread_ids++;
+  LIST_INSERT_HEAD(&trace_threads, self, threads);
+  g_mutex_unlock(&trace_lock);
+  g_private_set(&trace_key, self);
+  return self;
+}
+
+/* Queue the block of a thread to be written. LOCK trace_lock FIRST! */
+static void trace_seal(struct trace_thread *thread)
+{
+  struct trace_buf *buf = thread->buf;
+
+  if (!buf)
+    return;
+  thread->buf = NULL;
+  if (trace_queued >= TRACE_MAX_QUEUE) {
+    trace_dropped += buf->records;
+    free(buf);
+    return;
+  }
+  buf->hdr.raw = buf->len;
+  buf->hdr.thread = thread->id;
+  trace_records += buf->records;
+  SIMPLEQ_INSERT_TAIL(&trace_queue, buf, bufs);
+  trace_queued++;
+}
+
+/* Only from the simulator thread, between jobs */
+static void trace_seal_all(void)
+{
+  struct trace_thread *thread;
+
+  g_mutex_lock(&trace_lock);
+  LIST_FOREACH(thread, &trace_threads, threads)
+    trace_seal(thread);
+  g_mutex_unlock(&trace_lock);
+}
+
+static uint8_t *trace_varint(uint8_t *p, uint64_t v)
+{
+  while (v >= 0x80) {
+    *p++ = (v & 0x7f) | 0x80;
+    v >>= 7;
+  }
+  *p++ = v;
+  return p;
+}
+
+static uint8_t *trace_double(uint8_t *p, double d)
+{
+  memcpy(p, &d, sizeof(double));
+  return p + sizeof(double);
+}
+
+/* Append a record to the block of the calling thread */
+static void trace_put(const struct trace_record *rec)
+{
+  struct trace_thread *self = trace_self();
+  struct trace_buf *buf = self ? self->buf : NULL;
+  uint64_t now = sched_now();
+  int64_t dt;
+  uint8_t *p;
+
+  if (buf && buf->len + TRACE_MAX_RECORD > TRACE_BLOCK) {
+    g_mutex_lock(&trace_lock);
+    trace_seal(self);
+    g_mutex_unlock(&trace_lock);
+    uv_async_send(&trace_async);
+    buf = NULL;
+  }
+  if (self && !buf && (buf = malloc(sizeof(struct trace_buf)))) {
+    memset(&buf->hdr, 0, sizeof(buf->hdr));
+    buf->hdr.time = buf->last = now;
+    buf->len = buf->records = 0;
+    buf->out = NULL;
+    self->buf = buf;
+  }
+  if (!buf) {
+    g_mutex_lock(&trace_lock);
+    trace_dropped++;
+    g_mutex_unlock(&trace_lock);
+    return;
+  }
+
+  dt = (int64_t)(now - buf->last);
+  buf->last = now;
+  p = buf->data + buf->len;
+  *p++ = rec->type;
+  p = trace_varint(p, ((uint64_t)dt << 1) ^ (uint64_t)(dt >> 63));
+  p = trace_varint(p, rec->a);
+  switch (rec->type) {
+    case TRACE_ADD:
+    case TRACE_MOVE:
+      p = trace_double(p, rec->x);
+      p = trace_double(p, rec->y);
+      break;
+    case TRACE_LINK_UP:
+    case TRACE_LINK_DOWN:
+      p = trace_varint(p, rec->b);
+      break;
+    case TRACE_RX:
+    case TRACE_DROP:
+      p = trace_varint(p, rec->b);
+      /* Fall through */
+    case TRACE_TX:
+      p = trace_varint(p, rec->len);
+      break;
+    case TRACE_DEL:
+      break;
+  }
+  buf->len = p - buf->data;
+  buf->records++;
+}
+
+/* LOCK node_head, AT LEAST FOR READING, BEFORE CALLING THIS FUNCTION! */
+/* Record a node added, deleted or moved, with its position */
+void trace_node(enum trace_type type, const struct node *nodep)
+{
+  struct trace_record rec;
+
+  if (!trace_on)
+    return;
+  rec.type = type;
+  rec.a = nodep->id;
+  rec.x = nodep->x;
+  rec.y = nodep->y;
+  trace_put(&rec);
+}
+
+/* LOCK node_head, AT LEAST FOR READING, BEFORE CALLING THIS FUNCTION! */
+/* Record a link up or down between two nodes */
+void trace_link(enum trace_type type, const struct node *a, \
+  const struct node *b)
+{
+  struct trace_record rec;
+
+  if (!trace_on)
+    return;
+  rec.type = type;
+  rec.a = a->id;
+  rec.b = b->id;
+  trace_put(&rec);
+}
+
+/* Record a frame of len bytes sent by from, or received or dropped by to */
+void trace_frame(enum trace_type type, int64_t from, int64_t to, size_t len)
+{
+  struct trace_record rec;
+
+  if (!trace_on)
+    return;
+  rec.type = type;
+  rec.a = from;
+  rec.b = to;
+  rec.len = len;
+  trace_put(&rec);
+}
+
+static void trace_pump(void);
+
+/* Give up on a trace the disk failed, dropping every block that waits */
+static void trace_fail(const char *err)
+{
+  struct trace_buf *buf;
+
+  fprintf(stderr, "%s: %s\n", trace_path, err);
+  trace_on = FALSE;
+  uv_timer_stop(&trace_timer);
+  trace_seal_all();
+  g_mutex_lock(&trace_lock);
+  while ((buf = SIMPLEQ_FIRST(&trace_queue))) {
+    SIMPLEQ_REMOVE_HEAD(&trace_queue, buf, bufs);
+    trace_records -= buf->records;
+    trace_dropped += buf->records;
+    free(buf);
+  }
+  trace_queued = 0;
+  g_mutex_unlock(&trace_lock);
+}
+
+/* A block is on the disk, or not */
+static void trace_write_cb(uv_fs_t *req)
+{
+  struct trace_buf *buf = trace_busy;
+  ssize_t want = sizeof(struct trace_block) + buf->hdr.size;
+
+  if (req->result == want) {
+    trace_bytes += want;
+  }
+  else {
+    g_mutex_lock(&trace_lock);
+    trace_records -= buf->records;
+    trace_dropped += buf->records;
+    g_mutex_unlock(&trace_lock);
+    trace_fail((req->result < 0) ? uv_strerror(req->result) : \
+      "short write");
+  }
+  uv_fs_req_cleanup(req);
+  free(buf->out);
+  free(buf);
+  trace_busy = NULL;
+  trace_pump();
+}
+
+static void trace_write(struct trace_buf *buf)
+{
+  uv_buf_t iov[2];
+  int err;
+
+  if (buf->out) {
+    buf->hdr.flags = TRACE_DEFLATE;
+    buf->hdr.size = buf->out_len;
+    iov[1] = uv_buf_init((char *)buf->out, buf->out_len);
+  }
+  else {
+    buf->hdr.size = buf->len;
+    iov[1] = uv_buf_init((char *)buf->data, buf->len);
+  }
+  iov[0] = uv_buf_init((char *)&buf->hdr, sizeof(buf->hdr));
+  if ((err = uv_fs_write(trace_loop, &trace_req, trace_fd, iov, 2, -1, \
+    &trace_write_cb))) {
+    trace_req.result = err;
+    trace_write_cb(&trace_req);
+  }
+}
+
+/* Runs on the libuv thread pool. A block that doesn't shrink is stored. */
+static void trace_deflate_cb(uv_work_t *req)
+{
+  struct trace_buf *buf = req->data;
+  uLongf len = compressBound(buf->len);
+
+  if (!(buf->out = malloc(len)))
+    return;
+  if (compress2(buf->out, &len, buf->data, buf->len, Z_BEST_SPEED) != Z_OK \
+    || len >= buf->len) {
+    free(buf->out);
+    buf->out = NULL;
+    return;
+  }
+  buf->out_len = len;
+}
+
+static void trace_deflated_cb(uv_work_t *req, int status)
+{
+  trace_write(req->data);
+}
+
+/* Write the next sealed block, unless one is already on its way. Once
+ * recording stopped and every block is written, the trace is closed. */
+static void trace_pump(void)
+{
+  uv_fs_t req;
+  struct trace_buf *buf;
+
+  if (trace_busy || trace_fd < 0)
+    return;
+  g_mutex_lock(&trace_lock);
+  if ((buf = SIMPLEQ_FIRST(&trace_queue))) {
+    SIMPLEQ_REMOVE_HEAD(&trace_queue, buf, bufs);
+    trace_queued--;
+  }
+  g_mutex_unlock(&trace_lock);
+  if (!buf) {
+    if (!trace_on) {
+      uv_fs_close(trace_loop, &req, trace_fd, NULL);
+      uv_fs_req_cleanup(&req);
+      trace_fd = -1;
+    }
+    return;
+  }
+
+  trace_busy = buf;
+  if (!trace_deflate) {
+    trace_write(buf);
+    return;
+  }
+  trace_work.data = buf;
+  if (uv_queue_work(trace_loop, &trace_work, &trace_deflate_cb, \
+    &trace_deflated_cb))
+    trace_write(buf);
+}
+
+static void trace_timer_cb(uv_timer_t *handle)
+{
+  trace_seal_all();
+  trace_pump();
+}
+
+static void trace_async_cb(uv_async_t *handle)
+{
+  trace_pump();
+}
+
+/* LOCK node_head, AT LEAST FOR READING, BEFORE CALLING THIS FUNCTION! */
+/* Record to a file, deflated if deflate is TRUE, starting with the nodes and
+ * links there now. Returns -1 on failure (or while the last trace is still
+ * being written), 0 on success */
+int start_trace(const char *path, int deflate)
+{
+  int fd, err;
+  uv_fs_t req;
+  uv_buf_t iov;
+  struct trace_header hdr;
+  struct node *nodep;
+  struct sibling *sibp;
+
+  if (trace_fd >= 0)
+    return -1;
+  fd = uv_fs_open(trace_loop, &req, path, O_WRONLY | O_CREAT | O_TRUNC | \
+    O_CLOEXEC, 0644, NULL);
+  uv_fs_req_cleanup(&req);
+  if (fd < 0) {
+    fprintf(stderr, "%s: %s\n", path, uv_strerror(fd));
+    return -1;
+  }
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic));
+  hdr.version = TRACE_VERSION;
+  iov = uv_buf_init((char *)&hdr, sizeof(hdr));
+  err = uv_fs_write(trace_loop, &req, fd, &iov, 1, -1, NULL);
+  uv_fs_req_cleanup(&req);
+  if (err != sizeof(hdr)) {
+    fprintf(stderr, "%s: %s\n", path, (err < 0) ? uv_strerror(err) : \
+      "short write");
+    uv_fs_close(trace_loop, &req, fd, NULL);
+    uv_fs_req_cleanup(&req);
+    return -1;
+  }
+
+  g_free(trace_path);
+  trace_path = g_strdup(path);
+  trace_fd = fd;
+  trace_deflate = deflate;
+  g_mutex_lock(&trace_lock);
+  trace_records = trace_dropped = 0;
+  g_mutex_unlock(&trace_lock);
+  trace_bytes = sizeof(hdr);
+  trace_on = TRUE;
+  LIST_FOREACH(nodep, &node_head, nodes)
+    trace_node(TRACE_ADD, nodep);
+  LIST_FOREACH(nodep, &node_head, nodes) {
+    LIST_FOREACH(sibp, &nodep->siblings, sibs) {
+      if (sibp->node->soa > nodep->soa)
+        trace_link(TRACE_LINK_UP, nodep, sibp->node);
+    }
+  }
+  uv_timer_start(&trace_timer, &trace_timer_cb, TRACE_FLUSH_MS, \
+    TRACE_FLUSH_MS);
+  return 0;
+}
+
+/* Stop recording. The blocks recorded are still written, after which the
+ * trace is closed. Returns -1 on failure (to be recording), 0 on success */
+int stop_trace(void)
+{
+  if (!trace_on)
+    return -1;
+  trace_on = FALSE;
+  uv_timer_stop(&trace_timer);
+  trace_seal_all();
+  trace_pump();
+  return 0;
+}
+
+/* Returns NULL if nothing was ever recorded, the path of the last trace
+ * otherwise, with the records sealed and dropped, the bytes written and
+ * whether it is still recording */
+const char *get_trace(uint64_t *records, uint64_t *dropped, uint64_t *bytes, \
+  int *recording)
+{
+  g_mutex_lock(&trace_lock);
+  *records = trace_records;
+  *dropped = trace_dropped;
+  g_mutex_unlock(&trace_lock);
+  *bytes = trace_bytes;
+  *recording = trace_on;
+  return trace_path;
+}
+
+/* Read the next block of the replay. Returns -1 on failure, 0 at the end of
+ * the trace, 1 on success */
+static int replay_block(void)
+{
+  struct trace_block hdr;
+  uLongf len = TRACE_BLOCK;
+
+  if (fread(&hdr, sizeof(hdr), 1, replay_file) != 1)
+    return feof(replay_file) ? 0 : -1;
+  if (hdr.raw > TRACE_BLOCK || hdr.size > compressBound(TRACE_BLOCK))
+    return -1;
+  if (!(hdr.flags & TRACE_DEFLATE)) {
+    if (hdr.size != hdr.raw || \
+      (hdr.size && fread(replay_raw, hdr.size, 1, replay_file) != 1))
+      return -1;
+  }
+  else if (fread(replay_stored, hdr.size, 1, replay_file) != 1 || \
+    uncompress(replay_raw, &len, replay_stored, hdr.size) != Z_OK || \
+    len != hdr.raw)
+    return -1;
+  replay_len = hdr.raw;
+  replay_pos = 0;
+  replay_time = hdr.time;
+  return 1;
+}
+
+/* Returns -1 on failure, 0 on success */
+static int replay_varint(size_t *pos, uint64_t *v)
+{
+  int shift;
+  uint8_t byte;
+
+  *v = 0;
+  for (shift = 0; shift < 64 && *pos < replay_len; shift += 7) {
+    byte = replay_raw[(*pos)++];
+    *v |= (uint64_t)(byte & 0x7f) << shift;
+    if (!(byte & 0x80))
+      return 0;
+  }
+  return -1;
+}
+
+/* Returns -1 on failure, 0 on success */
+static int replay_double(size_t *pos, double *d)
+{
+  if (replay_len - *pos < sizeof(double))
+    return -1;
+  memcpy(d, replay_raw + *pos, sizeof(double));
+  *pos += sizeof(double);
+  return 0;
+}
+
+/* Decode the next record of the block, without taking it, and return its
+ * time at *time and the record after it at *next. Returns -1 on failure, 0 on
+ * success */
+static int replay_record(struct trace_record *rec, uint64_t *time, \
+  size_t *next)
+{
+  size_t pos = replay_pos;
+  uint64_t dt, v;
+
+  rec->type = replay_raw[pos++];
+  if (replay_varint(&pos, &dt) || replay_varint(&pos, &v))
+    return -1;
+  rec->a = v;
+  *time = replay_time + (uint64_t)((int64_t)(dt >> 1) ^ -(int64_t)(dt & 1));
+  switch (rec->type) {
+    case TRACE_ADD:
+    case TRACE_MOVE:
+      if (replay_double(&pos, &rec->x) || replay_double(&pos, &rec->y))
+        return -1;
+      break;
+    case TRACE_LINK_UP:
+    case TRACE_LINK_DOWN:
+      if (replay_varint(&pos, &v))
+        return -1;
+      rec->b = v;
+      break;
+    case TRACE_RX:
+    case TRACE_DROP:
+      if (replay_varint(&pos, &v))
+        return -1;
+      rec->b = v;
+      /* Fall through */
+    case TRACE_TX:
+      if (replay_varint(&pos, &rec->len))
+        return -1;
+      break;
+    case TRACE_DEL:
+      break;
+    default:
+      return -1;
+  }
+  *next = pos;
+  return 0;
+}
+
+/* LOCK node_head BEFORE CALLING THIS FUNCTION! */
+/* Links follow from the nodes, and frames need node processes, so only node
+ * records change the network */
+static void replay_apply(const struct trace_record *rec)
+{
+  gint64 *from, *to;
+  struct node *nodep;
+  int64_t id;
+
+  switch (rec->type) {
+    case TRACE_ADD:
+      if ((id = add_node(rec->x, rec->y)) < 0)
+        return;
+      from = g_new(gint64, 1);
+      to = g_new(gint64, 1);
+      *from = rec->a;
+      *to = id;
+      g_hash_table_replace(replay_ids, from, to);
+      break;
+    case TRACE_DEL:
+      if ((to = g_hash_table_lookup(replay_ids, &rec->a))) {
+        del_node(*to);
+        g_hash_table_remove(replay_ids, &rec->a);
+      }
+      break;
+    case TRACE_MOVE:
+      if ((to = g_hash_table_lookup(replay_ids, &rec->a)) && \
+        (nodep = find_node(*to)))
+        move_node(nodep, rec->x, rec->y);
+      break;
+    default:
+      return;
+  }
+  replay_applied++;
+}
+
+/* Apply every node record due by now */
+static void replay_tick_cb(uv_timer_t *handle)
+{
+  struct trace_record rec;
+  uint64_t time, due = replay_start + \
+    (uint64_t)((uv_hrtime() - replay_wall) * replay_speed);
+  size_t next;
+  int err = 1;
+
+  NODE_LOCK();
+  for (;;) {
+    while (replay_pos == replay_len && (err = replay_block()) > 0)
+      ;
+    if (err <= 0)
+      break;
+    if ((err = replay_record(&rec, &time, &next)) < 0)
+      break;
+    err = 1;
+    /* Only node records wait for their time, see above */
+    if (rec.type <= TRACE_MOVE && (int64_t)(time - due) > 0)
+      break;
+    replay_pos = next;
+    replay_time = time;
+    replay_apply(&rec);
+  }
+  NODE_UNLOCK();
+  if (err < 0)
+    fprintf(stderr, "%s: not a version %d trace.\n", replay_path, \
+      TRACE_VERSION);
+  else if (!err)
+    fprintf(stderr, "Replayed %llu record(s) of %s.\n", \
+      (unsigned long long)replay_applied, replay_path);
+  if (err <= 0)
+    stop_replay();
+}
+
+/* Stop replaying. Returns -1 on failure (to be replaying), 0 on success */
+int stop_replay(void)
+{
+  if (!replay_file)
+    return -1;
+  uv_timer_stop(&replay_timer);
+  fclose(replay_file);
+  replay_file = NULL;
+  g_hash_table_destroy(replay_ids);
+  replay_ids = NULL;
+  return 0;
+}
+
+/* LOCK node_head BEFORE CALLING THIS FUNCTION! */
+/* Replace every node with the nodes of a trace, and replay the trace at speed
+ * times the pace it was recorded at, up to REPLAY_MAX_SPEED. A speed of zero
+ * or less replays at the pace recorded. A replay in progress is stopped.
+ * Returns -1 on failure, 0 on success */
+int start_replay(const char *path, double speed)
+{
+  struct trace_header hdr;
+  FILE *f;
+
+  if (!replay_raw && !(replay_raw = malloc(TRACE_BLOCK)))
+    return -1;
+  if (!replay_stored && \
+    !(replay_stored = malloc(compressBound(TRACE_BLOCK))))
+    return -1;
+  if (!(f = fopen(path, "rb"))) {
+    fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    return -1;
+  }
+  if (fread(&hdr, sizeof(hdr), 1, f) != 1 || \
+    memcmp(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic)) || \
+    hdr.version != TRACE_VERSION) {
+    fprintf(stderr, "%s: not a version %d trace.\n", path, TRACE_VERSION);
+    fclose(f);
+    return -1;
+  }
+
+  stop_replay();
+  replay_file = f;
+  g_free(replay_path);
+  replay_path = g_strdup(path);
+  replay_len = replay_pos = 0;
+  replay_applied = 0;
+  replay_ids = g_hash_table_new_full(&g_int64_hash, &g_int64_equal, &g_free, \
+    &g_free);
+  if (replay_block() < 0) {
+    fprintf(stderr, "%s: not a version %d trace.\n", path, TRACE_VERSION);
+    stop_replay();
+    return -1;
+  }
+  replay_start = replay_time;
+  replay_wall = uv_hrtime();
+  replay_speed = (speed > 0.0) ? MIN(speed, REPLAY_MAX_SPEED) : 1.0;
+  while (!LIST_EMPTY(&node_head))
+    del_node(LIST_FIRST(&node_head)->id);
+  uv_timer_start(&replay_timer, &replay_tick_cb, 0, REPLAY_MS);
+  return 0;
+}
+
+/* Returns NULL if not replaying, the path of the replay otherwise, with the
+ * records applied, the speed, and the seconds of the trace replayed */
+const char *get_replay(uint64_t *applied, double *speed, double *seconds)
+{
+  if (!replay_file)
+    return NULL;
+  *applied = replay_applied;
+  *speed = replay_speed;
+  *seconds = (replay_time - replay_start) / 1e9;
+  return replay_path;
+}
+
+/* Blocks still waiting are written as the loop runs on */
+void shutdown_trace(void)
+{
+  stop_replay();
+  stop_trace();
+  uv_close((uv_handle_t *)&trace_async, NULL);
+}
+
+/* Returns -1 on failure, 0 on success */
+int init_trace(uv_loop_t *loop)
+{
+  trace_loop = loop;
+  uv_timer_init(loop, &trace_timer);
+  uv_timer_init(loop, &replay_timer);
+  /* Sealing and waking the writer alone shouldn't keep the loop running */
+  uv_unref((uv_handle_t *)&trace_timer);
+  if (uv_async_init(loop, &trace_async, &trace_async_cb))
+    return -1;
+  uv_unref((uv_handle_t *)&trace_async);
+  return 0;
+}
@@ -0,0 +1,474 @@
+/* tree.c: the k-d tree spatial index.
+ * Copyright  2015 Jack Morton <jhm@jemscout.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "postel.h"
+
+#include <stdlib.h>
+#include <math.h>
+
+/* The k-d tree is kept balanced the scapegoat way: a subtree is rebuilt around
+ * its median whenever an insert lands deeper than log(n) / log(1 / alpha), and
+ * the whole tree is rebuilt once deletions shrink it below alpha times its size
+ * at the last full rebuild. Both are amortized O(log n) per operation. */
+#define TREE_ALPHA 0.7
+#define TREE_SIZE(nodep) ((nodep) ? (nodep)->tree.size : 0)
+#define TREE_KEY(nodep, axis) ((axis) ? (nodep)->x : (nodep)->y)
+
+struct kd_tree {
+  struct node *head;
+  size_t max_size;  /* The tree size at the last full rebuild */
+};
+
+/* Order two nodes along an axis. Ties are broken on the other axis and then on
+ * the node address, so that no two nodes ever compare equal and a median split
+ * stays balanced however many nodes share a coordinate. */
+static int tree_cmp(const struct node *a, const struct node *b, int axis)
+{
+  if (TREE_KEY(a, axis) != TREE_KEY(b, axis))
+    return (TREE_KEY(a, axis) < TREE_KEY(b, axis)) ? -1 : 1;
+  if (TREE_KEY(a, !axis) != TREE_KEY(b, !axis))
+    return (TREE_KEY(a, !axis) < TREE_KEY(b, !axis)) ? -1 : 1;
+  if (a != b)
+    return (a < b) ? -1 : 1;
+  return 0;
+}
+
+/* Return the pointer that links nodep into the tree */
+static struct node **tree_link(struct node **head, struct node *nodep)
+{
+  struct node *parent = nodep->tree.parent;
+
+  if (!parent)
+    return head;
+  return (parent->tree.left == nodep) ? &parent->tree.left : \
+    &parent->tree.right;
+}
+
+/* Recount the subtree sizes from nodep up to the root */
+static void tree_resize(struct node *nodep)
+{
+  for (; nodep; nodep = nodep->tree.parent)
+    nodep->tree.size = 1 + TREE_SIZE(nodep->tree.left) + \
+      TREE_SIZE(nodep->tree.right);
+}
+
+/* Builds select medians over a copy of the keys of each node, so that the
+ * comparisons stream through one array rather than chase node pointers */
+struct tree_key {
+  double key[2];  /* Indexed by axis, as TREE_KEY() */
+  struct node *node;
+};
+
+/* Order two keys as tree_cmp() orders their nodes */
+static int tree_key_cmp(const struct tree_key *a, const struct tree_key *b, \
+  int axis)
+{
+  if (a->key[axis] != b->key[axis])
+    return (a->key[axis] < b->key[axis]) ? -1 : 1;
+  if (a->key[!axis] != b->key[!axis])
+    return (a->key[!axis] < b->key[!axis]) ? -1 : 1;
+  if (a->node != b->node)
+    return (a->node < b->node) ? -1 : 1;
+  return 0;
+}
+
+static void tree_key_set(struct tree_key *v, struct node *nodep)
+{
+  v->key[0] = TREE_KEY(nodep, 0);
+  v->key[1] = TREE_KEY(nodep, 1);
+  v->node = nodep;
+}
+
+/* Partially order v so that v[k] holds the k-th smallest node along axis, with
+ * smaller nodes before it and larger nodes after it (Hoare's selection) */
+static void tree_select(struct tree_key *v, size_t n, size_t k, int axis)
+{
+  long lo = 0, hi = (long)n - 1, i, j;
+  struct tree_key pivot, tmp;
+
+  while (lo < hi) {
+    pivot = v[lo + (hi - lo) / 2];
+    i = lo;
+    j = hi;
+    while (i <= j) {
+      while (tree_key_cmp(&v[i], &pivot, axis) < 0)
+        i++;
+      while (tree_key_cmp(&v[j], &pivot, axis) > 0)
+        j--;
+      if (i <= j) {
+        tmp = v[i];
+        v[i++] = v[j];
+        v[j--] = tmp;
+      }
+    }
+    if ((long)k <= j)
+      hi = j;
+    else if ((long)k >= i)
+      lo = i;
+    else
+      break;
+  }
+}
+
+/* Build a perfectly balanced subtree out of n nodes, splitting each level on
+ * the median. Returns the root of the new subtree. */
+static struct node *tree_build(struct tree_key *v, size_t n, \
+  struct node *parent, int depth)
+{
+  size_t m = n / 2;
+  struct node *nodep;
+
+  if (!n)
+    return NULL;
+
+  tree_select(v, n, m, depth & 1);
+  nodep = v[m].node;
+  nodep->tree.depth = depth;
+  nodep->tree.axis = depth & 1;
+  nodep->tree.parent = parent;
+  nodep->tree.size = n;
+  nodep->tree.left = tree_build(v, m, nodep, depth + 1);
+  nodep->tree.right = tree_build(v + m + 1, n - m - 1, nodep, depth + 1);
+  return nodep;
+}
+
+/* Store every node of a subtree in v, returns the number stored */
+static size_t tree_flatten(struct node *nodep, struct tree_key *v)
+{
+  size_t n;
+
+  if (!nodep)
+    return 0;
+  n = tree_flatten(nodep->tree.left, v);
+  tree_key_set(&v[n++], nodep);
+  return n + tree_flatten(nodep->tree.right, v + n);
+}
+
+/* Rebuild the subtree rooted at nodep in place. On allocation failure the
+ * subtree is left as it was, which is still a valid (if lopsided) tree. */
+static void tree_rebuild(struct node **head, struct node *nodep)
+{
+  struct node **link;
+  struct tree_key *v;
+  size_t n = TREE_SIZE(nodep);
+
+  if (n < 3)
+    return;
+  v = malloc(n * sizeof(*v));
+  if (!v)
+    return;
+  link = tree_link(head, nodep);
+  tree_flatten(nodep, v);
+  *link = tree_build(v, n, nodep->tree.parent, nodep->tree.depth);
+  free(v);
+}
+
+/* Insert a node into a 2-dimensional k-d tree */
+static int tree_insert(struct node_index *idx, struct node *nodei)
+{
+  struct kd_tree *tree = idx->data;
+  struct node *parent = NULL, **nodep = &tree->head;
+  int depth = 0;
+
+  /* Traverse the tree... */
+  while (*nodep) {
+    parent = *nodep;
+    parent->tree.size++;
+    nodep = (tree_cmp(nodei, parent, parent->tree.axis) < 0) ? \
+      &parent->tree.left : &parent->tree.right;
+    depth++;
+  }
+
+  /* And insert the node */
+  nodei->tree.depth = depth;
+  nodei->tree.axis = depth & 1;
+  nodei->tree.size = 1;
+  nodei->tree.parent = parent;
+  nodei->tree.left = nodei->tree.right = NULL;
+  *nodep = nodei;
+
+  if (TREE_SIZE(tree->head) > tree->max_size)
+    tree->max_size = TREE_SIZE(tree->head);
+
+  /* Too deep, so find the scapegoat: the lowest ancestor that is out of
+   * alpha-weight-balance, and rebuild the subtree below it. */
+  if (depth > log((double)TREE_SIZE(tree->head)) / log(1.0 / TREE_ALPHA) + \
+    1.0) {
+    for (; parent; parent = parent->tree.parent) {
+      if (TREE_SIZE(parent->tree.left) > TREE_ALPHA * parent->tree.size || \
+        TREE_SIZE(parent->tree.right) > TREE_ALPHA * parent->tree.size) {
+        tree_rebuild(&tree->head, parent);
+        break;
+      }
+    }
+  }
+  return 0;
+}
+
+/* Find the smallest node along axis in a subtree */
+static struct node *tree_min(struct node *nodep, int axis)
+{
+  struct node *min, *ret;
+
+  if (!nodep)
+    return NULL;
+
+  /* Splitting on the same axis, the minimum is not on the right */
+  min = tree_min(nodep->tree.left, axis);
+  if (nodep->tree.axis != axis) {
+    ret = tree_min(nodep->tree.right, axis);
+    if (ret && (!min || tree_cmp(ret, min, axis) < 0))
+      min = ret;
+  }
+  return (min && tree_cmp(min, nodep, axis) < 0) ? min : nodep;
+}
+
+/* Unlink a node from the tree, promoting a replacement from below */
+static void tree_unlink(struct node **head, struct node *nodep)
+{
+  struct node **link = tree_link(head, nodep), *repl;
+
+  if (!nodep->tree.left && !nodep->tree.right) {
+    *link = NULL;
+    tree_resize(nodep->tree.parent);
+    return;
+  }
+
+  /* The replacement is the minimum of the right subtree along this node's
+   * axis. With only a left subtree, it is moved to the right first. */
+  if (!nodep->tree.right) {
+    nodep->tree.right = nodep->tree.left;
+    nodep->tree.left = NULL;
+  }
+  repl = tree_min(nodep->tree.right, nodep->tree.axis);
+  tree_unlink(head, repl);
+
+  repl->tree.depth = nodep->tree.depth;
+  repl->tree.axis = nodep->tree.axis;
+  repl->tree.parent = nodep->tree.parent;
+  repl->tree.left = nodep->tree.left;
+  repl->tree.right = nodep->tree.right;
+  if (repl->tree.left)
+    repl->tree.left->tree.parent = repl;
+  if (repl->tree.right)
+    repl->tree.right->tree.parent = repl;
+  *link = repl;
+  tree_resize(repl);
+}
+
+/* Remove a node from the k-d tree */
+static void tree_remove(struct node_index *idx, struct node *nodep)
+{
+  struct kd_tree *tree = idx->data;
+
+  tree_unlink(&tree->head, nodep);
+  nodep->tree.parent = nodep->tree.left = nodep->tree.right = NULL;
+  nodep->tree.size = 0;
+
+  /* Deletions have thinned the tree out, so rebuild all of it */
+  if (TREE_SIZE(tree->head) < TREE_ALPHA * tree->max_size) {
+    tree_rebuild(&tree->head, tree->head);
+    tree->max_size = TREE_SIZE(tree->head);
+  }
+}
+
+/* A node that moved keeps its place as long as it is a leaf and still on the
+ * same side of the split of every ancestor, otherwise it is reinserted */
+static int tree_move(struct node_index *idx, struct node *nodep, \
+  double old_x, double old_y)
+{
+  struct node *child = nodep, *parent;
+
+  if (!nodep->tree.left && !nodep->tree.right) {
+    for (parent = nodep->tree.parent; parent; parent = parent->tree.parent) {
+      if ((tree_cmp(nodep, parent, parent->tree.axis) < 0) != \
+        (parent->tree.left == child))
+        break;
+      child = parent;
+    }
+    if (!parent)
+      return 0;
+  }
+  tree_remove(idx, nodep);
+  return tree_insert(idx, nodep);
+}
+
+/* A range query gathers the coordinates of the nodes it visits into a block,
+ * and tests a whole block at once with range_mask(), as the grid tests a
+ * cell */
+struct tree_batch {
+  double x, y, r2;
+  void (*fn)(struct node *, void *);
+  void *arg;
+  size_t n, found;
+  double xs[SIMD_BLOCK], ys[SIMD_BLOCK];
+  struct node *node[SIMD_BLOCK];
+};
+
+/* Call fn for every node of the block within range, and empty it */
+static void tree_flush(struct tree_batch *b)
+{
+  uint64_t mask[SIMD_BLOCK / 64], bits;
+  size_t word;
+
+  if (b->n && range_mask(b->x, b->y, b->r2, b->xs, b->ys, b->n, mask)) {
+    for (word = 0; word < (b->n + 63) / 64; word++) {
+      for (bits = mask[word]; bits; bits &= bits - 1) {
+        b->fn(b->node[word * 64 + __builtin_ctzll(bits)], b->arg);
+        b->found++;
+      }
+    }
+  }
+  b->n = 0;
+}
+
+/* Gather every node of the tree that may lie within distance r of x, y.
+ * Subtrees are skipped whenever the splitting line lies further than r
+ * away. */
+static void tree_range_r(struct node *nodep, double r, struct tree_batch *b)
+{
+  double split;
+
+  while (nodep) {
+    b->xs[b->n] = nodep->x;
+    b->ys[b->n] = nodep->y;
+    b->node[b->n] = nodep;
+    if (++b->n == SIMD_BLOCK)
+      tree_flush(b);
+
+    /* Descend into the near side iteratively, the far side recursively */
+    split = nodep->tree.axis ? b->x - nodep->x : b->y - nodep->y;
+    if (split - r <= 0.0 && split + r >= 0.0) {
+      tree_range_r(nodep->tree.left, r, b);
+      nodep = nodep->tree.right;
+    }
+    else
+      nodep = (split < 0.0) ? nodep->tree.left : nodep->tree.right;
+  }
+}
+
+/* Call fn for every node of the tree within distance r of x, y. Returns the
+ * number of nodes found. */
+static size_t tree_range(struct node_index *idx, double x, double y, \
+  double r, void (*fn)(struct node *, void *), void *arg)
+{
+  struct kd_tree *tree = idx->data;
+  struct tree_batch b;
+
+  b.x = x;
+  b.y = y;
+  b.r2 = r * r;
+  b.fn = fn;
+  b.arg = arg;
+  b.n = b.found = 0;
+  tree_range_r(tree->head, r, &b);
+  tree_flush(&b);
+  return b.found;
+}
+
+/* Perform a nearest neighbor search for the closest node in the tree: descend
+ * to the leaf region holding x, y, then on the way back up only visit the far
+ * side of a split that lies closer than the best node found so far. */
+static void find_nearest(struct node *nodep, double x, double y, \
+  struct node **best, double *best_dist)
+{
+  double dist_x, dist_y, dist, split;
+  struct node *near, *far;
+
+  if (!nodep)
+    return;
+
+  dist_x = x - nodep->x;
+  dist_y = y - nodep->y;
+  dist = dist_x * dist_x + dist_y * dist_y;
+  if (dist < *best_dist) {
+    *best = nodep;
+    *best_dist = dist;
+  }
+
+  split = nodep->tree.axis ? dist_x : dist_y;
+  near = (split < 0.0) ? nodep->tree.left : nodep->tree.right;
+  far = (split < 0.0) ? nodep->tree.right : nodep->tree.left;
+  find_nearest(near, x, y, best, best_dist);
+  if (split * split <= *best_dist)
+    find_nearest(far, x, y, best, best_dist);
+}
+
+static struct node *tree_nearest(struct node_index *idx, double x, double y)
+{
+  struct kd_tree *tree = idx->data;
+  struct node *best = NULL;
+  double best_dist = HUGE_VAL;
+
+  find_nearest(tree->head, x, y, &best, &best_dist);
+  return best;
+}
+
+/* Build one perfectly balanced tree out of the nodes already in the tree and
+ * n more, in O(n log n). On allocation failure the tree is left as it was.
+ * Returns -1 on failure, 0 on success */
+static int tree_load(struct node_index *idx, struct node **v, size_t n)
+{
+  struct kd_tree *tree = idx->data;
+  size_t i, size = TREE_SIZE(tree->head);
+  struct tree_key *all = malloc((size + n) * sizeof(*all));
+
+  if (!all)
+    return -1;
+  tree_flatten(tree->head, all);
+  for (i = 0; i < n; i++)
+    tree_key_set(&all[size + i], v[i]);
+  tree->head = tree_build(all, size + n, NULL, 0);
+  tree->max_size = size + n;
+  free(all);
+  return 0;
+}
+
+static int tree_init(struct node_index *idx, double width, double height, \
+  double range)
+{
+  struct kd_tree *tree = calloc(1, sizeof(struct kd_tree));
+
+  if (!tree)
+    return -1;
+  idx->data = tree;
+  return 0;
+}
+
+/* The nodes belong to the caller, only the tree itself is released */
+static void tree_destroy(struct node_index *idx)
+{
+  free(idx->data);
+  idx->data = NULL;
+}
+
+const struct index_ops tree_index_ops = {
+  "tree",
+  &tree_init,
+  &tree_destroy,
+  &tree_insert,
+  &tree_remove,
+  &tree_move,
+  &tree_range,
+  &tree_nearest,
+  &tree_load
+};
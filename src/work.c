@@ -0,0 +1,209 @@
+/* work.c: a work stealing pool of worker threads.
+ * Copyright  2015 Jack Morton <jhm@jemscout.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "postel.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <glib.h>
+
+/* A job is a number of tasks, run by one thread per processor, the thread of
+ * the simulator among them. Each thread starts with an even share of the
+ * tasks, as a range it takes from the front of. A thread whose range runs out
+ * steals the back half of the range of another, so that threads finishing
+ * early take on the work of those that fall behind, until every range is
+ * empty. A range is a single 64 bit word, low and high task, so that taking
+ * and stealing are each one compare and swap. Jobs are only run from the
+ * simulator thread, one at a time. */
+#define WORK_MAX_THREADS 64
+
+struct work_range {
+  uint64_t tasks;  /* The low task in the low half, the high in the high */
+  char pad[56];    /* Each range on its own cache line */
+};
+
+#define WORK_RANGE(lo, hi) ((uint64_t)(hi) << 32 | (uint32_t)(lo))
+#define WORK_LO(range) ((uint32_t)(range))
+#define WORK_HI(range) ((uint32_t)((range) >> 32))
+
+static struct work_range work_ranges[WORK_MAX_THREADS] \
+  __attribute__((aligned(64)));
+static GThread *work_threads[WORK_MAX_THREADS];
+static unsigned int work_n = 1;  /* Threads, the simulator thread included */
+
+static GMutex work_lock;
+static GCond work_start, work_done;
+static unsigned long work_gen;   /* Counts the jobs started */
+static unsigned int work_busy;   /* Threads still working on the job */
+static int work_quit;
+static void (*work_fn)(size_t task, void *arg);
+static void *work_arg;
+
+/* Take the next task of a thread. Returns FALSE if its range is empty */
+static int work_take(unsigned int self, size_t *task)
+{
+  uint64_t range = __atomic_load_n(&work_ranges[self].tasks, __ATOMIC_ACQUIRE);
+
+  while (WORK_LO(range) < WORK_HI(range)) {
+    if (__atomic_compare_exchange_n(&work_ranges[self].tasks, &range, \
+      WORK_RANGE(WORK_LO(range) + 1, WORK_HI(range)), FALSE, \
+      __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      *task = WORK_LO(range);
+      return TRUE;
+    }
+  }
+  return FALSE;
+}
+
+/* Steal the back half of the range of another thread, keep the rest of it
+ * and take its first task. Returns FALSE if every range is empty */
+static int work_steal(unsigned int self, size_t *task)
+{
+  unsigned int i, victim;
+  uint64_t range;
+  uint32_t mid;
+
+  for (i = 1; i < work_n; i++) {
+    victim = (self + i) % work_n;
+    range = __atomic_load_n(&work_ranges[victim].tasks, __ATOMIC_ACQUIRE);
+    while (WORK_LO(range) < WORK_HI(range)) {
+      mid = WORK_LO(range) + (WORK_HI(range) - WORK_LO(range)) / 2;
+      if (__atomic_compare_exchange_n(&work_ranges[victim].tasks, &range, \
+        WORK_RANGE(WORK_LO(range), mid), FALSE, __ATOMIC_ACQ_REL, \
+        __ATOMIC_ACQUIRE)) {
+        /* Our own range is empty, so no thief can be racing this store */
+        __atomic_store_n(&work_ranges[self].tasks, \
+          WORK_RANGE(mid + 1, WORK_HI(range)), __ATOMIC_RELEASE);
+        *task = mid;
+        return TRUE;
+      }
+    }
+  }
+  return FALSE;
+}
+
+static void work_run(unsigned int self)
+{
+  size_t task;
+
+  while (work_take(self, &task) || work_steal(self, &task))
+    work_fn(task, work_arg);
+}
+
+static gpointer work_thread(gpointer data)
+{
+  unsigned int self = GPOINTER_TO_UINT(data);
+  unsigned long seen = 0;
+
+  g_mutex_lock(&work_lock);
+  for (;;) {
+    while (work_gen == seen && !work_quit)
+      g_cond_wait(&work_start, &work_lock);
+    if (work_quit)
+      break;
+    seen = work_gen;
+    g_mutex_unlock(&work_lock);
+    work_run(self);
+    g_mutex_lock(&work_lock);
+    if (!--work_busy)
+      g_cond_signal(&work_done);
+  }
+  g_mutex_unlock(&work_lock);
+  return NULL;
+}
+
+/* Returns the number of threads that run a job */
+unsigned int count_workers(void)
+{
+  return work_n;
+}
+
+/* Run fn(task, arg) for every task below tasks, spread over the threads, and
+ * return once all of them are done. Tasks may run in any order, and at the
+ * same time as each other. */
+void run_workers(size_t tasks, void (*fn)(size_t task, void *arg), void *arg)
+{
+  unsigned int i;
+  size_t task;
+
+  /* Too little to share out, or too much to count in a range */
+  if (work_n == 1 || tasks < 2 || tasks > UINT32_MAX) {
+    for (task = 0; task < tasks; task++)
+      fn(task, arg);
+    return;
+  }
+  for (i = 0; i < work_n; i++) {
+    work_ranges[i].tasks = WORK_RANGE(tasks * i / work_n, \
+      tasks * (i + 1) / work_n);
+  }
+  g_mutex_lock(&work_lock);
+  work_fn = fn;
+  work_arg = arg;
+  work_busy = work_n - 1;
+  work_gen++;
+  g_cond_broadcast(&work_start);
+  g_mutex_unlock(&work_lock);
+
+  work_run(0);
+
+  g_mutex_lock(&work_lock);
+  while (work_busy)
+    g_cond_wait(&work_done, &work_lock);
+  g_mutex_unlock(&work_lock);
+}
+
+/* Stop and join every worker thread. Threads that exit hand back the objects
+ * they cached from pools, so this comes before the pools are shut down. */
+void shutdown_workers(void)
+{
+  unsigned int i;
+
+  g_mutex_lock(&work_lock);
+  work_quit = TRUE;
+  g_cond_broadcast(&work_start);
+  g_mutex_unlock(&work_lock);
+  for (i = 1; i < work_n; i++)
+    g_thread_join(work_threads[i]);
+  work_n = 1;
+  work_quit = FALSE;
+}
+
+/* Start a thread per processor, beside the simulator thread. Short of
+ * threads, jobs run on those that started. Returns -1 on failure (to start
+ * any), 0 on success */
+int init_workers(void)
+{
+  unsigned int i, n = MIN(g_get_num_processors(), WORK_MAX_THREADS);
+  GError *error = NULL;
+
+  for (work_n = 1; work_n < n; work_n++) {
+    i = work_n;
+    work_threads[i] = g_thread_try_new("worker", &work_thread, \
+      GUINT_TO_POINTER(i), &error);
+    if (!work_threads[i]) {
+      fprintf(stderr, "Error creating worker thread: %s\n", error->message);
+      g_error_free(error);
+      break;
+    }
+  }
+  return (work_n > 1 || n == 1) ? 0 : -1;
+}